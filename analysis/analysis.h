@@ -0,0 +1,356 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../disassembler/disassembler.h"
+#include "../romset/romset.h"
+
+/* Recursive descent code/data analysis of a ROM image.
+
+Starting from the entry points (reset and interrupt vectors) every reachable
+instruction is decoded by following jumps, calls and restarts. Bytes never
+reached are treated as data. Reachable code is split into basic blocks and
+the result can be saved to a file and loaded back by a later tool run,
+which then doesn't repeat the analysis. Only disassembler_test.c uses it
+so far; the emulator's idle loop analysis reads the code directly. */
+
+// Per byte classification in CodeMap.map
+#define MAP_DATA         0x00       // never reached: data (or code only reached indirectly)
+#define MAP_OPCODE       0x01       // first byte of an instruction
+#define MAP_OPERAND      0x02       // operand byte of an instruction
+#define MAP_LEADER       0x80       // flag: a basic block starts here
+
+// How a basic block ends
+#define EXIT_FALLTHROUGH  0         // runs into the next block
+#define EXIT_JUMP         1         // unconditional jump to target
+#define EXIT_BRANCH       2         // conditional jump to target, else next
+#define EXIT_CALL         3         // call (or RST) to target, returns to next
+#define EXIT_RETURN       4         // RET, conditional returns continue at next
+#define EXIT_INDIRECT     5         // PCHL, target unknown
+#define EXIT_HALT         6
+#define EXIT_END          7         // runs off the end of the image
+
+#define CODEMAP_MAGIC    "8080MAP"
+#define CODEMAP_VERSION  1
+
+typedef struct BasicBlock {
+    uint16_t    start;          // address of the first instruction
+    uint16_t    length;         // in bytes
+    uint16_t    instructions;
+    uint8_t     exit;           // EXIT_*
+    uint8_t     conditional;    // exit is taken only on a condition
+    uint16_t    target;         // jump/call target, valid for EXIT_JUMP/BRANCH/CALL
+    uint16_t    next;           // address following the block
+} BasicBlock;
+
+typedef struct CodeMap {
+    uint16_t    base;           // address of the first byte of the image
+    uint32_t    size;           // image size in bytes
+    uint32_t    crc32;          // of the analysed image, to detect a stale map
+    uint8_t     *map;           // size entries of MAP_* flags
+    int         block_count;
+    int         block_capacity;
+    BasicBlock  *blocks;        // sorted by start address
+} CodeMap;
+
+#define INVADERS_ENTRY_COUNT  3
+
+#ifndef CORE8080_LIBRARY
+
+// Space Invaders enters at reset and the two RST interrupt vectors
+const uint16_t INVADERS_ENTRY_POINTS[INVADERS_ENTRY_COUNT] = { 0x0000, 0x0008, 0x0010 };
+
+int FlowExit(const Instruction *ins) {
+    // Classifies how an instruction affects control flow
+    switch (OPCODE_INFO[ins->opcode].flow & ~FLOW_CONDITIONAL) {
+        case FLOW_JUMP: return (OPCODE_INFO[ins->opcode].flow & FLOW_CONDITIONAL) ? EXIT_BRANCH : EXIT_JUMP;
+        case FLOW_CALL:
+        case FLOW_RST: return EXIT_CALL;
+        case FLOW_RETURN: return EXIT_RETURN;
+        case FLOW_INDIRECT: return EXIT_INDIRECT;
+        case FLOW_HALT: return EXIT_HALT;
+    }
+    return EXIT_FALLTHROUGH;
+}
+
+int FlowIsConditional(const Instruction *ins) {
+    // Conditional jumps/calls/returns may continue with the next instruction
+    return (OPCODE_INFO[ins->opcode].flow & FLOW_CONDITIONAL) != 0;
+}
+
+uint16_t FlowTarget(const Instruction *ins) {
+    if (OPCODE_INFO[ins->opcode].flow == FLOW_RST) {
+        return ins->data << 3;
+    }
+    return ins->data;
+}
+
+static inline int InImage(const CodeMap *cm, uint32_t addr) {
+    return addr >= cm->base && addr < (uint32_t)cm->base + cm->size;
+}
+
+void FreeCodeMap(CodeMap *cm) {
+    free(cm->map);
+    free(cm->blocks);
+    memset(cm, 0, sizeof(CodeMap));
+}
+
+void AddBlock(CodeMap *cm, const BasicBlock *block) {
+    if (cm->block_count == cm->block_capacity) {
+        cm->block_capacity = cm->block_capacity ? cm->block_capacity * 2 : 256;
+        cm->blocks = realloc(cm->blocks, cm->block_capacity * sizeof(BasicBlock));
+    }
+    cm->blocks[cm->block_count++] = *block;
+}
+
+void BuildBlocks(CodeMap *cm, const uint8_t *image) {
+    // Splits the decoded code into basic blocks at leaders and control transfers
+    uint32_t offset = 0;
+    cm->block_count = 0;
+
+    while (offset < cm->size) {
+        if (!(cm->map[offset] & MAP_OPCODE)) {
+            offset++;
+            continue;
+        }
+
+        BasicBlock block = { cm->base + offset, 0, 0, EXIT_END, 0, 0, 0 };
+        Instruction ins;
+        uint8_t code[3];
+
+        for (;;) {
+            for (int i = 0; i < 3; i++) {
+                code[i] = offset + i < cm->size ? image[offset + i] : 0;
+            }
+            DecodeInstruction(code, cm->base + offset, &ins);
+            block.instructions++;
+            block.length += ins.length;
+            offset += ins.length;
+
+            int exit = FlowExit(&ins);
+            if (exit != EXIT_FALLTHROUGH) {
+                block.exit = exit;
+                block.conditional = FlowIsConditional(&ins);
+                block.target = FlowTarget(&ins);
+                break;
+            }
+            if (offset >= cm->size || !(cm->map[offset] & MAP_OPCODE)) {
+                block.exit = EXIT_END;
+                break;
+            }
+            if (cm->map[offset] & MAP_LEADER) {
+                block.exit = EXIT_FALLTHROUGH;
+                break;
+            }
+        }
+        block.next = block.start + block.length;
+        AddBlock(cm, &block);
+    }
+}
+
+int AnalyzeImage(CodeMap *cm, const uint8_t *image, uint32_t size, uint16_t base,
+                 const uint16_t *entries, int entry_count) {
+    // Recursive descent from the entry points. Returns the number of blocks.
+    memset(cm, 0, sizeof(CodeMap));
+    cm->base = base;
+    cm->size = size;
+    cm->crc32 = Crc32(image, size);
+    cm->map = calloc(size ? size : 1, 1);
+
+    // Explicit work list instead of recursion, every address is queued at most once as a leader
+    uint16_t *work = malloc(sizeof(uint16_t) * (size + entry_count));
+    int pending = 0;
+
+    for (int i = 0; i < entry_count; i++) {
+        if (InImage(cm, entries[i]) && !(cm->map[entries[i] - base] & MAP_LEADER)) {
+            cm->map[entries[i] - base] |= MAP_LEADER;
+            work[pending++] = entries[i];
+        }
+    }
+
+    while (pending > 0) {
+        uint32_t addr = work[--pending];
+
+        // Follow the straight line path until it ends or joins decoded code
+        while (InImage(cm, addr) && !(cm->map[addr - base] & (MAP_OPCODE | MAP_OPERAND))) {
+            uint32_t offset = addr - base;
+            uint8_t code[3];
+            Instruction ins;
+
+            for (int i = 0; i < 3; i++) {
+                code[i] = offset + i < size ? image[offset + i] : 0;
+            }
+            DecodeInstruction(code, addr, &ins);
+
+            cm->map[offset] |= MAP_OPCODE;
+            for (int i = 1; i < ins.length && offset + i < size; i++) {
+                cm->map[offset + i] |= MAP_OPERAND;
+            }
+            addr += ins.length;
+
+            int exit = FlowExit(&ins);
+            if (exit == EXIT_FALLTHROUGH) {
+                continue;
+            }
+
+            // Queue the target of jumps, calls and restarts
+            if (exit == EXIT_JUMP || exit == EXIT_BRANCH || exit == EXIT_CALL) {
+                uint16_t target = FlowTarget(&ins);
+                if (InImage(cm, target) && !(cm->map[target - base] & MAP_LEADER)) {
+                    cm->map[target - base] |= MAP_LEADER;
+                    work[pending++] = target;
+                }
+            }
+
+            // Calls are assumed to return, conditional transfers may fall through
+            if (exit == EXIT_CALL || FlowIsConditional(&ins)) {
+                if (InImage(cm, addr)) {
+                    cm->map[addr - base] |= MAP_LEADER;
+                }
+                continue;
+            }
+            break;
+        }
+
+        // Joining already decoded code starts a new block there
+        if (InImage(cm, addr) && (cm->map[addr - base] & MAP_OPCODE)) {
+            cm->map[addr - base] |= MAP_LEADER;
+        }
+    }
+    free(work);
+
+    BuildBlocks(cm, image);
+    return cm->block_count;
+}
+
+int FindBlock(const CodeMap *cm, uint16_t addr) {
+    // Binary search for the block starting at addr, -1 if there is none
+    int lo = 0;
+    int hi = cm->block_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cm->blocks[mid].start == addr) {
+            return mid;
+        }
+        if (cm->blocks[mid].start < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return -1;
+}
+
+static void Put16(FILE *f, uint16_t v) { fputc(v & 0xff, f); fputc(v >> 8, f); }
+static void Put32(FILE *f, uint32_t v) { Put16(f, v & 0xffff); Put16(f, v >> 16); }
+static uint16_t Get16(FILE *f) { uint16_t lo = fgetc(f) & 0xff; return lo | ((fgetc(f) & 0xff) << 8); }
+static uint32_t Get32(FILE *f) { uint32_t lo = Get16(f); return lo | ((uint32_t)Get16(f) << 16); }
+
+int SaveCodeMap(const CodeMap *cm, const char *filename) {
+    // Little endian: magic, version, base, size, crc32, map bytes, block count, blocks
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "error: Couldn't create %s\n", filename);
+        return -1;
+    }
+
+    fwrite(CODEMAP_MAGIC, 8, 1, f);
+    Put32(f, CODEMAP_VERSION);
+    Put16(f, cm->base);
+    Put32(f, cm->size);
+    Put32(f, cm->crc32);
+    fwrite(cm->map, cm->size, 1, f);
+    Put32(f, cm->block_count);
+    for (int i = 0; i < cm->block_count; i++) {
+        const BasicBlock *b = &cm->blocks[i];
+        Put16(f, b->start);
+        Put16(f, b->length);
+        Put16(f, b->instructions);
+        fputc(b->exit, f);
+        fputc(b->conditional, f);
+        Put16(f, b->target);
+        Put16(f, b->next);
+    }
+
+    int failed = ferror(f);
+    fclose(f);
+    return failed ? -1 : 0;
+}
+
+int LoadCodeMap(CodeMap *cm, const char *filename, uint32_t expected_crc32) {
+    // Loads a saved map. Returns -1 if it is missing, corrupt or was made
+    // from a different image (expected_crc32 != crc of the analysed image).
+    char magic[8];
+    memset(cm, 0, sizeof(CodeMap));
+
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+
+    if (fread(magic, 8, 1, f) != 1 || memcmp(magic, CODEMAP_MAGIC, 8) != 0 || Get32(f) != CODEMAP_VERSION) {
+        fclose(f);
+        return -1;
+    }
+
+    cm->base = Get16(f);
+    cm->size = Get32(f);
+    cm->crc32 = Get32(f);
+    if (cm->crc32 != expected_crc32 || cm->size == 0 || cm->size > 0x10000) {
+        fclose(f);
+        memset(cm, 0, sizeof(CodeMap));
+        return -1;
+    }
+
+    cm->map = malloc(cm->size);
+    if (fread(cm->map, cm->size, 1, f) != 1) {
+        fclose(f);
+        FreeCodeMap(cm);
+        return -1;
+    }
+
+    uint32_t count = Get32(f);
+    for (uint32_t i = 0; i < count && !feof(f); i++) {
+        BasicBlock b;
+        b.start = Get16(f);
+        b.length = Get16(f);
+        b.instructions = Get16(f);
+        b.exit = fgetc(f);
+        b.conditional = fgetc(f);
+        b.target = Get16(f);
+        b.next = Get16(f);
+        AddBlock(cm, &b);
+    }
+
+    int failed = feof(f) || (uint32_t)cm->block_count != count;
+    fclose(f);
+    if (failed) {
+        FreeCodeMap(cm);
+        return -1;
+    }
+    return 0;
+}
+
+#else
+
+// Compiled into libcore8080, see core/core8080.h
+extern const uint16_t INVADERS_ENTRY_POINTS[INVADERS_ENTRY_COUNT];
+int FlowExit(const Instruction *ins);
+int FlowIsConditional(const Instruction *ins);
+uint16_t FlowTarget(const Instruction *ins);
+void FreeCodeMap(CodeMap *cm);
+void AddBlock(CodeMap *cm, const BasicBlock *block);
+void BuildBlocks(CodeMap *cm, const uint8_t *image);
+int AnalyzeImage(CodeMap *cm, const uint8_t *image, uint32_t size, uint16_t base,
+                 const uint16_t *entries, int entry_count);
+int FindBlock(const CodeMap *cm, uint16_t addr);
+int SaveCodeMap(const CodeMap *cm, const char *filename);
+int LoadCodeMap(CodeMap *cm, const char *filename, uint32_t expected_crc32);
+
+#endif
+
+#endif
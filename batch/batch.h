@@ -0,0 +1,775 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../invaders/invaders.h"
+#include "../romset/romset.h"
+#include "../opcodes/opcodes.h"
+
+/* Lockstep interpreter for many machines at once.
+
+The registers and flags of up to BATCH_MAX_LANES machines are kept in
+structure of arrays form, one array per register with a lane per machine.
+Every step picks a leading lane, gathers all lanes sitting at the same ROM
+address into a mask and executes that one opcode for all of them. Register
+and flag work are branchless loops over the lane arrays with the mask
+blended into every store, which the compiler turns into SIMD: 16 lanes per
+instruction with SSE2, 32 with -mavx2. Memory accesses go lane by lane
+through each machine's own bus. Opcodes touching ports, interrupts or the
+flags register run on the scalar core for each lane of the group.
+
+Lanes that diverge form smaller groups and merge again at the next common
+loop or interrupt handler. Each lane executes exactly the instructions and
+cycles its machine would on its own, idle loops are skipped just like
+Run8080 does. Between frames the machines hold everything, so inputs,
+snapshots and video RAM are used as usual. */
+
+#define BATCH_MAX_LANES  64
+
+typedef struct Batch8080 {
+    int         count;
+    Invaders    *machines;
+    State8080   *cpu[BATCH_MAX_LANES];                  // CPU of each lane, its machine's
+    uint8_t     r[8][BATCH_MAX_LANES];                  // by REG_* index, r[REG_M] holds memory operands
+    uint8_t     z[BATCH_MAX_LANES];
+    uint8_t     s[BATCH_MAX_LANES];
+    uint8_t     p[BATCH_MAX_LANES];
+    uint8_t     cy[BATCH_MAX_LANES];
+    uint8_t     ac[BATCH_MAX_LANES];
+    uint8_t     halted[BATCH_MAX_LANES];
+    uint16_t    sp[BATCH_MAX_LANES];
+    uint16_t    pc[BATCH_MAX_LANES];
+    int32_t     cycles[BATCH_MAX_LANES];                // into the current frame
+    uint8_t     mask[BATCH_MAX_LANES];                  // 0xff for lanes in the current group
+    uint64_t    start[BATCH_MAX_LANES];                 // cpu.cycles at the start of the frame
+    uint8_t     plain[BATCH_MAX_LANES];                 // idle loops may be skipped, see BatchIdle
+    uint16_t    idle_branch[BATCH_MAX_LANES];           // loop being probed, 0 if none
+    uint16_t    idle_target[BATCH_MAX_LANES];
+    int32_t     idle_start[BATCH_MAX_LANES];
+    uint64_t    idle_regs[BATCH_MAX_LANES];
+    uint16_t    idle_sp[BATCH_MAX_LANES];
+    uint64_t    steps;                                  // statistics
+    uint64_t    instructions;
+    uint64_t    scalar;
+} Batch8080;
+
+Batch8080* BatchNew(const RomSet *roms, int count) {
+    // count machines at reset with the ROM set mapped, NULL if too many
+    if (count < 1 || count > BATCH_MAX_LANES) {
+        fprintf(stderr, "error: a batch runs 1 to %d machines\n", BATCH_MAX_LANES);
+        return NULL;
+    }
+    Batch8080 *b = calloc(1, sizeof(Batch8080));
+    b->count = count;
+    b->machines = malloc(count * sizeof(Invaders));
+    for (int i = 0; i < count; i++) {
+        InvadersInit(&b->machines[i]);
+        BusMapRomSet(&b->machines[i].bus, roms);
+        b->cpu[i] = &b->machines[i].cpu;
+    }
+    return b;
+}
+
+Invaders* BatchMachine(Batch8080 *b, int lane) {
+    return &b->machines[lane];
+}
+
+static void BatchLoadLane(Batch8080 *b, int i) {
+    State8080 *cpu = b->cpu[i];
+    b->r[REG_B][i] = cpu->b;
+    b->r[REG_C][i] = cpu->c;
+    b->r[REG_D][i] = cpu->d;
+    b->r[REG_E][i] = cpu->e;
+    b->r[REG_H][i] = cpu->h;
+    b->r[REG_L][i] = cpu->l;
+    b->r[REG_A][i] = cpu->a;
+    b->z[i] = cpu->cc.z;
+    b->s[i] = cpu->cc.s;
+    b->p[i] = cpu->cc.p;
+    b->cy[i] = cpu->cc.cy;
+    b->ac[i] = cpu->cc.ac;
+    b->sp[i] = cpu->sp;
+    b->pc[i] = cpu->pc;
+    b->halted[i] = cpu->halted;
+}
+
+static void BatchStoreLane(Batch8080 *b, int i) {
+    State8080 *cpu = b->cpu[i];
+    cpu->b = b->r[REG_B][i];
+    cpu->c = b->r[REG_C][i];
+    cpu->d = b->r[REG_D][i];
+    cpu->e = b->r[REG_E][i];
+    cpu->h = b->r[REG_H][i];
+    cpu->l = b->r[REG_L][i];
+    cpu->a = b->r[REG_A][i];
+    cpu->cc.z = b->z[i];
+    cpu->cc.s = b->s[i];
+    cpu->cc.p = b->p[i];
+    cpu->cc.cy = b->cy[i];
+    cpu->cc.ac = b->ac[i];
+    cpu->sp = b->sp[i];
+    cpu->pc = b->pc[i];
+    cpu->halted = b->halted[i];
+    cpu->cycles = b->start[i] + b->cycles[i];   // OUT handlers time sounds by it
+}
+
+static inline uint8_t BatchParity(uint8_t v) {
+    // 1 for even parity, like ParityCheck
+    v ^= v >> 4;
+    v ^= v >> 2;
+    v ^= v >> 1;
+    return ~v & 1;
+}
+
+static inline uint8_t BatchSelect(uint8_t m, uint8_t x, uint8_t y) {
+    // x in lanes of the group, y elsewhere, without a branch
+    return (x & m) | (y & ~m);
+}
+
+static inline uint16_t BatchSelect16(uint8_t m, uint16_t x, uint16_t y) {
+    uint16_t m16 = (int8_t)m;
+    return (x & m16) | (y & ~m16);
+}
+
+static inline void BatchZSP(Batch8080 *b, int i, uint8_t m, uint8_t v) {
+    b->z[i] = BatchSelect(m, v == 0, b->z[i]);
+    b->s[i] = BatchSelect(m, v >> 7, b->s[i]);
+    b->p[i] = BatchSelect(m, BatchParity(v), b->p[i]);
+}
+
+static void BatchCycles(Batch8080 *b, int n) {
+    for (int i = 0; i < BATCH_MAX_LANES; i++) {
+        b->cycles[i] += n & (int8_t)b->mask[i];
+    }
+}
+
+static void BatchAdvance(Batch8080 *b, int length) {
+    for (int i = 0; i < BATCH_MAX_LANES; i++) {
+        b->pc[i] += length & (int8_t)b->mask[i];
+    }
+}
+
+static void BatchGather(Batch8080 *b, const uint8_t *hi, const uint8_t *lo) {
+    // Memory operand at hi:lo of every lane in the group into r[REG_M]
+    for (int i = 0; i < b->count; i++) {
+        if (b->mask[i]) {
+            b->r[REG_M][i] = BusRead(b->cpu[i]->bus, hi[i] << 8 | lo[i]);
+        }
+    }
+}
+
+static void BatchScatter(Batch8080 *b, const uint8_t *hi, const uint8_t *lo, const uint8_t *value) {
+    for (int i = 0; i < b->count; i++) {
+        if (b->mask[i]) {
+            BusWrite(b->cpu[i]->bus, hi[i] << 8 | lo[i], value[i]);
+        }
+    }
+}
+
+/* The kernels below run over all BATCH_MAX_LANES lanes with the group mask
+blended into every store. Registers picked by the opcode are copied to and
+from r[REG_M] so the arithmetic only ever sees arrays at fixed
+offsets, which the compiler can vectorize without alias checks. */
+
+static void BatchFillKernel(uint8_t *restrict d, const uint8_t *restrict mask, uint8_t value) {
+    for (int i = 0; i < BATCH_MAX_LANES; i++) {
+        d[i] = BatchSelect(mask[i], value, d[i]);
+    }
+}
+
+static void BatchMoveKernel(uint8_t *restrict d, const uint8_t *restrict v, const uint8_t *restrict mask) {
+    for (int i = 0; i < BATCH_MAX_LANES; i++) {
+        d[i] = BatchSelect(mask[i], v[i], d[i]);
+    }
+}
+
+static void BatchFill(Batch8080 *b, int reg, uint8_t value) {
+    BatchFillKernel(b->r[reg], b->mask, value);
+}
+
+static void BatchMove(Batch8080 *b, int dst, int src) {
+    if (dst != src) {
+        BatchMoveKernel(b->r[dst], b->r[src], b->mask);
+    }
+}
+
+static void BatchIncrement(Batch8080 *b, int reg, uint8_t delta) {
+    // INR / DCR, delta 1 or 0xff
+    BatchMove(b, REG_M, reg);
+    uint8_t *r = b->r[REG_M];
+    for (int i = 0; i < BATCH_MAX_LANES; i++) {
+        uint8_t m = b->mask[i];
+        uint8_t v = r[i] + delta;
+        r[i] = BatchSelect(m, v, r[i]);
+        uint8_t ac = delta == 1 ? (v & 0x0f) == 0 : (v & 0x0f) != 0x0f;
+        b->ac[i] = BatchSelect(m, ac, b->ac[i]);
+        BatchZSP(b, i, m, v);
+    }
+    BatchMove(b, reg, REG_M);
+}
+
+static inline void BatchALULane(Batch8080 *b, int i, int op) {
+    // Same results as Arithmetic, AND, XOR, ORA and CMP
+    uint8_t m = b->mask[i];
+    uint8_t a = b->r[REG_A][i];
+    uint8_t v = b->r[REG_M][i];
+    uint8_t cy = (op == 1 || op == 3) & b->cy[i];
+    uint16_t wide;
+    uint8_t result, carry, ac;
+    switch (op) {
+        case 0: case 1:     // ADD, ADC
+            wide = a + v + cy;
+            result = wide;
+            carry = wide > 0xff;
+            ac = ((a ^ v ^ result) & 0x10) != 0;
+            break;
+        case 2: case 3:     // SUB, SBB
+        case 7:             // CMP
+            wide = a - v - cy;
+            result = wide;
+            carry = wide > 0xff;
+            ac = ((a ^ v ^ result) & 0x10) == 0;
+            break;
+        case 4:             // ANA
+            result = a & v;
+            carry = 0;
+            ac = ((a | v) & 0x08) != 0;
+            break;
+        case 5:             // XRA
+            result = a ^ v;
+            carry = 0;
+            ac = 0;
+            break;
+        default:            // ORA
+            result = a | v;
+            carry = 0;
+            ac = 0;
+            break;
+    }
+    if (op != 7) {
+        b->r[REG_A][i] = BatchSelect(m, result, a);
+    }
+    b->cy[i] = BatchSelect(m, carry, b->cy[i]);
+    b->ac[i] = BatchSelect(m, ac, b->ac[i]);
+    BatchZSP(b, i, m, result);
+}
+
+static void BatchALU(Batch8080 *b, int op, int src) {
+    // One loop per operation so each is straight line code
+    BatchMove(b, REG_M, src);
+    switch (op) {
+        case 0: for (int i = 0; i < BATCH_MAX_LANES; i++) BatchALULane(b, i, 0); break;
+        case 1: for (int i = 0; i < BATCH_MAX_LANES; i++) BatchALULane(b, i, 1); break;
+        case 2: for (int i = 0; i < BATCH_MAX_LANES; i++) BatchALULane(b, i, 2); break;
+        case 3: for (int i = 0; i < BATCH_MAX_LANES; i++) BatchALULane(b, i, 3); break;
+        case 4: for (int i = 0; i < BATCH_MAX_LANES; i++) BatchALULane(b, i, 4); break;
+        case 5: for (int i = 0; i < BATCH_MAX_LANES; i++) BatchALULane(b, i, 5); break;
+        case 6: for (int i = 0; i < BATCH_MAX_LANES; i++) BatchALULane(b, i, 6); break;
+        default: for (int i = 0; i < BATCH_MAX_LANES; i++) BatchALULane(b, i, 7); break;
+    }
+}
+
+static void BatchPairKernel(uint8_t *restrict h, uint8_t *restrict l, const uint8_t *restrict mask, uint8_t delta) {
+    // INX / DCX, delta 1 or 0xff (-1)
+    uint8_t wrap = delta == 1 ? 0 : 0xff;
+    for (int i = 0; i < BATCH_MAX_LANES; i++) {
+        uint8_t m = mask[i];
+        uint8_t low = l[i] + delta;
+        h[i] += delta & -(low == wrap) & m;
+        l[i] = BatchSelect(m, low, l[i]);
+    }
+}
+
+static void BatchDADKernel(uint8_t *restrict h, uint8_t *restrict l, const uint16_t *restrict rp,
+                           uint8_t *restrict cy, const uint8_t *restrict mask) {
+    // HL += rp, carry out of bit 15
+    for (int i = 0; i < BATCH_MAX_LANES; i++) {
+        uint8_t m = mask[i];
+        uint16_t hl = h[i] << 8 | l[i];
+        uint16_t v = hl + rp[i];
+        h[i] = BatchSelect(m, v >> 8, h[i]);
+        l[i] = BatchSelect(m, v & 0xff, l[i]);
+        cy[i] = BatchSelect(m, v < hl, cy[i]);
+    }
+}
+
+static inline void BatchRotateLane(Batch8080 *b, int i, int kind) {
+    uint8_t m = b->mask[i];
+    uint8_t v = b->r[REG_A][i], c = b->cy[i];
+    uint8_t result, carry;
+    switch (kind) {
+        case 0:  result = v << 1 | v >> 7; carry = v >> 7; break;
+        case 1:  result = v >> 1 | v << 7; carry = v & 1; break;
+        case 2:  result = v << 1 | c; carry = v >> 7; break;
+        default: result = v >> 1 | c << 7; carry = v & 1; break;
+    }
+    b->r[REG_A][i] = BatchSelect(m, result, v);
+    b->cy[i] = BatchSelect(m, carry, c);
+}
+
+static void BatchJumpKernel(uint16_t *restrict pc, const uint8_t *restrict flag, const uint8_t *restrict mask,
+                            uint8_t want, uint8_t always, uint16_t target) {
+    // Lanes jump when flag equals want or always is 0xff, the others skip the address
+    for (int i = 0; i < BATCH_MAX_LANES; i++) {
+        uint8_t m = mask[i];
+        uint8_t jump = m & (always | -(flag[i] == want));
+        pc[i] = BatchSelect16(jump, target, pc[i] + (2 & (int8_t)m));
+    }
+}
+
+static void BatchPairAdd(Batch8080 *b, int pair, uint8_t delta) {
+    // INX / DCX of BC, DE or HL
+    BatchPairKernel(b->r[pair * 2], b->r[pair * 2 + 1], b->mask, delta);
+}
+
+static void BatchDAD(Batch8080 *b, int pair) {
+    // pair 0-3 is BC, DE, HL, SP
+    uint16_t rp[BATCH_MAX_LANES];
+    for (int i = 0; i < BATCH_MAX_LANES; i++) {
+        rp[i] = pair == 3 ? b->sp[i] : b->r[pair * 2][i] << 8 | b->r[pair * 2 + 1][i];
+    }
+    BatchDADKernel(b->r[REG_H], b->r[REG_L], rp, b->cy, b->mask);
+}
+
+static void BatchRotate(Batch8080 *b, int kind) {
+    // RLC, RRC, RAL, RAR
+    switch (kind) {
+        case 0: for (int i = 0; i < BATCH_MAX_LANES; i++) BatchRotateLane(b, i, 0); break;
+        case 1: for (int i = 0; i < BATCH_MAX_LANES; i++) BatchRotateLane(b, i, 1); break;
+        case 2: for (int i = 0; i < BATCH_MAX_LANES; i++) BatchRotateLane(b, i, 2); break;
+        default: for (int i = 0; i < BATCH_MAX_LANES; i++) BatchRotateLane(b, i, 3); break;
+    }
+}
+
+static const uint8_t* BatchConditionFlag(const Batch8080 *b, uint8_t opcode) {
+    // Flag tested by Jcc/Ccc/Rcc, the condition holds when it equals bit 3
+    static const size_t flags[4] = {
+        offsetof(Batch8080, z), offsetof(Batch8080, cy), offsetof(Batch8080, p), offsetof(Batch8080, s)
+    };
+    return (const uint8_t *)b + flags[(opcode >> 4) & 3];
+}
+
+static inline uint8_t BatchCondition(const Batch8080 *b, int i, uint8_t opcode) {
+    // ConditionMet for lane i
+    return BatchConditionFlag(b, opcode)[i] == ((opcode >> 3) & 1);
+}
+
+static void BatchJump(Batch8080 *b, uint8_t opcode, uint16_t target) {
+    // JMP and Jcc, pc already points past the opcode
+    BatchJumpKernel(b->pc, BatchConditionFlag(b, opcode), b->mask, (opcode >> 3) & 1,
+                    opcode == 0xc3 ? 0xff : 0, target);
+}
+
+static void BatchPush(Batch8080 *b, int i, uint16_t value) {
+    MemoryBus *bus = b->cpu[i]->bus;
+    BusWrite(bus, b->sp[i] - 1, value >> 8);
+    BusWrite(bus, b->sp[i] - 2, value & 0xff);
+    b->sp[i] -= 2;
+}
+
+static uint16_t BatchPop(Batch8080 *b, int i) {
+    MemoryBus *bus = b->cpu[i]->bus;
+    uint16_t value = BusRead(bus, b->sp[i]) | BusRead(bus, b->sp[i] + 1) << 8;
+    b->sp[i] += 2;
+    return value;
+}
+
+static void BatchScalar(Batch8080 *b, int i, int until) {
+    // One instruction of lane i on the machine's own CPU
+    BatchStoreLane(b, i);
+    b->cycles[i] += Emulate8080(b->cpu[i]);
+    BatchLoadLane(b, i);
+    if (b->halted[i] && b->cycles[i] < until) {
+        b->cycles[i] = until;       // as Run8080, asleep until the interrupt
+    }
+    b->scalar++;
+}
+
+static int BatchExecute(Batch8080 *b, uint8_t opcode, const uint8_t *code) {
+    // Runs opcode for the lanes in the mask, pc already advanced past the
+    // opcode byte. Returns 0 if the opcode needs the scalar core.
+    int dst = (opcode >> 3) & 7;
+    int src = opcode & 7;
+    int pair = (opcode >> 4) & 3;                                   // BC, DE, HL, SP / PSW
+    uint16_t address = code[2] << 8 | code[1];
+
+    if (opcode >= 0x40 && opcode < 0x80 && opcode != 0x76) {       // MOV
+        if (src == REG_M) {
+            BatchGather(b, b->r[REG_H], b->r[REG_L]);
+        }
+        if (dst == REG_M) {
+            BatchScatter(b, b->r[REG_H], b->r[REG_L], b->r[src]);
+        } else {
+            BatchMove(b, dst, src);
+        }
+        return 1;
+    }
+    if (opcode >= 0x80 && opcode < 0xc0) {                         // ALU register
+        if (src == REG_M) {
+            BatchGather(b, b->r[REG_H], b->r[REG_L]);
+        }
+        BatchALU(b, dst, src);
+        return 1;
+    }
+
+    switch (opcode) {
+        case 0x00:                                                  // NOP
+            return 1;
+        case 0x01: case 0x11: case 0x21:                            // LXI
+            BatchFill(b, pair * 2, code[2]);
+            BatchFill(b, pair * 2 + 1, code[1]);
+            BatchAdvance(b, 2);
+            return 1;
+        case 0x31:                                                  // LXI SP
+            for (int i = 0; i < BATCH_MAX_LANES; i++) {
+                b->sp[i] = BatchSelect16(b->mask[i], address, b->sp[i]);
+            }
+            BatchAdvance(b, 2);
+            return 1;
+        case 0x03: case 0x13: case 0x23:                            // INX
+            BatchPairAdd(b, pair, 1);
+            return 1;
+        case 0x0b: case 0x1b: case 0x2b:                            // DCX
+            BatchPairAdd(b, pair, 0xff);
+            return 1;
+        case 0x33: case 0x3b:                                       // INX SP, DCX SP
+            for (int i = 0; i < BATCH_MAX_LANES; i++) {
+                b->sp[i] += (opcode == 0x33 ? 1 : 0xffff) & (int8_t)b->mask[i];
+            }
+            return 1;
+        case 0x09: case 0x19: case 0x29: case 0x39:                 // DAD
+            BatchDAD(b, pair);
+            return 1;
+        case 0x04: case 0x0c: case 0x14: case 0x1c:                 // INR
+        case 0x24: case 0x2c: case 0x34: case 0x3c:
+        case 0x05: case 0x0d: case 0x15: case 0x1d:                 // DCR
+        case 0x25: case 0x2d: case 0x35: case 0x3d:
+            if (dst == REG_M) {
+                BatchGather(b, b->r[REG_H], b->r[REG_L]);
+            }
+            BatchIncrement(b, dst, opcode & 1 ? 0xff : 1);
+            if (dst == REG_M) {
+                BatchScatter(b, b->r[REG_H], b->r[REG_L], b->r[REG_M]);
+            }
+            return 1;
+        case 0x06: case 0x0e: case 0x16: case 0x1e:                 // MVI
+        case 0x26: case 0x2e: case 0x36: case 0x3e:
+            BatchFill(b, dst, code[1]);
+            if (dst == REG_M) {
+                BatchScatter(b, b->r[REG_H], b->r[REG_L], b->r[REG_M]);
+            }
+            BatchAdvance(b, 1);
+            return 1;
+        case 0x07: case 0x0f: case 0x17: case 0x1f:                 // RLC, RRC, RAL, RAR
+            BatchRotate(b, dst);
+            return 1;
+        case 0x2f:                                                  // CMA
+            for (int i = 0; i < BATCH_MAX_LANES; i++) {
+                b->r[REG_A][i] ^= b->mask[i];
+            }
+            return 1;
+        case 0x37: case 0x3f:                                       // STC, CMC
+            for (int i = 0; i < BATCH_MAX_LANES; i++) {
+                b->cy[i] = BatchSelect(b->mask[i], opcode == 0x37 || !b->cy[i], b->cy[i]);
+            }
+            return 1;
+        case 0x02: case 0x12:                                       // STAX
+            BatchScatter(b, b->r[pair * 2], b->r[pair * 2 + 1], b->r[REG_A]);
+            return 1;
+        case 0x0a: case 0x1a:                                       // LDAX
+            BatchGather(b, b->r[pair * 2], b->r[pair * 2 + 1]);
+            BatchMove(b, REG_A, REG_M);
+            return 1;
+        case 0x32:                                                  // STA
+            for (int i = 0; i < b->count; i++) {
+                if (b->mask[i]) {
+                    BusWrite(b->cpu[i]->bus, address, b->r[REG_A][i]);
+                }
+            }
+            BatchAdvance(b, 2);
+            return 1;
+        case 0x3a:                                                  // LDA
+            for (int i = 0; i < b->count; i++) {
+                if (b->mask[i]) {
+                    b->r[REG_A][i] = BusRead(b->cpu[i]->bus, address);
+                }
+            }
+            BatchAdvance(b, 2);
+            return 1;
+        case 0xc6: case 0xce: case 0xd6: case 0xde:                 // ALU immediate
+        case 0xe6: case 0xee: case 0xf6: case 0xfe:
+            BatchFill(b, REG_M, code[1]);
+            BatchALU(b, dst, REG_M);
+            BatchAdvance(b, 1);
+            return 1;
+        case 0xeb:                                                  // XCHG
+            for (int i = 0; i < BATCH_MAX_LANES; i++) {
+                uint8_t m = b->mask[i];
+                uint8_t d = b->r[REG_D][i], e = b->r[REG_E][i];
+                uint8_t h = b->r[REG_H][i], l = b->r[REG_L][i];
+                b->r[REG_D][i] = BatchSelect(m, h, d);
+                b->r[REG_E][i] = BatchSelect(m, l, e);
+                b->r[REG_H][i] = BatchSelect(m, d, h);
+                b->r[REG_L][i] = BatchSelect(m, e, l);
+            }
+            return 1;
+        case 0xc3:                                                  // JMP
+        case 0xc2: case 0xca: case 0xd2: case 0xda:                 // Jcc
+        case 0xe2: case 0xea: case 0xf2: case 0xfa:
+            BatchJump(b, opcode, address);
+            return 1;
+        case 0xcd:                                                  // CALL
+        case 0xc4: case 0xcc: case 0xd4: case 0xdc:                 // Ccc
+        case 0xe4: case 0xec: case 0xf4: case 0xfc:
+            for (int i = 0; i < b->count; i++) {
+                if (b->mask[i]) {
+                    if (opcode == 0xcd || BatchCondition(b, i, opcode)) {
+                        BatchPush(b, i, b->pc[i] + 2);
+                        b->pc[i] = address;
+                    } else {
+                        b->pc[i] += 2;
+                    }
+                }
+            }
+            return 1;
+        case 0xc9:                                                  // RET
+        case 0xc0: case 0xc8: case 0xd0: case 0xd8:                 // Rcc
+        case 0xe0: case 0xe8: case 0xf0: case 0xf8:
+            for (int i = 0; i < b->count; i++) {
+                if (b->mask[i] && (opcode == 0xc9 || BatchCondition(b, i, opcode))) {
+                    b->pc[i] = BatchPop(b, i);
+                }
+            }
+            return 1;
+        case 0xc5: case 0xd5: case 0xe5:                            // PUSH
+            for (int i = 0; i < b->count; i++) {
+                if (b->mask[i]) {
+                    BatchPush(b, i, b->r[pair * 2][i] << 8 | b->r[pair * 2 + 1][i]);
+                }
+            }
+            return 1;
+        case 0xc1: case 0xd1: case 0xe1:                            // POP
+            for (int i = 0; i < b->count; i++) {
+                if (b->mask[i]) {
+                    uint16_t v = BatchPop(b, i);
+                    b->r[pair * 2][i] = v >> 8;
+                    b->r[pair * 2 + 1][i] = v & 0xff;
+                }
+            }
+            return 1;
+    }
+    return 0;
+}
+
+static uint64_t BatchRegisters(const Batch8080 *b, int i) {
+    // Everything an idle loop iteration could change but sp, packed for
+    // comparing. Seven registers and five flags fill 61 bits.
+    uint64_t regs = 0;
+    for (int r = 0; r < 8; r++) {
+        if (r != REG_M) {
+            regs = regs << 8 | b->r[r][i];
+        }
+    }
+    return regs << 5 | b->z[i] | b->s[i] << 1 | b->p[i] << 2 | b->cy[i] << 3 | b->ac[i] << 4;
+}
+
+static void BatchIdle(Batch8080 *b, uint16_t branch, int until) {
+    // Idle loop skipping as in Run8080, without stopping the group. When a
+    // short backward jump at branch is taken the lane starts a probe, the
+    // next time it comes around the loop the registers are compared and if
+    // nothing changed whole iterations are skipped up to until.
+    int verdict = IDLE_UNKNOWN;
+    for (int i = 0; i < b->count; i++) {
+        if (!b->mask[i] || !b->plain[i]) {
+            continue;
+        }
+        uint16_t target = b->pc[i];
+        if (target >= branch || branch - target > IDLE_LOOP_MAX) {
+            b->idle_branch[i] = 0;      // left the loop
+            continue;
+        }
+        uint64_t regs = BatchRegisters(b, i);
+        if (b->idle_branch[i] == branch && b->idle_target[i] == target) {
+            if (regs == b->idle_regs[i] && b->sp[i] == b->idle_sp[i] && b->cycles[i] < until) {
+                int32_t period = b->cycles[i] - b->idle_start[i];
+                int32_t skipped = (until - b->cycles[i]) / period * period;
+                b->cycles[i] += skipped;
+                b->cpu[i]->idle_cycles += skipped;
+                b->idle_branch[i] = 0;
+                continue;
+            }
+        } else {
+            if (verdict == IDLE_UNKNOWN) {
+                verdict = IdleLoopVerdict(b->cpu[i], target, branch);
+            }
+            if (verdict != IDLE_PURE) {
+                continue;
+            }
+        }
+        b->idle_branch[i] = branch;
+        b->idle_target[i] = target;
+        b->idle_regs[i] = regs;
+        b->idle_sp[i] = b->sp[i];
+        b->idle_start[i] = b->cycles[i];
+    }
+}
+
+static void BatchGroup(Batch8080 *b, uint16_t pc, int until) {
+    // One step: the opcode at pc for every lane there short of until
+    MemoryBus *bus = b->cpu[0]->bus;
+    uint8_t code[3] = { BusRead(bus, pc), BusRead(bus, pc + 1), BusRead(bus, pc + 2) };
+    const OpcodeInfo *info = &OPCODE_INFO[code[0]];
+    int grouped = 0;
+    for (int i = 0; i < BATCH_MAX_LANES; i++) {
+        b->mask[i] = -((b->pc[i] == pc) & (b->cycles[i] < until));
+        grouped += b->mask[i] & 1;
+    }
+
+    // Conditional calls and returns are cheaper when not taken, the
+    // condition holds before and after
+    uint8_t taken[BATCH_MAX_LANES];
+    if (info->flow & FLOW_CONDITIONAL) {
+        for (int i = 0; i < BATCH_MAX_LANES; i++) {
+            taken[i] = BatchCondition(b, i, code[0]);
+        }
+    }
+    BatchAdvance(b, 1);
+    if (BatchExecute(b, code[0], code)) {
+        if (info->flow & FLOW_CONDITIONAL) {
+            for (int i = 0; i < BATCH_MAX_LANES; i++) {
+                b->cycles[i] += (taken[i] ? info->cycles : info->cycles_not_taken) & (int8_t)b->mask[i];
+            }
+        } else {
+            BatchCycles(b, info->cycles);
+        }
+        b->steps++;
+        b->instructions += grouped;
+        uint16_t target = code[2] << 8 | code[1];
+        if ((info->flow & ~FLOW_CONDITIONAL) == FLOW_JUMP && target < pc && pc - target <= IDLE_LOOP_MAX) {
+            BatchIdle(b, pc, until);
+        }
+    } else {
+        for (int i = 0; i < b->count; i++) {
+            if (b->mask[i]) {
+                b->pc[i]--;
+                BatchScalar(b, i, until);
+            }
+        }
+    }
+}
+
+static void BatchRun(Batch8080 *b, int until) {
+    // Runs every lane until its frame cycle count reaches until
+    for (int i = 0; i < b->count; i++) {
+        if (b->halted[i] && b->cycles[i] < until) {
+            b->cycles[i] = until;
+        }
+        b->idle_branch[i] = 0;
+    }
+    for (;;) {
+        // The lane at the highest address leads. Loops and returns jump
+        // back down, so lanes getting there first wait for the others.
+        int32_t lead = -1;
+        for (int i = 0; i < BATCH_MAX_LANES; i++) {
+            int32_t key = b->cycles[i] < until ? b->pc[i] : -1;
+            lead = key > lead ? key : lead;
+        }
+        if (lead < 0) {
+            return;
+        }
+        uint16_t pc = lead;
+        MemoryBus *bus = b->cpu[0]->bus;       // all machines have the same ROM
+        if (bus->attr[pc >> PAGE_SHIFT] != PAGE_ROM || bus->attr[(uint16_t)(pc + 2) >> PAGE_SHIFT] != PAGE_ROM) {
+            // Code outside ROM may differ between machines
+            for (int i = 0; i < b->count; i++) {
+                if (b->pc[i] == pc && b->cycles[i] < until) {
+                    BatchScalar(b, i, until);
+                }
+            }
+            continue;
+        }
+        BatchGroup(b, pc, until);
+    }
+}
+
+static int BatchPlain(const Invaders *m) {
+    // Same conditions as SkipIdleLoop: not strict, not traced and no reads
+    // through handlers, which may change by themselves
+    if (m->cpu.strict || m->cpu.trace) {
+        return 0;
+    }
+    for (int i = 0; i < PAGE_COUNT; i++) {
+        if (m->bus.read[i] == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void BatchInterrupt(Batch8080 *b, int num) {
+    // InvadersInterrupt for every lane
+    for (int i = 0; i < b->count; i++) {
+        State8080 *cpu = b->cpu[i];
+        if (cpu->int_enable) {
+            BatchPush(b, i, b->pc[i]);
+            b->pc[i] = 8 * num;
+            cpu->int_enable = 0;
+            b->halted[i] = 0;
+        }
+    }
+}
+
+void BatchRunFrame(Batch8080 *b) {
+    // InvadersRunFrame on every machine
+    for (int i = 0; i < BATCH_MAX_LANES; i++) {
+        if (i < b->count) {
+            BatchLoadLane(b, i);
+            b->start[i] = b->machines[i].cpu.cycles;
+            b->cycles[i] = 0;
+            b->plain[i] = BatchPlain(&b->machines[i]);
+        } else {
+            b->cycles[i] = INT32_MAX;   // padding, never runs
+        }
+    }
+    BatchRun(b, INVADERS_CYCLES_PER_FRAME / 2);
+    BatchInterrupt(b, 1);
+    BatchRun(b, INVADERS_CYCLES_PER_FRAME);
+    BatchInterrupt(b, 2);
+    for (int i = 0; i < b->count; i++) {
+        BatchStoreLane(b, i);
+        b->machines[i].frames++;
+    }
+}
+
+void BatchFree(Batch8080 *b) {
+    free(b->machines);
+    free(b);
+}
+
+int BatchStep(State8080 *state) {
+    // One instruction of state on the lane kernels, a core for the lockstep
+    // harness. The batch has a single lane running state itself, code
+    // anywhere is grouped and idle loops are never skipped. Opcodes without
+    // a kernel run on Emulate8080 as in a full batch.
+    static Batch8080 lane;
+    if (state->halted) {
+        return Emulate8080(state);
+    }
+    lane.count = 1;
+    lane.cpu[0] = state;
+    BatchLoadLane(&lane, 0);
+    lane.start[0] = state->cycles;
+    for (int i = 0; i < BATCH_MAX_LANES; i++) {
+        lane.cycles[i] = i == 0 ? 0 : INT32_MAX;
+    }
+    BatchGroup(&lane, lane.pc[0], 1);      // 1 cycle: stops after one instruction
+    BatchStoreLane(&lane, 0);
+    return lane.cycles[0];
+}
+
+#endif
@@ -0,0 +1,499 @@
+/* Benchmarks for the emulator subsystems.
+
+Prints the results as JSON. With --baseline the results are compared with an
+earlier run and the exit status is 1 if anything regressed by more than the
+threshold (10% by default).
+
+    benchmark [--output <file>] [--baseline <file>] [--threshold <percent>]
+
+Save a run with --output and use it as the baseline for later runs. The
+committed workloads/benchmark_baseline.json is such a run, from the machine
+the last performance change was measured on:
+
+    build/benchmark --baseline workloads/benchmark_baseline.json
+
+Timings depend on the machine, so compare against a baseline made on the
+same one. Run it from the repository root, it reads ./ROMs and ./workloads. */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "./emulator/emulator.h"
+#include "./disassembler/disassembler.h"
+#include "./invaders/invaders.h"
+#include "./scaler/scaler.h"
+#include "./env/env.h"
+#include "./cow/cow.h"
+#include "./batch/batch.h"
+
+#define GROUP_INSTRUCTIONS   20000000
+#define BENCH_FRAMES         10000
+#define BENCH_GAMEPLAY       "workloads/gameplay.inputs"
+#define BENCH_GAMEPLAY_MAX   20000       // frames of it replayed
+#define BENCH_CONVERSIONS    5000
+#define BENCH_SNAPSHOTS      200000
+#define BENCH_CLONES         1000000
+#define BENCH_SCALES         200
+#define BENCH_PASSES         1000
+#define BENCH_ENVS           16
+#define BENCH_ENV_STEPS      500         // batched steps of BENCH_ENVS games
+#define BENCH_LANES          32
+#define BENCH_BATCH_FRAMES   500         // frames of BENCH_LANES machines in lockstep
+#define BENCH_REPEATS        3           // every measurement keeps the best of these
+#define DEFAULT_THRESHOLD    10.0
+
+#define MAX_METRICS  32
+
+typedef struct Metric {
+    char        name[64];
+    double      value;
+    const char  *unit;
+    int         higher_is_better;
+} Metric;
+
+Metric metrics[MAX_METRICS];
+int metric_count = 0;
+
+void AddMetric(const char *name, double value, const char *unit, int higher_is_better) {
+    Metric *m = &metrics[metric_count++];
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    m->value = value;
+    m->unit = unit;
+    m->higher_is_better = higher_is_better;
+}
+
+double Seconds(clock_t start) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+double Best(double best, clock_t start) {
+    // Keeps the fastest repeat, the others were disturbed by something else
+    double seconds = Seconds(start);
+    return seconds < best ? seconds : best;
+}
+
+/* Opcode group microbenchmarks.
+
+Each group is a short body of instructions repeated to fill a loop at 0x0100
+that jumps back to itself. Jump and call targets in a body are relative to
+the start of that copy of the body. */
+
+typedef struct OpcodeGroup {
+    const char      *name;
+    int             length;
+    uint8_t         body[16];
+} OpcodeGroup;
+
+const OpcodeGroup OPCODE_GROUPS[] = {
+    { "mov",        7, { 0x41, 0x4a, 0x53, 0x5c, 0x65, 0x6f, 0x78 } },                 // MOV r,r
+    { "alu",        8, { 0x80, 0x91, 0xa2, 0xab, 0xb4, 0xbd, 0x88, 0x99 } },           // ADD SUB ANA XRA ORA CMP ADC SBB
+    { "immediate", 10, { 0xc6, 0x01, 0xd6, 0x02, 0xe6, 0x7f, 0xf6, 0x10, 0xfe, 0x20 } },// ADI SUI ANI ORI CPI
+    { "inc_dec",    5, { 0x04, 0x0d, 0x03, 0x1b, 0x09 } },                             // INR DCR INX DCX DAD
+    { "memory",    10, { 0x77, 0x7e, 0x32, 0x00, 0x90, 0x3a, 0x00, 0x90, 0x34, 0x35 } },// MOV M,A MOV A,M STA LDA INR M DCR M
+    { "stack",      6, { 0xc5, 0xd5, 0xf5, 0xf1, 0xd1, 0xc1 } },                       // PUSH POP
+    { "branch",    10, { 0xc3, 0x03, 0x00, 0xc2, 0x06, 0x00, 0xca, 0x09, 0x00, 0xff } },// JMP JNZ JZ RST 7 (RET)
+};
+
+#define OPCODE_GROUP_COUNT  (int)(sizeof(OPCODE_GROUPS) / sizeof(OPCODE_GROUPS[0]))
+
+void BuildGroup(State8080 *state, const OpcodeGroup *group) {
+    uint8_t *mem = state->memory;
+    memset(mem, 0, 0x10000);
+
+    // Prologue: LXI SP,$f000  LXI H,$8000  JMP $0100, RST 7 returns at once
+    const uint8_t prologue[] = { 0x31, 0x00, 0xf0, 0x21, 0x00, 0x80, 0xc3, 0x00, 0x01 };
+    memcpy(mem, prologue, sizeof(prologue));
+    mem[0x38] = 0xc9;
+
+    uint16_t addr = 0x0100;
+    while (addr + group->length <= 0x0300) {
+        memcpy(&mem[addr], group->body, group->length);
+        for (int i = 0; i < group->length; i += OpcodeLength(group->body[i])) {
+            const OpcodeInfo *info = &OPCODE_INFO[group->body[i]];
+            int flow = info->flow & ~FLOW_CONDITIONAL;
+            if (flow == FLOW_JUMP || flow == FLOW_CALL) {
+                uint16_t target = addr + (group->body[i + 1] | group->body[i + 2] << 8);
+                mem[addr + i + 1] = target & 0xff;
+                mem[addr + i + 2] = target >> 8;
+            }
+        }
+        addr += group->length;
+    }
+    mem[addr] = 0xc3;       // JMP $0100
+    mem[addr + 1] = 0x00;
+    mem[addr + 2] = 0x01;
+
+    // Registers back to reset, keeping the memory
+    uint8_t *memory = state->memory;
+    MemoryBus *bus = state->bus;
+    memset(state, 0, sizeof(State8080));
+    state->memory = memory;
+    state->bus = bus;
+}
+
+void BenchOpcodeGroups(void) {
+    State8080 state = {0};
+    state.memory = calloc(0x10000, 1);
+    state.bus = BusNew();
+    BusMapRAM(state.bus, 0x00, PAGE_COUNT, state.memory);
+
+    for (int g = 0; g < OPCODE_GROUP_COUNT; g++) {
+        double seconds = 1e9;
+        for (int r = 0; r < BENCH_REPEATS; r++) {
+            BuildGroup(&state, &OPCODE_GROUPS[g]);
+            clock_t start = clock();
+            for (int i = 0; i < GROUP_INSTRUCTIONS; i++) {
+                Emulate8080(&state);
+            }
+            seconds = Best(seconds, start);
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "opcodes_%s", OPCODE_GROUPS[g].name);
+        AddMetric(name, GROUP_INSTRUCTIONS / seconds / 1e6, "M instructions/s", 1);
+    }
+
+    free(state.bus);
+    free(state.memory);
+}
+
+void BenchMachine(const RomSet *roms) {
+    // Headless frames from reset, the attract mode exercises most of the game
+    Invaders *m = NULL;
+    double seconds = 1e9;
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        free(m);
+        m = InvadersNew(roms);
+        clock_t start = clock();
+        for (int i = 0; i < BENCH_FRAMES; i++) {
+            InvadersRunFrame(m);
+        }
+        seconds = Best(seconds, start);
+    }
+    AddMetric("frames", BENCH_FRAMES / seconds, "frames/s", 1);
+    AddMetric("frames_speed", BENCH_FRAMES / seconds / INVADERS_FPS, "x real time", 1);
+
+    // The same without idle loop skipping
+    seconds = 1e9;
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        Invaders *strict = InvadersNew(roms);
+        strict->cpu.strict = 1;
+        clock_t start = clock();
+        for (int i = 0; i < BENCH_FRAMES; i++) {
+            InvadersRunFrame(strict);
+        }
+        seconds = Best(seconds, start);
+        free(strict);
+    }
+    AddMetric("frames_strict", BENCH_FRAMES / seconds, "frames/s", 1);
+
+    // Video RAM to pixels, as done by DrawVideoRAM every frame
+    uint32_t *pixels = malloc(INVADERS_WIDTH * INVADERS_HEIGHT * sizeof(uint32_t));
+    seconds = 1e9;
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        clock_t start = clock();
+        for (int i = 0; i < BENCH_CONVERSIONS; i++) {
+            ConvertVideoRAM(&m->memory[INVADERS_VRAM], pixels);
+        }
+        seconds = Best(seconds, start);
+    }
+    AddMetric("draw_video_ram", seconds / BENCH_CONVERSIONS * 1e6, "us/frame", 0);
+
+    // Upscaling to 896x1024 on the worker pool
+    Scaler *scaler = ScalerNew(ScalerThreads());
+    uint32_t *scaled = malloc(INVADERS_WIDTH * 4 * INVADERS_HEIGHT * 4 * sizeof(uint32_t));
+    const int modes[2] = { SCALE_NEAREST, SCALE_4X };
+    const char *names[2] = { "scale_nearest_4x", "scale_scale4x" };
+    for (int mode = 0; mode < 2; mode++) {
+        seconds = 1e9;
+        for (int r = 0; r < BENCH_REPEATS; r++) {
+            clock_t start = clock();
+            for (int i = 0; i < BENCH_SCALES; i++) {
+                Scale(scaler, pixels, INVADERS_WIDTH, INVADERS_HEIGHT, INVADERS_WIDTH,
+                      scaled, INVADERS_WIDTH * 4, modes[mode], 4, 1);
+            }
+            seconds = Best(seconds, start);
+        }
+        AddMetric(names[mode], seconds / BENCH_SCALES * 1e6, "us/frame", 0);
+    }
+    ScalerFree(scaler);
+    free(scaled);
+    free(pixels);
+
+    // Save state round trip through memory
+    InvadersSnapshot *snapshot = malloc(sizeof(InvadersSnapshot));
+    seconds = 1e9;
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        clock_t start = clock();
+        for (int i = 0; i < BENCH_SNAPSHOTS; i++) {
+            InvadersSave(m, snapshot);
+            if (InvadersRestore(m, snapshot) != 0) {
+                fprintf(stderr, "error: Snapshot didn't restore\n");
+                exit(1);
+            }
+        }
+        seconds = Best(seconds, start);
+    }
+    AddMetric("save_state", seconds / BENCH_SNAPSHOTS * 1e6, "us/round trip", 0);
+    free(snapshot);
+    free(m);
+}
+
+void BenchGameplay(const RomSet *roms) {
+    // The recorded game, inputs at mid screen like headless --play. Attract
+    // mode spends much of its time in idle loops, a game mostly doesn't, so
+    // both are needed to see what idle loop skipping costs and gains.
+    FILE *f = fopen(BENCH_GAMEPLAY, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "error: Couldn't open %s\n", BENCH_GAMEPLAY);
+        exit(1);
+    }
+    uint8_t *inputs = malloc(2 * BENCH_GAMEPLAY_MAX);
+    int frames = fread(inputs, 2, BENCH_GAMEPLAY_MAX, f);
+    fclose(f);
+
+    const char *names[2] = { "frames_gameplay", "frames_gameplay_strict" };
+    for (int strict = 0; strict < 2; strict++) {
+        double seconds = 1e9;
+        for (int r = 0; r < BENCH_REPEATS; r++) {
+            Invaders *m = InvadersNew(roms);
+            m->cpu.strict = strict;
+            clock_t start = clock();
+            for (int i = 0; i < frames; i++) {
+                int cycles = InvadersRun(m, 0, INVADERS_CYCLES_PER_FRAME / 2);
+                InvadersInterrupt(m, 1);
+                m->input_port1 = inputs[2 * i];
+                m->input_port2 = inputs[2 * i + 1];
+                InvadersRun(m, cycles, INVADERS_CYCLES_PER_FRAME);
+                InvadersInterrupt(m, 2);
+                m->frames++;
+            }
+            seconds = Best(seconds, start);
+            free(m);
+        }
+        AddMetric(names[strict], frames / seconds, "frames/s", 1);
+    }
+    free(inputs);
+}
+
+void BenchClone(const RomSet *roms) {
+    // Copy-on-write branch of a stored game state, cloned and dropped again
+    CowRunner *runner = CowRunnerNew(roms);
+    for (int i = 0; i < 100; i++) {
+        InvadersRunFrame(&runner->m);
+    }
+    CowState *root = CowCapture(runner);
+    CowState *leaf = CowClone(runner, root);
+    CowLoad(runner, leaf);
+    double seconds = 1e9;
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        clock_t start = clock();
+        for (int i = 0; i < BENCH_CLONES; i++) {
+            CowFree(runner, CowClone(runner, root));
+        }
+        seconds = Best(seconds, start);
+    }
+    AddMetric("cow_clone", seconds / BENCH_CLONES * 1e9, "ns/clone", 0);
+    CowFree(runner, leaf);
+    CowFree(runner, root);
+    CowRunnerFree(runner);
+}
+
+void BenchEnv(const RomSet *roms) {
+    // Agents playing at random, one frame and a palette index frame per step
+    EnvBatch *env = EnvNew(roms, BENCH_ENVS, ENV_OBS_8BPP, 1);
+    if (env == NULL) {
+        exit(1);
+    }
+    uint8_t *obs = malloc(BENCH_ENVS * EnvObsSize(env));
+    EnvInfo info[BENCH_ENVS];
+    uint8_t actions[BENCH_ENVS];
+    uint32_t x = 1;
+    double seconds = 1e9;
+
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        EnvResetAll(env, obs, info);
+        clock_t start = clock();
+        for (int step = 0; step < BENCH_ENV_STEPS; step++) {
+            for (int i = 0; i < BENCH_ENVS; i++) {
+                x = x * 1103515245 + 12345;
+                actions[i] = (x >> 16) % ENV_ACTIONS;
+            }
+            EnvStep(env, actions, obs, info);
+        }
+        seconds = Best(seconds, start);
+    }
+    AddMetric("env_steps", BENCH_ENVS * BENCH_ENV_STEPS / seconds, "steps/s", 1);
+    free(obs);
+    EnvFree(env);
+}
+
+void BenchBatch(const RomSet *roms) {
+    // Machines from reset in attract mode on the lockstep interpreter,
+    // frames of all of them together
+    double seconds = 1e9;
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        Batch8080 *b = BatchNew(roms, BENCH_LANES);
+        clock_t start = clock();
+        for (int i = 0; i < BENCH_BATCH_FRAMES; i++) {
+            BatchRunFrame(b);
+        }
+        seconds = Best(seconds, start);
+        BatchFree(b);
+    }
+    AddMetric("batch_frames", BENCH_LANES * BENCH_BATCH_FRAMES / seconds, "frames/s", 1);
+}
+
+void BenchDisassembler(const RomSet *roms) {
+    // Decode and format the whole ROM into one text buffer
+    uint8_t image[0x2000 + 2] = {0};
+    for (int i = 0; i < roms->count; i++) {
+        memcpy(&image[roms->manifest[i].address], roms->data[i], roms->manifest[i].size);
+    }
+
+    size_t text_size = 0x2000 * (INSTRUCTION_TEXT_MAX + 1);
+    char *text = malloc(text_size);
+    long instructions = 0;
+    double seconds = 1e9;
+
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        clock_t start = clock();
+        instructions = 0;
+        for (int pass = 0; pass < BENCH_PASSES; pass++) {
+            Instruction ins;
+            size_t pos = 0;
+            int pc = 0;
+            while (pc < 0x2000) {
+                pc += DecodeInstruction(&image[pc], pc, &ins);
+                pos = FormatInstruction(&ins, text, pos, text_size);
+                text[pos++] = '\n';
+                instructions++;
+            }
+        }
+        seconds = Best(seconds, start);
+    }
+    AddMetric("disassembler", instructions / seconds / 1e6, "M instructions/s", 1);
+    free(text);
+}
+
+void WriteJSON(FILE *f) {
+    // One metric per line, LoadBaseline depends on it
+    fprintf(f, "{\n  \"metrics\": [\n");
+    for (int i = 0; i < metric_count; i++) {
+        fprintf(f, "    {\"name\": \"%s\", \"value\": %.4f, \"unit\": \"%s\", \"higher_is_better\": %d}%s\n",
+                metrics[i].name, metrics[i].value, metrics[i].unit, metrics[i].higher_is_better,
+                i + 1 < metric_count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+int LoadBaseline(const char *filename, Metric *baseline, int max) {
+    // Reads metrics written by WriteJSON, returns the count or -1
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "error: Couldn't open baseline %s\n", filename);
+        return -1;
+    }
+
+    char line[256];
+    int count = 0;
+    while (count < max && fgets(line, sizeof(line), f)) {
+        Metric *m = &baseline[count];
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"value\": %lf", m->name, &m->value) == 2) {
+            count++;
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+int CompareBaseline(const Metric *baseline, int count, double threshold) {
+    // Prints a table to stderr, returns the number of regressions
+    int regressions = 0;
+    fprintf(stderr, "%-20s %14s %14s %9s\n", "metric", "baseline", "current", "change");
+    for (int i = 0; i < metric_count; i++) {
+        const Metric *m = &metrics[i];
+        const Metric *b = NULL;
+        for (int j = 0; j < count; j++) {
+            if (strcmp(baseline[j].name, m->name) == 0) {
+                b = &baseline[j];
+            }
+        }
+        if (b == NULL || b->value == 0) {
+            fprintf(stderr, "%-20s %14s %14.3f\n", m->name, "-", m->value);
+            continue;
+        }
+
+        // Positive change is always an improvement
+        double change = (m->value - b->value) / b->value * 100.0;
+        if (!m->higher_is_better) {
+            change = -change;
+        }
+        int regressed = change < -threshold;
+        regressions += regressed;
+        fprintf(stderr, "%-20s %14.3f %14.3f %+8.1f%%%s\n", m->name, b->value, m->value, change,
+                regressed ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+int main (int argc, char**argv)
+{
+    const char *output = NULL;
+    const char *baseline_file = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_file = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--output <file>] [--baseline <file>] [--threshold <percent>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    RomSet roms;
+    if (LoadRomSet(&roms, "./ROMs", INVADERS_MANIFEST, INVADERS_MANIFEST_COUNT) != 0) {
+        exit(1);
+    }
+
+    BenchOpcodeGroups();
+    BenchMachine(&roms);
+    BenchGameplay(&roms);
+    BenchClone(&roms);
+    BenchEnv(&roms);
+    BenchBatch(&roms);
+    BenchDisassembler(&roms);
+    FreeRomSet(&roms);
+
+    WriteJSON(stdout);
+    if (output) {
+        FILE *f = fopen(output, "w");
+        if (f == NULL) {
+            fprintf(stderr, "error: Couldn't create %s\n", output);
+            return 1;
+        }
+        WriteJSON(f);
+        fclose(f);
+    }
+
+    if (baseline_file) {
+        Metric baseline[MAX_METRICS];
+        int count = LoadBaseline(baseline_file, baseline, MAX_METRICS);
+        if (count < 0) {
+            return 1;
+        }
+        int regressions = CompareBaseline(baseline, count, threshold);
+        if (regressions) {
+            fprintf(stderr, "%d metric(s) regressed more than %.1f%%\n", regressions, threshold);
+            return 1;
+        }
+    }
+    return 0;
+}
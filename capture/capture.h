@@ -0,0 +1,399 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../invaders/invaders.h"
+#include "../romset/romset.h"
+
+/* Video capture.
+
+At the end of every frame the emulation thread copies the 7K of 1bpp video
+RAM into a single producer / single consumer ring (the same scheme as the
+trace) and goes on. A writer thread colors the frames and encodes them
+losslessly as a PNG sequence, an animated GIF or a raw Y4M stream. Frames
+are never dropped: if the writer falls behind, the emulation waits for a
+free slot. */
+
+#define CAPTURE_PNG  0          // name_000000.png, name_000001.png, ...
+#define CAPTURE_GIF  1
+#define CAPTURE_Y4M  2
+
+#define CAPTURE_DEFAULT_CAPACITY  256       // frames, must be a power of two
+#define CAPTURE_PIXELS  (INVADERS_WIDTH * INVADERS_HEIGHT)
+
+typedef struct CaptureFrame {
+    uint8_t     vram[INVADERS_VRAM_SIZE];
+} CaptureFrame;
+
+typedef struct Capture {
+    int                 format;
+    char                path[512];      // file name, or the PNG name before the number
+    char                suffix[16];     // PNG extension
+    CaptureFrame        *ring;
+    uint64_t            mask;
+    _Atomic uint64_t    head;           // next frame to fill, owned by the emulation thread
+    _Atomic uint64_t    tail;           // next frame to encode, owned by the writer thread
+    uint64_t            cached_tail;
+    uint64_t            stalls;         // times the emulation had to wait
+    _Atomic int         stop;
+    FILE                *file;          // GIF and Y4M
+    uint64_t            written;
+    int                 error;
+    pthread_t           writer;
+    uint8_t             pixels[CAPTURE_PIXELS];     // writer's palette indices
+} Capture;
+
+static void PutLE16(FILE *f, uint16_t v) {
+    fputc(v & 0xff, f);
+    fputc(v >> 8, f);
+}
+
+/* PNG: 2 bit palette image, deflate with stored blocks so no zlib is needed */
+
+static void PutBE32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void PngChunk(FILE *f, const char *type, const uint8_t *data, uint32_t size) {
+    uint8_t *chunk = malloc(size + 4);
+    uint8_t be[4];
+    memcpy(chunk, type, 4);
+    memcpy(chunk + 4, data, size);
+
+    PutBE32(be, size);
+    fwrite(be, 4, 1, f);
+    fwrite(chunk, size + 4, 1, f);
+    PutBE32(be, Crc32(chunk, size + 4));
+    fwrite(be, 4, 1, f);
+    free(chunk);
+}
+
+static int WritePNG(Capture *c) {
+    char name[600];
+    snprintf(name, sizeof(name), "%s_%06llu%s", c->path, (unsigned long long)c->written, c->suffix);
+    FILE *f = fopen(name, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "error: Couldn't create %s\n", name);
+        return -1;
+    }
+
+    const int stride = INVADERS_WIDTH / 4 + 1;              // filter byte + 4 pixels per byte
+    const uint32_t raw_size = stride * INVADERS_HEIGHT;
+    uint8_t header[13] = { 0 };
+    PutBE32(header, INVADERS_WIDTH);
+    PutBE32(header + 4, INVADERS_HEIGHT);
+    header[8] = 2;                                          // bit depth
+    header[9] = 3;                                          // palette
+
+    uint8_t palette[12];
+    for (int i = 0; i < 4; i++) {
+        palette[i * 3] = INVADERS_PALETTE[i] >> 16;
+        palette[i * 3 + 1] = INVADERS_PALETTE[i] >> 8;
+        palette[i * 3 + 2] = INVADERS_PALETTE[i];
+    }
+
+    // zlib stream: header, one stored block (raw_size < 64K), adler32
+    uint8_t *z = calloc(2 + 5 + raw_size + 4, 1);
+    uint8_t *raw = z + 7;
+    z[0] = 0x78;
+    z[1] = 0x01;
+    z[2] = 0x01;                                            // final block, stored
+    z[3] = raw_size & 0xff;
+    z[4] = raw_size >> 8;
+    z[5] = ~raw_size & 0xff;
+    z[6] = (~raw_size >> 8) & 0xff;
+    for (int y = 0; y < INVADERS_HEIGHT; y++) {
+        uint8_t *row = raw + y * stride + 1;                // filter 0
+        const uint8_t *px = &c->pixels[y * INVADERS_WIDTH];
+        for (int x = 0; x < INVADERS_WIDTH; x++) {
+            row[x >> 2] |= px[x] << (6 - 2 * (x & 3));
+        }
+    }
+    uint32_t a = 1, b = 0;
+    for (uint32_t i = 0; i < raw_size; i++) {
+        a = (a + raw[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    PutBE32(raw + raw_size, b << 16 | a);
+
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    fwrite(signature, 8, 1, f);
+    PngChunk(f, "IHDR", header, sizeof(header));
+    PngChunk(f, "PLTE", palette, sizeof(palette));
+    PngChunk(f, "IDAT", z, 7 + raw_size + 4);
+    PngChunk(f, "IEND", NULL, 0);
+    free(z);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/* GIF: 4 color global palette, one LZW compressed image per frame */
+
+#define GIF_MIN_CODE_SIZE  2
+#define GIF_MAX_CODES      4096
+
+typedef struct GifWriter {
+    FILE        *f;
+    uint32_t    bits;           // pending output bits
+    int         nbits;
+    uint8_t     block[256];     // data sub-block being filled, block[0] is the length
+} GifWriter;
+
+static void GifByte(GifWriter *g, uint8_t byte) {
+    g->block[++g->block[0]] = byte;
+    if (g->block[0] == 255) {
+        fwrite(g->block, 256, 1, g->f);
+        g->block[0] = 0;
+    }
+}
+
+static void GifCode(GifWriter *g, int code, int size) {
+    g->bits |= (uint32_t)code << g->nbits;
+    g->nbits += size;
+    while (g->nbits >= 8) {
+        GifByte(g, g->bits & 0xff);
+        g->bits >>= 8;
+        g->nbits -= 8;
+    }
+}
+
+static void WriteGIFHeader(FILE *f) {
+    fwrite("GIF89a", 6, 1, f);
+    PutLE16(f, INVADERS_WIDTH);
+    PutLE16(f, INVADERS_HEIGHT);
+    fputc(0xf1, f);                                 // global palette of 4 colors
+    fputc(0, f);
+    fputc(0, f);
+    for (int i = 0; i < 4; i++) {
+        fputc(INVADERS_PALETTE[i] >> 16, f);
+        fputc(INVADERS_PALETTE[i] >> 8 & 0xff, f);
+        fputc(INVADERS_PALETTE[i] & 0xff, f);
+    }
+    fwrite("\x21\xff\x0bNETSCAPE2.0\x03\x01\x00\x00\x00", 19, 1, f);     // loop forever
+}
+
+static int WriteGIFFrame(Capture *c) {
+    // GIF delays are in 1/100 s, 2 2 1 averages out to 60 frames a second
+    FILE *f = c->file;
+    int delay = c->written % 3 == 2 ? 1 : 2;
+    fwrite("\x21\xf9\x04\x00", 4, 1, f);
+    PutLE16(f, delay);
+    fwrite("\x00\x00", 2, 1, f);
+
+    fputc(0x2c, f);                                 // image descriptor, whole screen
+    PutLE16(f, 0);
+    PutLE16(f, 0);
+    PutLE16(f, INVADERS_WIDTH);
+    PutLE16(f, INVADERS_HEIGHT);
+    fputc(0, f);
+    fputc(GIF_MIN_CODE_SIZE, f);
+
+    // LZW with the string table as a trie: next[code][pixel]
+    static uint16_t next[GIF_MAX_CODES][4];
+    const int clear = 1 << GIF_MIN_CODE_SIZE;
+    const int eoi = clear + 1;
+    GifWriter g = { f, 0, 0, { 0 } };
+    int size = GIF_MIN_CODE_SIZE + 1;
+    int max_code = eoi;
+
+    memset(next, 0, sizeof(next));
+    GifCode(&g, clear, size);
+    int code = c->pixels[0];
+    for (int i = 1; i < CAPTURE_PIXELS; i++) {
+        int pixel = c->pixels[i];
+        if (next[code][pixel]) {
+            code = next[code][pixel];
+            continue;
+        }
+        GifCode(&g, code, size);
+        next[code][pixel] = ++max_code;
+        if (max_code >= (1 << size)) {
+            size++;
+        }
+        if (max_code == GIF_MAX_CODES - 1) {
+            GifCode(&g, clear, size);
+            memset(next, 0, sizeof(next));
+            size = GIF_MIN_CODE_SIZE + 1;
+            max_code = eoi;
+        }
+        code = pixel;
+    }
+    GifCode(&g, code, size);
+    // the decoder grows its table on the last code as well
+    if (++max_code >= (1 << size) && size < 12) {
+        size++;
+    }
+    GifCode(&g, eoi, size);
+    if (g.nbits > 0) {
+        GifByte(&g, g.bits & 0xff);
+    }
+    if (g.block[0] > 0) {
+        fwrite(g.block, g.block[0] + 1, 1, f);
+    }
+    fputc(0, f);                                    // end of image data
+    return ferror(f) ? -1 : 0;
+}
+
+/* Y4M: 4:4:4 8 bit frames, the palette converted once with BT.601 */
+
+static int WriteY4MFrame(Capture *c) {
+    static uint8_t plane[3][CAPTURE_PIXELS];
+    uint8_t yuv[4][3];
+    for (int i = 0; i < 4; i++) {
+        int r = INVADERS_PALETTE[i] >> 16, g = INVADERS_PALETTE[i] >> 8 & 0xff, b = INVADERS_PALETTE[i] & 0xff;
+        yuv[i][0] = (uint8_t)(16 + (65.738 * r + 129.057 * g + 25.064 * b) / 256 + 0.5);
+        yuv[i][1] = (uint8_t)(128 + (-37.945 * r - 74.494 * g + 112.439 * b) / 256 + 0.5);
+        yuv[i][2] = (uint8_t)(128 + (112.439 * r - 94.154 * g - 18.285 * b) / 256 + 0.5);
+    }
+    for (int i = 0; i < CAPTURE_PIXELS; i++) {
+        plane[0][i] = yuv[c->pixels[i]][0];
+        plane[1][i] = yuv[c->pixels[i]][1];
+        plane[2][i] = yuv[c->pixels[i]][2];
+    }
+    fwrite("FRAME\n", 6, 1, c->file);
+    fwrite(plane, sizeof(plane), 1, c->file);
+    return ferror(c->file) ? -1 : 0;
+}
+
+static int EncodeFrame(Capture *c, const CaptureFrame *frame) {
+    ConvertVideoIndices(frame->vram, c->pixels);
+    switch (c->format) {
+        case CAPTURE_PNG: return WritePNG(c);
+        case CAPTURE_GIF: return WriteGIFFrame(c);
+    }
+    return WriteY4MFrame(c);
+}
+
+static void CaptureSleep(long ns) {
+    struct timespec ts = { 0, ns };
+    nanosleep(&ts, NULL);
+}
+
+static void* CaptureWriterThread(void *arg) {
+    Capture *c = arg;
+    for (;;) {
+        uint64_t tail = atomic_load_explicit(&c->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&c->head, memory_order_acquire);
+        if (tail == head) {
+            if (atomic_load_explicit(&c->stop, memory_order_acquire)) {
+                break;
+            }
+            CaptureSleep(2000000);      // idle, a frame takes 16 ms anyway
+            continue;
+        }
+        if (!c->error && EncodeFrame(c, &c->ring[tail & c->mask]) != 0) {
+            c->error = 1;
+        }
+        c->written++;
+        atomic_store_explicit(&c->tail, tail + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+int CaptureFormat(const char *path) {
+    // Picks the format from the file extension, PNG when unknown
+    const char *dot = strrchr(path, '.');
+    if (dot && strcmp(dot, ".gif") == 0) {
+        return CAPTURE_GIF;
+    } else if (dot && strcmp(dot, ".y4m") == 0) {
+        return CAPTURE_Y4M;
+    }
+    return CAPTURE_PNG;
+}
+
+Capture* CaptureOpen(const char *path, size_t capacity) {
+    // Starts recording to path, returns NULL if it can't be created
+    Capture *c = calloc(1, sizeof(Capture));
+    c->format = CaptureFormat(path);
+    snprintf(c->path, sizeof(c->path), "%s", path);
+
+    if (c->format == CAPTURE_PNG) {
+        char *dot = strrchr(c->path, '.');
+        if (dot && strlen(dot) < sizeof(c->suffix)) {
+            snprintf(c->suffix, sizeof(c->suffix), "%s", dot);
+            *dot = '\0';
+        } else {
+            snprintf(c->suffix, sizeof(c->suffix), ".png");
+        }
+    } else {
+        c->file = fopen(path, "wb");
+        if (c->file == NULL) {
+            fprintf(stderr, "error: Couldn't create capture file %s\n", path);
+            free(c);
+            return NULL;
+        }
+        if (c->format == CAPTURE_GIF) {
+            WriteGIFHeader(c->file);
+        } else {
+            fprintf(c->file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", INVADERS_WIDTH, INVADERS_HEIGHT, INVADERS_FPS);
+        }
+    }
+
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    c->ring = malloc(size * sizeof(CaptureFrame));
+    c->mask = size - 1;
+
+    if (pthread_create(&c->writer, NULL, CaptureWriterThread, c) != 0) {
+        fprintf(stderr, "error: Couldn't start capture writer\n");
+        if (c->file) {
+            fclose(c->file);
+        }
+        free(c->ring);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+static inline void CaptureVideo(Capture *c, const uint8_t *vram) {
+    // Queues a completed frame, waiting only while the ring is full
+    uint64_t head = atomic_load_explicit(&c->head, memory_order_relaxed);
+    if (head - c->cached_tail > c->mask) {
+        c->cached_tail = atomic_load_explicit(&c->tail, memory_order_acquire);
+        while (head - c->cached_tail > c->mask) {
+            c->stalls++;
+            CaptureSleep(1000000);
+            c->cached_tail = atomic_load_explicit(&c->tail, memory_order_acquire);
+        }
+    }
+    memcpy(c->ring[head & c->mask].vram, vram, INVADERS_VRAM_SIZE);
+    atomic_store_explicit(&c->head, head + 1, memory_order_release);
+}
+
+uint64_t CaptureClose(Capture *c) {
+    // Encodes the queued frames, finishes the file and returns the frame
+    // count, or 0 if writing failed
+    atomic_store_explicit(&c->stop, 1, memory_order_release);
+    pthread_join(c->writer, NULL);
+
+    uint64_t written = c->written;
+    if (c->file) {
+        if (c->format == CAPTURE_GIF) {
+            fputc(0x3b, c->file);                   // trailer
+        }
+        if (fclose(c->file) != 0) {
+            c->error = 1;
+        }
+    }
+    if (c->error) {
+        fprintf(stderr, "error: Couldn't write capture %s\n", c->path);
+        written = 0;
+    }
+    free(c->ring);
+    free(c);
+    return written;
+}
+
+#endif
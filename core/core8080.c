@@ -0,0 +1,14 @@
+/* libcore8080: the one translation unit holding the definitions of the core
+headers, see core8080.h. */
+#ifdef CORE8080_LIBRARY
+    #error "core8080.c is the library itself, build it without CORE8080_LIBRARY"
+#endif
+
+#include "../opcodes/opcodes.h"
+#include "../memory/memory.h"
+#include "../disassembler/disassembler.h"
+#include "../trace/trace.h"
+#include "../emulator/emulator.h"
+#include "../romset/romset.h"
+#include "../invaders/invaders.h"
+#include "../analysis/analysis.h"
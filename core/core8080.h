@@ -0,0 +1,30 @@
+#ifndef CORE8080_H
+#define CORE8080_H
+
+/* Public header of libcore8080, the emulator core as a static library.
+
+The core is the CPU, the memory bus, the opcode tables and disassembler,
+execution traces, ROM sets, the Space Invaders machine and the ROM code
+analysis. Every one of those headers holds its own definitions so a
+program can still be built from a single file. With CORE8080_LIBRARY defined they shrink to types,
+macros, inline bus access and prototypes, and the definitions come from
+the library instead (core/core8080.c, built by the Makefile).
+
+Include this before any other header of the repository, or build with
+-DCORE8080_LIBRARY, and link with -lcore8080 -lpthread. The other modules
+(debugger, scaler, mixer, ...) stay header only on top of the library. */
+
+#ifndef CORE8080_LIBRARY
+    #define CORE8080_LIBRARY
+#endif
+
+#include "../opcodes/opcodes.h"
+#include "../memory/memory.h"
+#include "../disassembler/disassembler.h"
+#include "../trace/trace.h"
+#include "../emulator/emulator.h"
+#include "../romset/romset.h"
+#include "../invaders/invaders.h"
+#include "../analysis/analysis.h"
+
+#endif
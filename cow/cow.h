@@ -0,0 +1,229 @@
+#ifndef COW_H
+#define COW_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../invaders/invaders.h"
+#include "../romset/romset.h"
+
+/* Copy-on-write machine states for tree search.
+
+A CowState is the registers and IO latches plus 32 pointers to reference
+counted 256 byte RAM pages, a few hundred bytes in all. Cloning a state
+copies that and bumps the counts; no RAM is copied. The ROM isn't part of a
+state at all.
+
+States run on a CowRunner, a machine whose bus is pointed at the pages of
+the loaded state. Pages the state owns alone are mapped writable as usual.
+Shared pages are mapped read only and the first write to one takes the bus
+slow path, which gives the state its own copy and remaps the page. So a
+branch only ever pays for the pages it actually changes.
+
+Once a runner has captured a state its machine's memory[] is no longer the
+RAM being played, anything reading it directly (InvadersSave, DemoInput,
+ConvertVideoRAM(&m->memory[INVADERS_VRAM]), ...) sees COW_STALE_FILL. Read
+a state's RAM with CowReadRAM.
+
+Reference counts aren't atomic: keep a tree of states on one thread. */
+
+#define COW_FIRST_PAGE  (INVADERS_RAM >> PAGE_SHIFT)
+#define COW_PAGES       (0x2000 >> PAGE_SHIFT)         // 32 pages of work and video RAM
+#define COW_STALE_FILL  0xaa                           // the runner machine's own RAM after CowCapture
+
+typedef struct CowPage {
+    uint32_t    refs;
+    uint8_t     data[PAGE_SIZE];
+} CowPage;
+
+typedef struct CowState {
+    uint64_t    cycles;
+    uint64_t    frames;
+    uint16_t    sp;
+    uint16_t    pc;
+    uint8_t     a, b, c, d, e, h, l;
+    uint8_t     flags;              // PSW layout
+    uint8_t     int_enable;
+    uint8_t     halted;
+    uint8_t     input_port1;
+    uint8_t     input_port2;
+    uint8_t     output_port3;
+    uint8_t     output_port5;
+    uint8_t     shift_offset;
+    uint16_t    shift_register;
+    CowPage     *pages[COW_PAGES];
+} CowState;
+
+typedef struct CowRunner {
+    Invaders    m;
+    CowState    *active;            // state the machine is running, NULL if none
+    uint64_t    page_copies;        // statistics
+} CowRunner;
+
+static void CowMapPage(CowRunner *r, int index) {
+    // Points the page and all its mirrors at the active state's copy
+    CowPage *page = r->active->pages[index];
+    uint8_t *write = page->refs == 1 ? page->data : NULL;
+    for (int p = COW_FIRST_PAGE + index; p < PAGE_COUNT; p += COW_PAGES) {
+        r->m.bus.read[p] = page->data;
+        r->m.bus.write[p] = write;
+    }
+}
+
+static void CowWrite(MemoryBus *bus, uint16_t addr, uint8_t value) {
+    // First write to a shared page, copy it for the active state
+    CowRunner *r = bus->ctx;
+    int index = (addr >> PAGE_SHIFT) % COW_PAGES;
+    CowPage *shared = r->active->pages[index];
+    if (shared->refs == 1) {
+        // The other owners have been freed since the state was loaded
+        CowMapPage(r, index);
+        shared->data[addr & PAGE_MASK] = value;
+        return;
+    }
+    CowPage *page = malloc(sizeof(CowPage));
+    page->refs = 1;
+    memcpy(page->data, shared->data, PAGE_SIZE);
+    shared->refs--;
+    r->active->pages[index] = page;
+    r->page_copies++;
+    CowMapPage(r, index);
+    page->data[addr & PAGE_MASK] = value;
+}
+
+CowRunner* CowRunnerNew(const RomSet *roms) {
+    // A machine with the ROMs mapped, ready to load states
+    CowRunner *r = calloc(1, sizeof(CowRunner));
+    InvadersInit(&r->m);
+    if (roms) {
+        BusMapRomSet(&r->m.bus, roms);
+    }
+    r->m.bus.ctx = r;
+    for (int p = COW_FIRST_PAGE; p < PAGE_COUNT; p++) {
+        r->m.bus.write_handler[p] = CowWrite;
+    }
+    return r;
+}
+
+static void CowSaveRegisters(const Invaders *m, CowState *s) {
+    s->cycles = m->cpu.cycles;
+    s->frames = m->frames;
+    s->sp = m->cpu.sp;
+    s->pc = m->cpu.pc;
+    s->a = m->cpu.a;
+    s->b = m->cpu.b;
+    s->c = m->cpu.c;
+    s->d = m->cpu.d;
+    s->e = m->cpu.e;
+    s->h = m->cpu.h;
+    s->l = m->cpu.l;
+    s->flags = PackFlags(&m->cpu);
+    s->int_enable = m->cpu.int_enable;
+    s->halted = m->cpu.halted;
+    s->input_port1 = m->input_port1;
+    s->input_port2 = m->input_port2;
+    s->output_port3 = m->output_port3;
+    s->output_port5 = m->output_port5;
+    s->shift_offset = m->shift_offset;
+    s->shift_register = m->shift_register;
+}
+
+void CowSync(CowRunner *r) {
+    // Stores the machine registers in the active state. RAM needs nothing,
+    // the machine writes straight into the state's pages.
+    CowSaveRegisters(&r->m, r->active);
+}
+
+void CowLoad(CowRunner *r, CowState *s) {
+    // Makes s the state the runner's machine plays, saving the one before
+    if (r->active) {
+        CowSync(r);
+    }
+    Invaders *m = &r->m;
+    m->cpu.cycles = s->cycles;
+    m->frames = s->frames;
+    m->cpu.sp = s->sp;
+    m->cpu.pc = s->pc;
+    m->cpu.a = s->a;
+    m->cpu.b = s->b;
+    m->cpu.c = s->c;
+    m->cpu.d = s->d;
+    m->cpu.e = s->e;
+    m->cpu.h = s->h;
+    m->cpu.l = s->l;
+    UnpackFlags(&m->cpu, s->flags);
+    m->cpu.int_enable = s->int_enable;
+    m->cpu.halted = s->halted;
+    m->input_port1 = s->input_port1;
+    m->input_port2 = s->input_port2;
+    m->output_port3 = s->output_port3;
+    m->output_port5 = s->output_port5;
+    m->shift_offset = s->shift_offset;
+    m->shift_register = s->shift_register;
+
+    r->active = s;
+    for (int i = 0; i < COW_PAGES; i++) {
+        CowMapPage(r, i);
+    }
+}
+
+CowState* CowCapture(CowRunner *r) {
+    // Turns the runner's machine as it is now into a state of its own and
+    // loads it. Use once for the root of a tree.
+    CowState *s = calloc(1, sizeof(CowState));
+    for (int i = 0; i < COW_PAGES; i++) {
+        s->pages[i] = malloc(sizeof(CowPage));
+        s->pages[i]->refs = 1;
+        memcpy(s->pages[i]->data, r->m.bus.read[COW_FIRST_PAGE + i], PAGE_SIZE);
+    }
+    CowSaveRegisters(&r->m, s);
+    // Nothing writes the machine's RAM from now on, make stale reads obvious
+    memset(&r->m.memory[INVADERS_RAM], COW_STALE_FILL, COW_PAGES << PAGE_SHIFT);
+    r->active = NULL;
+    CowLoad(r, s);
+    return s;
+}
+
+CowState* CowClone(CowRunner *r, CowState *s) {
+    // Returns a new state equal to s sharing all of its pages
+    if (s == r->active) {
+        CowSync(r);
+    }
+    CowState *clone = malloc(sizeof(CowState));
+    memcpy(clone, s, sizeof(CowState));
+    for (int i = 0; i < COW_PAGES; i++) {
+        if (s->pages[i]->refs++ == 1 && s == r->active) {
+            CowMapPage(r, i);       // shared now, the machine mustn't write to it
+        }
+    }
+    return clone;
+}
+
+void CowFree(CowRunner *r, CowState *s) {
+    // Drops s and every page nothing else uses. Freeing the active state
+    // leaves the runner empty until the next CowLoad.
+    if (s == r->active) {
+        r->active = NULL;
+    }
+    for (int i = 0; i < COW_PAGES; i++) {
+        if (--s->pages[i]->refs == 0) {
+            free(s->pages[i]);
+        }
+    }
+    free(s);
+}
+
+void CowReadRAM(const CowState *s, uint8_t *ram) {
+    // Gathers the 8K of RAM from 0x2000, video RAM is the last 7K
+    for (int i = 0; i < COW_PAGES; i++) {
+        memcpy(&ram[i << PAGE_SHIFT], s->pages[i]->data, PAGE_SIZE);
+    }
+}
+
+void CowRunnerFree(CowRunner *r) {
+    free(r);
+}
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef CPM_H
+#define CPM_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../emulator/emulator.h"
+
+/* Minimal CP/M environment for running the classic 8080 CPU test programs
+(cpudiag, 8080PRE, 8080EXM) headless.
+
+The program is loaded at 0x0100. BDOS calls (CALL 0x0005) are trapped:
+function 2 prints the character in E, function 9 prints the '$' terminated
+string at DE. A jump to 0x0000 (warm boot) ends the run, so does an opcode
+the emulator doesn't implement, which fails it. */
+
+#define CPM_TPA        0x0100      // programs load and start here
+#define CPM_BDOS       0x0005
+#define CPM_OUTPUT_MAX 65536
+
+typedef struct CpmResult {
+    int         passed;             // reached warm boot without reporting an error
+    int         faulted;            // stopped at an unimplemented opcode
+    uint16_t    fault_pc;
+    uint64_t    instructions;
+    uint64_t    cycles;
+    double      seconds;
+    size_t      output_length;
+    char        output[CPM_OUTPUT_MAX];
+} CpmResult;
+
+void CpmPutChar(CpmResult *result, char c) {
+    putchar(c);
+    if (result->output_length < CPM_OUTPUT_MAX - 1) {
+        result->output[result->output_length++] = c;
+        result->output[result->output_length] = '\0';
+    }
+}
+
+void CpmBdos(State8080 *state, CpmResult *result) {
+    // Console output functions are all the test programs need
+    if (state->c == 2) {
+        CpmPutChar(result, state->e);
+    } else if (state->c == 9) {
+        uint16_t addr = (state->d << 8) | state->e;
+        for (int i = 0; i < 0x10000; i++) {
+            char c = BusRead(state->bus, addr + i);
+            if (c == '$') {
+                break;
+            }
+            CpmPutChar(result, c);
+        }
+    }
+}
+
+void PrepareCPM(State8080 *state) {
+    // Warm boot vector and a BDOS entry that just returns once trapped
+    BusWrite(state->bus, 0x0000, 0x76);         // HLT, never executed
+    BusWrite(state->bus, CPM_BDOS, 0xc9);       // RET
+    BusWrite(state->bus, 0x0006, 0x00);         // top of TPA for programs that read it
+    BusWrite(state->bus, 0x0007, 0xf0);
+    state->pc = CPM_TPA;
+    state->sp = 0xf000;
+}
+
+int LoadCPM(State8080 *state, const char *filename) {
+    // Loads a .COM program into the TPA of state, which must have flat RAM
+    // mapped over the whole bus. Returns -1 if the file can't be read.
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+
+    uint16_t addr = CPM_TPA;
+    int c;
+    while ((c = fgetc(f)) != EOF && addr != 0) {
+        BusWrite(state->bus, addr++, c);
+    }
+    fclose(f);
+
+    PrepareCPM(state);
+    return 0;
+}
+
+void RunCPM(State8080 *state, uint64_t max_instructions, CpmResult *result) {
+    // Runs the loaded program until it warm boots. max_instructions of 0
+    // means no limit.
+    memset(result, 0, sizeof(CpmResult));
+    uint64_t start_cycles = state->cycles;
+    state->trap_faults = 1;
+    state->faulted = 0;
+    clock_t start = clock();
+
+    while (max_instructions == 0 || result->instructions < max_instructions) {
+        if (state->pc == CPM_BDOS) {
+            CpmBdos(state, result);
+        } else if (state->pc == 0x0000) {
+            break;
+        }
+        Emulate8080(state);
+        if (state->faulted) {
+            result->faulted = 1;
+            result->fault_pc = state->fault_pc;
+            break;
+        }
+        result->instructions++;
+    }
+
+    result->seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    result->cycles = state->cycles - start_cycles;
+    result->passed = !result->faulted && state->pc == 0x0000 &&
+                     strstr(result->output, "ERROR") == NULL &&
+                     strstr(result->output, "FAILED") == NULL;
+}
+
+#endif
@@ -0,0 +1,622 @@
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+    #include <unistd.h>
+    #include <poll.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <arpa/inet.h>
+    #include <sys/socket.h>
+#endif
+
+#include "../emulator/emulator.h"
+
+/* Debugger with a GDB remote serial protocol stub.
+
+PC breakpoints live in a 64K-bit bitmap, memory watchpoints reuse the bus
+page table: a watched page is pointed at the watch handlers, every other
+page keeps its fast path. Mirrors of a watched RAM page are trapped too and
+report the address they alias. Instruction fetches aren't data reads and
+never trigger a read watchpoint, BusFetch marks them with bus->fetching.
+None of this is looked at by the normal run loop; only DebuggerRun checks breakpoints, so the emulator pays nothing
+unless a debugger is attached.
+
+GDB has no 8080 target, so registers use the z80 layout (af bc de hl sp pc,
+then ix iy af' bc' de' hl' ir as zero). Connect with:
+    (gdb) set architecture z80
+    (gdb) target remote localhost:<port> */
+
+#define MAX_WATCHPOINTS   8
+
+#define WATCH_WRITE       1
+#define WATCH_READ        2
+#define WATCH_ACCESS      3
+
+#define GDB_PACKET_SIZE   4096
+#define GDB_REGISTERS     13        // z80 register file, 16 bits each
+
+typedef struct Watchpoint {
+    uint16_t    addr;
+    uint16_t    length;
+    uint8_t     type;               // WATCH_*
+} Watchpoint;
+
+typedef struct Debugger {
+    uint64_t            breakpoints[0x10000 / 64];  // one bit per address
+    Watchpoint          watch[MAX_WATCHPOINTS];
+    int                 watch_count;
+
+    // Page table entries replaced by the watch handlers
+    uint8_t             watched[PAGE_COUNT];
+    uint8_t             alias[PAGE_COUNT];          // page a trapped mirror stands for
+    uint8_t             *saved_read[PAGE_COUNT];
+    uint8_t             *saved_write[PAGE_COUNT];
+    BusReadHandler      saved_read_handler[PAGE_COUNT];
+    BusWriteHandler     saved_write_handler[PAGE_COUNT];
+
+    State8080           *state;
+    int                 attached;       // 0 once GDB detaches
+    int                 stepping;       // stop after the next instruction
+    int                 resuming;       // don't stop on a breakpoint at the resume pc
+    int                 inspecting;     // GDB memory access, don't trigger watchpoints
+    int                 watch_hit;      // WATCH_* that triggered, 0 if none
+    uint16_t            watch_addr;
+
+    int                 listen_fd;
+    int                 fd;             // GDB connection
+    char                packet[GDB_PACKET_SIZE];
+} Debugger;
+
+static inline int BreakpointAt(const Debugger *dbg, uint16_t addr) {
+    return (dbg->breakpoints[addr >> 6] >> (addr & 63)) & 1;
+}
+
+void SetBreakpoint(Debugger *dbg, uint16_t addr) {
+    dbg->breakpoints[addr >> 6] |= (uint64_t)1 << (addr & 63);
+}
+
+void ClearBreakpoint(Debugger *dbg, uint16_t addr) {
+    dbg->breakpoints[addr >> 6] &= ~((uint64_t)1 << (addr & 63));
+}
+
+void CheckWatch(Debugger *dbg, uint16_t addr, int type) {
+    // Records a hit if addr is inside a watchpoint of a matching type
+    if (dbg->inspecting) {
+        return;
+    }
+    for (int i = 0; i < dbg->watch_count; i++) {
+        const Watchpoint *w = &dbg->watch[i];
+        if ((w->type & type) && (uint16_t)(addr - w->addr) < w->length) {
+            dbg->watch_hit = w->type;
+            dbg->watch_addr = addr;
+        }
+    }
+}
+
+static void CheckWatchPage(Debugger *dbg, uint16_t addr, int type) {
+    // The address itself and, on a mirror, the one it aliases
+    int page = addr >> PAGE_SHIFT;
+    CheckWatch(dbg, addr, type);
+    if (dbg->alias[page] != page) {
+        CheckWatch(dbg, dbg->alias[page] << PAGE_SHIFT | (addr & PAGE_MASK), type);
+    }
+}
+
+uint8_t WatchRead(MemoryBus *bus, uint16_t addr) {
+    // Read handler for watched pages, forwards to the page's real mapping
+    Debugger *dbg = bus->debug;
+    int page = addr >> PAGE_SHIFT;
+
+    if (!bus->fetching) {
+        CheckWatchPage(dbg, addr, WATCH_READ);
+    }
+    if (dbg->saved_read[page]) {
+        return dbg->saved_read[page][addr & PAGE_MASK];
+    }
+    return dbg->saved_read_handler[page](bus, addr);
+}
+
+void WatchWrite(MemoryBus *bus, uint16_t addr, uint8_t value) {
+    // Write handler for watched pages, forwards to the page's real mapping
+    Debugger *dbg = bus->debug;
+    int page = addr >> PAGE_SHIFT;
+
+    CheckWatchPage(dbg, addr, WATCH_WRITE);
+    if (dbg->saved_write[page]) {
+        dbg->saved_write[page][addr & PAGE_MASK] = value;
+        return;
+    }
+    dbg->saved_write_handler[page](bus, addr, value);
+}
+
+void UpdateWatchedPages(Debugger *dbg) {
+    // Restores every page, then traps the pages covered by a watchpoint
+    MemoryBus *bus = dbg->state->bus;
+
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        if (dbg->watched[page]) {
+            bus->read[page] = dbg->saved_read[page];
+            bus->write[page] = dbg->saved_write[page];
+            bus->read_handler[page] = dbg->saved_read_handler[page];
+            bus->write_handler[page] = dbg->saved_write_handler[page];
+            dbg->watched[page] = 0;
+        }
+    }
+
+    // Pages covered by a watchpoint, then the mirrors sharing their memory
+    uint8_t want[PAGE_COUNT] = { 0 };
+    for (int i = 0; i < dbg->watch_count; i++) {
+        const Watchpoint *w = &dbg->watch[i];
+        int first = w->addr >> PAGE_SHIFT;
+        int last = ((uint32_t)w->addr + w->length - 1) >> PAGE_SHIFT;
+        for (int page = first; page <= last && page < PAGE_COUNT; page++) {
+            want[page] = 1;
+            dbg->alias[page] = page;
+        }
+    }
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        if (!want[page] || bus->read[page] == NULL) {
+            continue;
+        }
+        for (int mirror = 0; mirror < PAGE_COUNT; mirror++) {
+            if (!want[mirror] && bus->attr[mirror] == PAGE_MIRROR &&
+                bus->read[mirror] == bus->read[page] && bus->write[mirror] == bus->write[page]) {
+                want[mirror] = 1;
+                dbg->alias[mirror] = page;
+            }
+        }
+    }
+
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        if (!want[page]) {
+            continue;
+        }
+        dbg->saved_read[page] = bus->read[page];
+        dbg->saved_write[page] = bus->write[page];
+        dbg->saved_read_handler[page] = bus->read_handler[page];
+        dbg->saved_write_handler[page] = bus->write_handler[page];
+        bus->read[page] = NULL;
+        bus->write[page] = NULL;
+        bus->read_handler[page] = WatchRead;
+        bus->write_handler[page] = WatchWrite;
+        dbg->watched[page] = 1;
+    }
+    BusCountHandlers(bus);
+}
+
+int AddWatchpoint(Debugger *dbg, uint16_t addr, uint16_t length, int type) {
+    if (dbg->watch_count == MAX_WATCHPOINTS || length == 0) {
+        return -1;
+    }
+    Watchpoint w = { addr, length, type };
+    dbg->watch[dbg->watch_count++] = w;
+    UpdateWatchedPages(dbg);
+    return 0;
+}
+
+int RemoveWatchpoint(Debugger *dbg, uint16_t addr, uint16_t length, int type) {
+    for (int i = 0; i < dbg->watch_count; i++) {
+        Watchpoint *w = &dbg->watch[i];
+        if (w->addr == addr && w->length == length && w->type == type) {
+            *w = dbg->watch[--dbg->watch_count];
+            UpdateWatchedPages(dbg);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+uint16_t GetRegister(const State8080 *state, int n) {
+    // z80 numbering: af bc de hl sp pc, everything else reads as 0
+    switch (n) {
+        case 0: return state->a << 8 | PackFlags(state);
+        case 1: return state->b << 8 | state->c;
+        case 2: return state->d << 8 | state->e;
+        case 3: return state->h << 8 | state->l;
+        case 4: return state->sp;
+        case 5: return state->pc;
+    }
+    return 0;
+}
+
+void SetRegister(State8080 *state, int n, uint16_t value) {
+    switch (n) {
+        case 0: state->a = value >> 8; UnpackFlags(state, value & 0xff); break;
+        case 1: state->b = value >> 8; state->c = value & 0xff; break;
+        case 2: state->d = value >> 8; state->e = value & 0xff; break;
+        case 3: state->h = value >> 8; state->l = value & 0xff; break;
+        case 4: state->sp = value; break;
+        case 5: state->pc = value; break;
+    }
+}
+
+#ifndef _WIN32
+
+static int HexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static const char *ParseHex(const char *s, uint32_t *value) {
+    // Parses hex digits into value, returns the first non-hex character
+    *value = 0;
+    while (HexValue(*s) >= 0) {
+        *value = (*value << 4) | HexValue(*s++);
+    }
+    return s;
+}
+
+static char *PutHexByte(char *out, uint8_t value) {
+    static const char hex[] = "0123456789abcdef";
+    *out++ = hex[value >> 4];
+    *out++ = hex[value & 0xf];
+    return out;
+}
+
+void GdbSend(Debugger *dbg, const char *data) {
+    // Frames data as $data#checksum
+    size_t length = strlen(data);
+    char *frame = malloc(length + 5);
+    uint8_t sum = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        sum += (uint8_t)data[i];
+    }
+    frame[0] = '$';
+    memcpy(&frame[1], data, length);
+    frame[length + 1] = '#';
+    PutHexByte(&frame[length + 2], sum);
+
+    if (write(dbg->fd, frame, length + 4) < 0) {
+        dbg->attached = 0;
+    }
+    free(frame);
+}
+
+int GdbReceive(Debugger *dbg) {
+    // Reads the next packet into dbg->packet. Returns its length, 0 for a
+    // break request (^C) and -1 if the connection is gone.
+    char c;
+    int length = 0;
+
+    for (;;) {
+        if (read(dbg->fd, &c, 1) != 1) {
+            return -1;
+        }
+        if (c == 0x03) {
+            return 0;
+        }
+        if (c == '$') {
+            break;
+        }
+        // acks ('+'/'-') and noise between packets are ignored
+    }
+
+    for (;;) {
+        if (read(dbg->fd, &c, 1) != 1) {
+            return -1;
+        }
+        if (c == '#') {
+            break;
+        }
+        if (length < GDB_PACKET_SIZE - 1) {
+            dbg->packet[length++] = c;
+        }
+    }
+    dbg->packet[length] = '\0';
+
+    char checksum[2];
+    if (read(dbg->fd, checksum, 2) != 2) {
+        return -1;
+    }
+    if (write(dbg->fd, "+", 1) != 1) {
+        return -1;
+    }
+    return length > 0 ? length : 1;
+}
+
+void GdbStopReply(Debugger *dbg) {
+    // SIGTRAP, with the address for watchpoints
+    char reply[64];
+    if (dbg->watch_hit) {
+        const char *kind = dbg->watch_hit == WATCH_WRITE ? "watch" : dbg->watch_hit == WATCH_READ ? "rwatch" : "awatch";
+        snprintf(reply, sizeof(reply), "T05%s:%x;", kind, dbg->watch_addr);
+    } else {
+        snprintf(reply, sizeof(reply), "S05");
+    }
+    GdbSend(dbg, reply);
+}
+
+void DebuggerDetach(Debugger *dbg) {
+    // Drops all breakpoints and watchpoints and lets the machine run freely
+    memset(dbg->breakpoints, 0, sizeof(dbg->breakpoints));
+    dbg->watch_count = 0;
+    UpdateWatchedPages(dbg);
+    dbg->stepping = 0;
+    dbg->attached = 0;
+    if (dbg->fd >= 0) {
+        close(dbg->fd);
+        dbg->fd = -1;
+    }
+}
+
+void DebuggerStop(Debugger *dbg) {
+    // Reports the stop to GDB and serves requests until it resumes the machine
+    State8080 *state = dbg->state;
+    char reply[GDB_PACKET_SIZE];
+
+    GdbStopReply(dbg);
+    dbg->watch_hit = 0;
+    dbg->stepping = 0;
+
+    while (dbg->attached) {
+        int length = GdbReceive(dbg);
+        if (length < 0) {
+            DebuggerDetach(dbg);
+            return;
+        }
+        if (length == 0) {
+            // break request while already stopped
+            GdbStopReply(dbg);
+            continue;
+        }
+
+        const char *p = dbg->packet;
+        uint32_t addr, count, value;
+        reply[0] = '\0';
+
+        switch (*p++) {
+            case '?':
+                GdbStopReply(dbg);
+                continue;
+            case 'g':
+                {
+                    char *out = reply;
+                    for (int i = 0; i < GDB_REGISTERS; i++) {
+                        uint16_t r = GetRegister(state, i);
+                        out = PutHexByte(out, r & 0xff);     // little endian
+                        out = PutHexByte(out, r >> 8);
+                    }
+                    *out = '\0';
+                }
+                break;
+            case 'G':
+                for (int i = 0; i < GDB_REGISTERS && strlen(p) >= 4; i++, p += 4) {
+                    uint32_t lo, hi;
+                    char byte[3] = { p[0], p[1], 0 };
+                    ParseHex(byte, &lo);
+                    byte[0] = p[2]; byte[1] = p[3];
+                    ParseHex(byte, &hi);
+                    SetRegister(state, i, hi << 8 | lo);
+                }
+                strcpy(reply, "OK");
+                break;
+            case 'p':
+                {
+                    ParseHex(p, &value);
+                    uint16_t r = GetRegister(state, value);
+                    PutHexByte(PutHexByte(reply, r & 0xff), r >> 8)[0] = '\0';
+                }
+                break;
+            case 'P':
+                {
+                    uint32_t n, lo, hi;
+                    p = ParseHex(p, &n);
+                    if (*p == '=' && strlen(p + 1) >= 4) {
+                        char byte[3] = { p[1], p[2], 0 };
+                        ParseHex(byte, &lo);
+                        byte[0] = p[3]; byte[1] = p[4];
+                        ParseHex(byte, &hi);
+                        SetRegister(state, n, hi << 8 | lo);
+                    }
+                    strcpy(reply, "OK");
+                }
+                break;
+            case 'm':
+                {
+                    p = ParseHex(p, &addr);
+                    if (*p == ',') {
+                        ParseHex(p + 1, &count);
+                    } else {
+                        count = 0;
+                    }
+                    if (count > (GDB_PACKET_SIZE - 1) / 2) {
+                        count = (GDB_PACKET_SIZE - 1) / 2;
+                    }
+                    char *out = reply;
+                    dbg->inspecting = 1;
+                    for (uint32_t i = 0; i < count; i++) {
+                        out = PutHexByte(out, BusRead(state->bus, (uint16_t)(addr + i)));
+                    }
+                    dbg->inspecting = 0;
+                    *out = '\0';
+                }
+                break;
+            case 'M':
+                {
+                    p = ParseHex(p, &addr);
+                    p = ParseHex(p + 1, &count);
+                    p++;    // ':'
+                    dbg->inspecting = 1;
+                    for (uint32_t i = 0; i < count && HexValue(p[0]) >= 0 && HexValue(p[1]) >= 0; i++, p += 2) {
+                        BusWrite(state->bus, (uint16_t)(addr + i), HexValue(p[0]) << 4 | HexValue(p[1]));
+                    }
+                    dbg->inspecting = 0;
+                    strcpy(reply, "OK");
+                }
+                break;
+            case 'Z':
+            case 'z':
+                {
+                    // Z<type>,<addr>,<kind>: 0/1 breakpoints, 2 write, 3 read, 4 access watchpoints
+                    int insert = dbg->packet[0] == 'Z';
+                    int type = *p - '0';
+                    p = ParseHex(p + 2, &addr);
+                    ParseHex(p + 1, &count);
+                    int ok = 0;
+                    if (type == 0 || type == 1) {
+                        if (insert) SetBreakpoint(dbg, addr); else ClearBreakpoint(dbg, addr);
+                        ok = 1;
+                    } else if (type >= 2 && type <= 4) {
+                        int kind = type == 2 ? WATCH_WRITE : type == 3 ? WATCH_READ : WATCH_ACCESS;
+                        ok = (insert ? AddWatchpoint(dbg, addr, count, kind) : RemoveWatchpoint(dbg, addr, count, kind)) == 0;
+                    }
+                    strcpy(reply, ok ? "OK" : "E01");
+                    if (type > 4) {
+                        reply[0] = '\0';    // unsupported
+                    }
+                }
+                break;
+            case 'c':
+                if (*p) {
+                    ParseHex(p, &addr);
+                    state->pc = addr;
+                }
+                dbg->resuming = 1;
+                return;
+            case 's':
+                if (*p) {
+                    ParseHex(p, &addr);
+                    state->pc = addr;
+                }
+                dbg->resuming = 1;
+                dbg->stepping = 1;
+                return;
+            case 'H':
+                strcpy(reply, "OK");
+                break;
+            case 'q':
+                if (strncmp(dbg->packet, "qSupported", 10) == 0) {
+                    snprintf(reply, sizeof(reply), "PacketSize=%x", GDB_PACKET_SIZE - 16);
+                } else if (strcmp(dbg->packet, "qAttached") == 0) {
+                    strcpy(reply, "1");
+                } else if (strcmp(dbg->packet, "qC") == 0) {
+                    strcpy(reply, "QC1");
+                }
+                break;
+            case 'D':
+                GdbSend(dbg, "OK");
+                DebuggerDetach(dbg);
+                return;
+            case 'k':
+                DebuggerDetach(dbg);
+                exit(0);
+        }
+        GdbSend(dbg, reply);
+    }
+}
+
+int DebuggerBreakRequested(Debugger *dbg) {
+    // Non blocking check for a ^C from GDB while the machine runs
+    struct pollfd pfd = { dbg->fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 0) <= 0) {
+        return 0;
+    }
+
+    char c;
+    if (read(dbg->fd, &c, 1) != 1) {
+        DebuggerDetach(dbg);
+        return 0;
+    }
+    return c == 0x03;
+}
+
+Debugger* DebuggerListen(State8080 *state, int port) {
+    // Waits for GDB on 127.0.0.1:port. The machine is stopped before its
+    // first instruction once GDB connects. Returns NULL on failure.
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return NULL;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+        perror("gdb stub");
+        close(fd);
+        return NULL;
+    }
+
+    printf("Waiting for GDB on localhost:%d\n", port);
+    int client = accept(fd, NULL, NULL);
+    if (client < 0) {
+        perror("accept");
+        close(fd);
+        return NULL;
+    }
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    Debugger *dbg = calloc(1, sizeof(Debugger));
+    dbg->state = state;
+    dbg->listen_fd = fd;
+    dbg->fd = client;
+    dbg->attached = 1;
+    dbg->stepping = 1;      // report a stop before the first instruction
+    state->bus->debug = dbg;
+    return dbg;
+}
+
+#else
+
+void DebuggerStop(Debugger *dbg) {
+    dbg->attached = 0;
+}
+
+int DebuggerBreakRequested(Debugger *dbg) {
+    return 0;
+}
+
+Debugger* DebuggerListen(State8080 *state, int port) {
+    printf("error: the GDB stub is not available on Windows\n");
+    return NULL;
+}
+
+#endif
+
+int DebuggerRun(Debugger *dbg, State8080 *state, int cycles, int until) {
+    // Debug version of the run loop: executes until the cycle count reaches
+    // until, stopping for GDB on breakpoints, watchpoints and single steps.
+    // Returns the updated cycle count.
+    if (dbg->stepping || DebuggerBreakRequested(dbg)) {
+        DebuggerStop(dbg);
+    }
+
+    while (cycles < until && dbg->attached) {
+        if (!dbg->resuming && BreakpointAt(dbg, state->pc)) {
+            DebuggerStop(dbg);
+            continue;
+        }
+        dbg->resuming = 0;
+
+        if (state->halted && !dbg->stepping) {
+            // Breakpoints can't hit before an interrupt wakes the CPU
+            return Run8080(state, cycles, until);
+        }
+        cycles += Emulate8080(state);
+
+        if (dbg->stepping || dbg->watch_hit) {
+            DebuggerStop(dbg);
+        }
+    }
+
+    // Plain run loop once GDB has detached
+    return Run8080(state, cycles, until);
+}
+
+#endif
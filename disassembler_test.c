@@ -3,34 +3,97 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "./disassembler/disassembler.h"
+#include "./analysis/analysis.h"
 
-int main (int argc, char**argv)    
-   {    
-    FILE *f= fopen("./ROMs/invaders", "rb");    
-    if (f==NULL)    
-    {    
-        printf("error: Couldn't open file\n");    
-        exit(1);    
-    }    
+#define BENCH_PASSES  500
 
-    //Get the file size and read it into a memory buffer    
-    fseek(f, 0L, SEEK_END);    
-    int fsize = ftell(f);    
-    fseek(f, 0L, SEEK_SET);    
+int main (int argc, char**argv)
+   {
+    FILE *f= fopen("./ROMs/invaders", "rb");
+    if (f==NULL)
+    {
+        printf("error: Couldn't open file\n");
+        exit(1);
+    }
 
-    unsigned char *buffer=malloc(fsize);    
+    //Get the file size and read it into a memory buffer
+    fseek(f, 0L, SEEK_END);
+    int fsize = ftell(f);
+    fseek(f, 0L, SEEK_SET);
 
-    fread(buffer, fsize, 1, f);    
-    fclose(f);    
+    unsigned char *buffer=calloc(fsize + 2, 1);     // padding so the last instruction can't read past the end
+
+    fread(buffer, fsize, 1, f);
+    fclose(f);
+
+    // Find the code reachable from the reset and interrupt vectors so data
+    // tables are not decoded as instructions
+    CodeMap cm;
+    AnalyzeImage(&cm, buffer, fsize, 0, INVADERS_ENTRY_POINTS, INVADERS_ENTRY_COUNT);
 
     int pc = 0;                         // program counter
+    int code_bytes = 0;
+
+    while (pc < fsize)                  // loop through buffer and disassemble one instruction at a time
+    {
+        if (cm.map[pc] & MAP_OPCODE) {
+            code_bytes -= pc;
+            pc += Disassembler(buffer, pc); // increment pc by the number of bytes used by the instruction
+            code_bytes += pc;
+        } else {
+            // print runs of data as DB lines of up to 8 bytes
+            printf("%04x  DB      ", pc);
+            for (int i = 0; i < 8 && pc < fsize && !(cm.map[pc] & MAP_OPCODE); i++, pc++) {
+                printf(i ? ", $%02x" : "$%02x", buffer[pc]);
+            }
+            printf("\n");
+        }
+    }
+
+    printf("\n%d basic blocks, %d code bytes, %d data bytes\n", cm.block_count, code_bytes, fsize - code_bytes);
+
+    // Optionally persist the map for the emulator and other tools
+    if (argc > 1) {
+        CodeMap loaded;
+        if (SaveCodeMap(&cm, argv[1]) != 0 || LoadCodeMap(&loaded, argv[1], cm.crc32) != 0 ||
+            loaded.block_count != cm.block_count || memcmp(loaded.map, cm.map, cm.size) != 0) {
+            printf("error: Couldn't save code map to %s\n", argv[1]);
+            exit(1);
+        }
+        FreeCodeMap(&loaded);
+    }
+    FreeCodeMap(&cm);
+
+    // Throughput benchmark: decode and format the whole ROM into one text buffer
+    size_t text_size = (size_t)fsize * (INSTRUCTION_TEXT_MAX + 1);
+    char *text = malloc(text_size);
+    long instructions = 0;
+    size_t pos = 0;
+
+    clock_t start = clock();
+    for (int pass = 0; pass < BENCH_PASSES; pass++) {
+        Instruction ins;
+        pos = 0;
+        pc = 0;
+        while (pc < fsize) {
+            pc += DecodeInstruction(&buffer[pc], pc, &ins);
+            pos = FormatInstruction(&ins, text, pos, text_size);
+            text[pos++] = '\n';
+            instructions++;
+        }
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    if (seconds > 0) {
+        printf("\n%ld instructions (%d passes, %zu bytes of text per pass) in %.3f s: %.1f M instructions/s, %.1f MB/s of ROM\n",
+               instructions, BENCH_PASSES, pos, seconds, instructions / seconds / 1e6,
+               (double)fsize * BENCH_PASSES / seconds / 1e6);
+    }
 
-    while (pc < fsize)                  // loop through buffer and disassemble one instruction at a time    
-    {    
-        pc += Disassembler(buffer, pc); // increment pc by the number of bytes used by the instruction
-    }    
-    return 0;    
-   } 
-      
\ No newline at end of file
+    free(text);
+    free(buffer);
+    return 0;
+   }
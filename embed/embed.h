@@ -0,0 +1,78 @@
+#ifndef EMBED_H
+#define EMBED_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../romset/romset.h"
+
+/* ROM images linked into the executable.
+
+Built with EMBED_ASSETS defined (make EMBED=1), the assembler's .incbin
+copies the ROM files into the read only data of the program that includes
+this header. LoadInvadersRomSet then verifies them in place and the bus
+pages point straight at them, so startup opens no files and the program
+runs from any directory. Without EMBED_ASSETS it maps ./ROMs as before.
+
+.incbin paths are relative to where the compiler runs, so build from the
+repository root or point EMBED_DIR at the ROMs. Include this in a single
+translation unit only, it defines the symbols. See embed/sounds.h for the
+sound samples. */
+
+#ifndef EMBED_DIR
+    #define EMBED_DIR  "ROMs"
+#endif
+
+#define EMBED_STR_(x)  #x
+#define EMBED_STR(x)   EMBED_STR_(x)
+
+#if defined(__APPLE__)
+    #define EMBED_SECTION  "__TEXT,__const"
+#elif defined(_WIN32)
+    #define EMBED_SECTION  ".rdata,\"dr\""
+#else
+    #define EMBED_SECTION  ".rodata"
+#endif
+
+// Defines sym and sym_end around the contents of EMBED_DIR/file
+#define EMBED_FILE(sym, file)                                                       \
+    __asm__(".pushsection " EMBED_SECTION "\n"                                      \
+            ".balign 16\n"                                                          \
+            ".globl " EMBED_STR(__USER_LABEL_PREFIX__) #sym "\n"                    \
+            ".globl " EMBED_STR(__USER_LABEL_PREFIX__) #sym "_end\n"                \
+            EMBED_STR(__USER_LABEL_PREFIX__) #sym ":\n"                             \
+            ".incbin \"" EMBED_DIR "/" file "\"\n"                                  \
+            EMBED_STR(__USER_LABEL_PREFIX__) #sym "_end:\n"                         \
+            ".popsection\n");                                                       \
+    extern const uint8_t sym[], sym##_end[]
+
+#ifdef EMBED_ASSETS
+
+EMBED_FILE(embedded_invaders_h, "invaders.h");
+EMBED_FILE(embedded_invaders_g, "invaders.g");
+EMBED_FILE(embedded_invaders_f, "invaders.f");
+EMBED_FILE(embedded_invaders_e, "invaders.e");
+
+#endif
+
+int LoadInvadersRomSet(RomSet *set, const char *dir) {
+    // The embedded images if there are any, otherwise the ones in dir.
+    // Returns 0 on success, -1 (with an error printed) on failure.
+#ifdef EMBED_ASSETS
+    // Same order as INVADERS_MANIFEST
+    const uint8_t *const images[4] = {
+        embedded_invaders_h, embedded_invaders_g, embedded_invaders_f, embedded_invaders_e,
+    };
+    const size_t sizes[4] = {
+        embedded_invaders_h_end - embedded_invaders_h, embedded_invaders_g_end - embedded_invaders_g,
+        embedded_invaders_f_end - embedded_invaders_f, embedded_invaders_e_end - embedded_invaders_e,
+    };
+    return AttachRomSet(set, INVADERS_MANIFEST, images, sizes, INVADERS_MANIFEST_COUNT);
+#else
+    return LoadRomSet(set, dir, INVADERS_MANIFEST, INVADERS_MANIFEST_COUNT);
+#endif
+}
+
+#endif
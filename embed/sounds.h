@@ -0,0 +1,52 @@
+#ifndef EMBED_SOUNDS_H
+#define EMBED_SOUNDS_H
+
+#include "./embed.h"
+#include "../mixer/mixer.h"
+
+/* Sound samples linked into the executable, like the ROMs in embed/embed.h.
+
+The WAV files are embedded as they are and decoded at startup by the same
+code that reads them from disk. */
+
+#ifdef EMBED_ASSETS
+
+EMBED_FILE(embedded_sound_0, "sound/0.wav");
+EMBED_FILE(embedded_sound_1, "sound/1.wav");
+EMBED_FILE(embedded_sound_2, "sound/2.wav");
+EMBED_FILE(embedded_sound_3, "sound/3.wav");
+EMBED_FILE(embedded_sound_4, "sound/4.wav");
+EMBED_FILE(embedded_sound_5, "sound/5.wav");
+EMBED_FILE(embedded_sound_6, "sound/6.wav");
+EMBED_FILE(embedded_sound_7, "sound/7.wav");
+EMBED_FILE(embedded_sound_8, "sound/8.wav");
+
+#endif
+
+int LoadInvadersSounds(Mixer *mixer, const char *dir) {
+    // The embedded samples if there are any, otherwise dir/0.wav to dir/8.wav.
+    // Returns the number that failed, those stay silent.
+#ifdef EMBED_ASSETS
+    const uint8_t *const start[MIXER_SOUNDS] = {
+        embedded_sound_0, embedded_sound_1, embedded_sound_2, embedded_sound_3, embedded_sound_4,
+        embedded_sound_5, embedded_sound_6, embedded_sound_7, embedded_sound_8,
+    };
+    const uint8_t *const end[MIXER_SOUNDS] = {
+        embedded_sound_0_end, embedded_sound_1_end, embedded_sound_2_end, embedded_sound_3_end, embedded_sound_4_end,
+        embedded_sound_5_end, embedded_sound_6_end, embedded_sound_7_end, embedded_sound_8_end,
+    };
+    int failed = 0;
+    for (int i = 0; i < MIXER_SOUNDS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "embedded %d.wav", i);
+        if (ParseWavSample(&mixer->sounds[i], start[i], end[i] - start[i], name) != 0) {
+            failed++;
+        }
+    }
+    return failed;
+#else
+    return MixerLoadSounds(mixer, dir);
+#endif
+}
+
+#endif
@@ -1,7 +1,15 @@
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
+
+#include "../memory/memory.h"
+#include "../disassembler/disassembler.h"
+#include "../trace/trace.h"
 
 #define  ADD   0
 #define  SUB   1
@@ -18,7 +26,21 @@ typedef struct ConditionCodes {
 	uint8_t		pad:3;
 } ConditionCodes;
 
-ConditionCodes CC_ZSPAC = {1,1,1,0,1};
+#define IDLE_LOOP_MAX     32        // longest loop, in bytes, checked for idle skipping
+#define IDLE_CACHE_SIZE   256       // must be a power of two
+#define IDLE_BACKOFF_MAX  8         // a loop that keeps working is probed every 2^8th time at most
+
+#define IDLE_UNKNOWN  0
+#define IDLE_PURE     1             // loop body only reads memory and registers
+#define IDLE_IMPURE   2
+
+typedef struct IdleEntry {
+	uint16_t	target;				// loop head
+	uint16_t	branch;				// address of the backward jump
+	uint8_t		verdict;			// IDLE_*, only kept for loops in ROM
+	uint8_t		misses;				// probes in a row that found the loop still working
+	uint16_t	backoff;			// times the jump is taken before the next probe
+} IdleEntry;
 
 typedef struct State8080 {
 	uint8_t		a;
@@ -30,50 +52,49 @@ typedef struct State8080 {
 	uint8_t		l;
 	uint16_t	sp;
 	uint16_t	pc;
-	uint8_t		*memory;
+	uint8_t		*memory;				// host backing store for the mapped RAM/ROM
+	MemoryBus	*bus;					// every CPU memory access goes through the bus
 	struct ConditionCodes		cc;
 	uint8_t		int_enable;
+	uint8_t		halted;					// stopped by HLT until the next interrupt
+	uint64_t	cycles;					// total cycles executed
+	uint8_t		(*port_in)(struct State8080* state, uint8_t port);					// IN handler, NULL reads 0
+	void		(*port_out)(struct State8080* state, uint8_t port, uint8_t value);	// OUT handler, NULL ignores
+	Trace		*trace;					// records every instruction when not NULL
+	void		*machine;				// machine owning this CPU, for the port handlers
+	uint8_t		strict;					// Run8080 executes every instruction, no idle loop skipping
+	uint8_t		trap_faults;			// unimplemented opcodes set faulted instead of exiting
+	uint8_t		faulted;
+	uint16_t	fault_pc;				// address of the unimplemented opcode
+	uint8_t		quiet_ports[32];		// bit per port, OUT has no effect (watchdogs, ...)
+	uint64_t	idle_cycles;			// cycles skipped in idle loops
+	IdleEntry	idle[IDLE_CACHE_SIZE];	// loops seen, by branch address
 } State8080;
 
-// number of cycles to complete each instruction by opcode
-unsigned char cycles[] = {
-     4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5, 7,  4,  // 0x00 - 0x0f
-     4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5, 7,  4,  // 0x10 - 0x1f
-     4, 10, 16,  5,  5,  5,  7,  4,  4, 10, 16,  5,  5,  5, 7,  4,  // 0x20 - 0x2f
-     4, 10, 13,  5, 10, 10, 10,  4,  4, 10, 13,  5,  5,  5, 7,  4,  // 0x30 - 0x3f
-	 5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5, 7,  5,  // 0x40 - 0x4f
-	 5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5, 7,  5,  // 0x50 - 0x5f
-	 5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5, 7,  5,  // 0x60 - 0x6f
-	 7,  7,  7,  7,  7,  7,  7,  7,  5,  5,  5,  5,  5,  5, 7,  5,  // 0x70 - 0x7f
-	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4, 7,  4,  // 0x80 - 0x8f
-	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4, 7,  4,  // 0x90 - 0x9f
-	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4, 7,  4,  // 0xa0 - 0xaf
-	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4, 7,  4,  // 0xb0 - 0xbf
-	11, 10, 10, 10, 17, 11,  7, 11, 11, 10, 10, 10, 10, 17, 7, 11,  // 0xc0 - 0xcf
-	11, 10, 10, 10, 17, 11,  7, 11, 11, 10, 10, 10, 10, 17, 7, 11,  // 0xd0 - 0xdf
-	11, 10, 10, 18, 17, 11,  7, 11, 11,  5, 10,  5, 17, 17, 7, 11,  // 0xe0 - 0xef
-	11, 10, 10,  4, 17, 11,  7, 11, 11,  5, 10,  4, 17, 17, 7, 11,  // 0xf0 - 0xff
-};
-
-typedef struct {
-    int size;
-    uint8_t *mem;
-} mem_t;
-
-mem_t *mem_new(int size) {
-    mem_t *mem = malloc(sizeof(mem_t));
-    mem->size = size;
-
-    mem->mem = malloc(sizeof(uint8_t) * size);
-
-    return mem;
-}
+// Registers by their 3 bit index in the opcodes. M is the memory at HL and
+// has no slot of its own, see OPERAND.
+#define REG_B  0
+#define REG_C  1
+#define REG_D  2
+#define REG_E  3
+#define REG_H  4
+#define REG_L  5
+#define REG_M  6
+#define REG_A  7
+
+#define REGISTER_OFFSET(r)  ((r) == REG_B ? offsetof(State8080, b) : (r) == REG_C ? offsetof(State8080, c) : \
+                             (r) == REG_D ? offsetof(State8080, d) : (r) == REG_E ? offsetof(State8080, e) : \
+                             (r) == REG_H ? offsetof(State8080, h) : (r) == REG_L ? offsetof(State8080, l) : \
+                             offsetof(State8080, a))
+#define REGISTER(state, r)  (*((uint8_t *)(state) + REGISTER_OFFSET(r)))
+
+#ifndef CORE8080_LIBRARY
 
 void GenerateInterrupt(State8080* state, int interrupt_num) {    
     //perform "PUSH PC"    
     // Push PC onto stack
-    state->memory[state->sp-1] = (state->pc & 0xFF00) >> 8;
-    state->memory[state->sp-2] = (state->pc & 0xff);
+    BusWrite(state->bus, state->sp-1, (state->pc & 0xFF00) >> 8);
+    BusWrite(state->bus, state->sp-2, (state->pc & 0xff));
     // Decrement pointer
     state->sp = state->sp - 2;
 
@@ -81,6 +102,7 @@ void GenerateInterrupt(State8080* state, int interrupt_num) {
     //This is identical to an "RST interrupt_num" instruction.    
     state->pc = 8 * interrupt_num;
     state->int_enable = 0;    
+    state->halted = 0;
 }
 
 int ParityCheck(uint8_t value) {
@@ -100,7 +122,7 @@ int ParityCheck(uint8_t value) {
     return 0;
 }
 
-void HandleZSP_Flags(State8080* state, uint16_t result) {
+static void HandleZSP_Flags(State8080* state, uint16_t result) {
     // Handle zero flag
     if ((result & 0xff) == 0) { state->cc.z = 1; }
     else { state->cc.z = 0; }
@@ -114,37 +136,38 @@ void HandleZSP_Flags(State8080* state, uint16_t result) {
     return;
 }
 
-void Arithmetic(State8080* state, uint8_t operand, uint8_t operation, uint8_t carry) {
+static void Arithmetic(State8080* state, uint8_t operand, uint8_t operation, uint8_t carry) {
     // Handles ADD, ADI, ADC, ACI, SUB, SUI, SBB, SBI instructions
+    // The carry bit joins the sum rather than the operand, so ADC of $ff
+    // with carry set still carries out
+    uint8_t cy = carry ? state->cc.cy : 0;
     uint16_t result;
-    // Handle operations that use carry bit
-    if (carry) {
-        operand += state->cc.cy;
-    }
 
     // Addition
     if (operation == ADD) {
-        result = state->a + operand;
+        result = state->a + operand + cy;
+        state->cc.ac = ((state->a ^ operand ^ result) & 0x10) != 0;   // carry out of bit 3
     }
     // Subtraction
-    else if (operation == SUB) {
-        result = state->a + (uint8_t)(~operand + 1); // add two's complement of the operand
+    else {
+        // The 8080 adds the complement of the operand, carry is the borrow
+        // and auxiliary carry the carry out of bit 3 of that addition
+        result = state->a - operand - cy;
+        state->cc.ac = ((state->a ^ operand ^ result) & 0x10) == 0;
     }
 
     // Handle Zero, Sign, and Parity flags
     HandleZSP_Flags(state, result);
 
-    // Handle carry flag
-    if (result > 0xff) { state->cc.cy = 1; }
-    else { state->cc.cy = 0; }
-    if (operation == 1) { state->cc.cy ^= 1; }  // carry works opposite in subtraction, so flip bit
+    // Handle carry flag, a borrow wraps result past $ff too
+    state->cc.cy = result > 0xff;
 
     // Store result in A
     state->a = (result & 0xff);
     return;
 }
 
-void DAD(State8080 *state, uint32_t reg_pair) {
+static void DAD(State8080 *state, uint32_t reg_pair) {
     // Add register pair to HL (16 bit add)
     uint32_t hl = (state->h << 8 | state->l);
     uint32_t result = reg_pair + hl;
@@ -159,59 +182,65 @@ void DAD(State8080 *state, uint32_t reg_pair) {
     return;
 }
 
-void INR(State8080 *state, uint8_t *reg) {
+static void INR(State8080 *state, uint8_t *reg) {
     // Increments register and handles flags
     *reg += 0x01;
     HandleZSP_Flags(state, *reg);
+    state->cc.ac = (*reg & 0x0f) == 0;
     return;
 }
 
-void DCR(State8080 *state, uint8_t *reg) {
+static void DCR(State8080 *state, uint8_t *reg) {
     // Decrements register and handles flags
     *reg -= 0x01;
     HandleZSP_Flags(state, *reg);
+    state->cc.ac = (*reg & 0x0f) != 0x0f;
     return;
 }
 
-void MOV(uint8_t *reg, uint8_t value) {
+static void MOV(uint8_t *reg, uint8_t value) {
     // Moves a value into a specified register
     *reg = value;
     return;
 }
 
-void JMP (State8080* state, unsigned char* code) {
+static void JMP (State8080* state, unsigned char* code) {
     // Create 16bit address from the opcodes
     // Left shift larger byte due to format being little endian
     // Jump to the 16bit address
     state->pc = (code[2] << 8) | code[1];
 }
 
-void CALL (State8080* state, unsigned char* code) {
+static void CALL (State8080* state, unsigned char* code) {
     uint16_t ret = state->pc+2;
 
+    // Create 16bit address from the codes before the push, code may point
+    // at the memory the stack overwrites
+    // Leftshift larger byte due to format being little endian
+    uint16_t target = (code[2] << 8) | code[1];
+
     //Save upper byte
-    state->memory[state->sp-1] = (ret >> 8) & 0xff;
+    BusWrite(state->bus, state->sp-1, (ret >> 8) & 0xff);
 
     // Save lower byte
-    state->memory[state->sp-2] = (ret & 0xff);
+    BusWrite(state->bus, state->sp-2, (ret & 0xff));
 
     // Update stack pointer
     state->sp = state->sp - 2;
 
-    // Create 16bit address from the codes
-    // Leftshift larger byte due to format being little endian
     // Set pc to the target 16bit address
-    state->pc = (code[2] << 8) | code[1];
+    state->pc = target;
 }
 
-void RST (State8080* state, uint8_t num) {
-    uint16_t ret = state->pc+2;
+static void RST (State8080* state, uint8_t num) {
+    // RST is a single byte, pc already points at the next instruction
+    uint16_t ret = state->pc;
 
     //Save upper byte
-    state->memory[state->sp-1] = (ret >> 8) & 0xff;
+    BusWrite(state->bus, state->sp-1, (ret >> 8) & 0xff);
 
     // Save lower byte
-    state->memory[state->sp-2] = (ret & 0xff);
+    BusWrite(state->bus, state->sp-2, (ret & 0xff));
 
     // Update stack pointer
     state->sp = state->sp - 2;
@@ -223,19 +252,21 @@ void RST (State8080* state, uint8_t num) {
     state->pc = (num << 3) | 0x0000;
 }
 
-void RET(State8080* state) {
+static void RET(State8080* state) {
     // Set pc to the 16bit address taken from the stack
     // Left shift the upper byte and use inclusive OR to create the
     // 16bit address
-    state->pc = state->memory[state->sp] | (state->memory[state->sp+1] << 8);
+    state->pc = BusRead(state->bus, state->sp) | (BusRead(state->bus, state->sp+1) << 8);
 
     // Increment stack pointer
     state->sp += 2;
 }
 
-void AND(State8080* state, uint8_t reg) {
+static void AND(State8080* state, uint8_t reg) {
     // Logical AND reg with the accumulator
     // Value is stored in the accumulator
+    // Auxiliary carry is the OR of bit 3 of both operands
+    state->cc.ac = ((state->a | reg) & 0x08) != 0;
     state->a = state->a & reg;
     HandleZSP_Flags(state, state->a);
 
@@ -243,134 +274,231 @@ void AND(State8080* state, uint8_t reg) {
     state->cc.cy = 0;
 }
 
-void XOR(State8080* state, uint8_t reg) {
+static void XOR(State8080* state, uint8_t reg) {
     // Exclusive OR between reg and accumulator
     // Value stored in accumulator
     state->a = state->a ^ reg;
     HandleZSP_Flags(state, state->a);
 
-    // Resets carry bit to zero
+    // Resets carry and auxiliary carry bits to zero
     state->cc.cy = 0;
+    state->cc.ac = 0;
 }
 
-void ORA(State8080* state, uint8_t reg) {
+static void ORA(State8080* state, uint8_t reg) {
     // Inclusive OR between reg and accumulator
     // Value stored in accumulator
     state->a = state->a | reg;
     HandleZSP_Flags(state, state->a);
 
-    // Resets carry bit to zero
+    // Resets carry and auxiliary carry bits to zero
     state->cc.cy = 0;
+    state->cc.ac = 0;
 }
 
-void CMP(State8080* state, uint8_t reg) {
+static void CMP(State8080* state, uint8_t reg) {
     // Compares the specified register to the accumulator
     // Sets condition bits based on the result of the comparison
 
     // Subtraction logic taken from Arithmetic helper function
-    // add two's complement of the operand for subtraction
-    uint8_t result = state->a + (uint8_t)(~reg + 1);
+    uint16_t result = state->a - reg;
 
     // Handle Zero, Sign, and Parity flags
     HandleZSP_Flags(state, result);
 
-    // Handle carry flag
-    if (reg > state->a) { state->cc.cy = 1; }
-    else { state->cc.cy = 0; }
+    // Handle carry and auxiliary carry flags
+    state->cc.cy = result > 0xff;
+    state->cc.ac = ((state->a ^ reg ^ result) & 0x10) == 0;
+}
+
+uint8_t PackFlags(const State8080* state) {
+    // Flag register in PSW layout: S Z 0 AC 0 P 1 CY
+    return state->cc.s << 7 | state->cc.z << 6 | state->cc.ac << 4 | state->cc.p << 2 | 0x02 | state->cc.cy;
+}
+
+void UnpackFlags(State8080* state, uint8_t psw) {
+    state->cc.s = (psw >> 7) & 1;
+    state->cc.z = (psw >> 6) & 1;
+    state->cc.ac = (psw >> 4) & 1;
+    state->cc.p = (psw >> 2) & 1;
+    state->cc.cy = psw & 1;
 }
 
-void POP(State8080 *state, char pop) {
+static void POP(State8080 *state, char pop) {
     // Addition
     if (pop == 'B') {
         // Pop B and C from stack
-        state->c = state->memory[state->sp];
-        state->b = state->memory[state->sp+1];
+        state->c = BusRead(state->bus, state->sp);
+        state->b = BusRead(state->bus, state->sp+1);
         // Increment pointer
         state->sp += 2;
     } else if (pop == 'D') {
         // Pop D and E from stack
-        state->e = state->memory[state->sp];
-        state->d = state->memory[state->sp+1];
+        state->e = BusRead(state->bus, state->sp);
+        state->d = BusRead(state->bus, state->sp+1);
         // Increment pointer
         state->sp += 2;
     } else if (pop == 'H') {
         // Pop H and L from stack
-        state->l = state->memory[state->sp];
-        state->h = state->memory[state->sp+1];
+        state->l = BusRead(state->bus, state->sp);
+        state->h = BusRead(state->bus, state->sp+1);
         // Increment counter
         state->sp += 2;
     } else if (pop == 'P') {
         // Copy memory content into accumulator A
-        state->a = state->memory[state->sp+1];
+        state->a = BusRead(state->bus, state->sp+1);
         // Set psw variable by copying memory
         // content on top of stack. This is
         // for flag register F.
-        *(unsigned char*)&state->cc = state->memory[state->sp];
-        // Sets state cc struct values if equal
-        // to bitwise AND operation
-        //state->cc.z  = (0x01 == (psw & 0x01));
-        //state->cc.s  = (0x02 == (psw & 0x02));
-        //state->cc.p  = (0x04 == (psw & 0x04));
-        //state->cc.cy = (0x05 == (psw & 0x08));
-        //state->cc.ac = (0x10 == (psw & 0x10));
+        UnpackFlags(state, BusRead(state->bus, state->sp));
         // Increment pointer
         state->sp += 2;
     }
 }
 
-void PUSH(State8080 *state, char push) {
+static void PUSH(State8080 *state, char push) {
     // Addition
     if (push == 'B') {
         // Push B and C onto stack
-        state->memory[state->sp-1] = state->b;
-        state->memory[state->sp-2] = state->c;
+        BusWrite(state->bus, state->sp-1, state->b);
+        BusWrite(state->bus, state->sp-2, state->c);
         // Decrement pointer
         state->sp = state->sp - 2;
     } else if (push == 'D') {
         // Push D and E onto stack
-        state->memory[state->sp-1] = state->d;
-        state->memory[state->sp-2] = state->e;
+        BusWrite(state->bus, state->sp-1, state->d);
+        BusWrite(state->bus, state->sp-2, state->e);
         // Decrement pointer
         state->sp = state->sp - 2;
     } else if (push == 'H') {
         // Push H and L onto stack
-        state->memory[state->sp-1] = state->h;
-        state->memory[state->sp-2] = state->l;
+        BusWrite(state->bus, state->sp-1, state->h);
+        BusWrite(state->bus, state->sp-2, state->l);
         // Decrement pointer
         state->sp = state->sp - 2;
     } else if (push == 'P') {
         // Push accumulator A onto stack
-        state->memory[state->sp-1] = state->a;
-        // Create and set psw int variable by
-        // combining flag register F contained
-        // in state cc struct
-        uint8_t psw = (state->cc.z |
-                state->cc.s << 1 |
-                state->cc.p << 2 |
-                state->cc.cy << 3 |
-                state->cc.ac << 4 );
-        // Push psw onto stack and decrement pointer
-        state->memory[state->sp-2] = psw;
+        BusWrite(state->bus, state->sp-1, state->a);
+        // Push flag register F in PSW layout and decrement pointer
+        BusWrite(state->bus, state->sp-2, PackFlags(state));
         state->sp = state->sp - 2;
     }
 }
 
-void UnimplementedInstruction(State8080* state) {
-    // Print error along with associated instruction
+static void UnimplementedInstruction(State8080* state) {
+    // Print error along with associated instruction. Exits unless the
+    // caller traps faults, then pc stays at the opcode and faulted is set.
     printf ("Error: Unimplemented instruction\n");
     state->pc--;
-    Disassembler(state->memory, state->pc);
-    printf("\n");
+
+    uint8_t scratch[3];
+    Instruction ins;
+    char text[INSTRUCTION_TEXT_MAX];
+    DecodeInstruction(BusFetch(state->bus, state->pc, scratch), state->pc, &ins);
+    FormatInstruction(&ins, text, 0, sizeof(text));
+    printf("%04x  %s\n", state->pc, text);
+    if (state->trap_faults) {
+        state->faulted = 1;
+        state->fault_pc = state->pc;
+        return;
+    }
     exit(1);
 }
 
+static void TraceInstruction(State8080* state, const unsigned char *code) {
+    // Appends the instruction about to execute and the registers to the trace
+    TraceRecord *r = TraceReserve(state->trace);
+    r->cycle = state->cycles;
+    r->pc = state->pc;
+    r->sp = state->sp;
+    r->opcode = code[0];
+    r->operand[0] = code[1];
+    r->operand[1] = code[2];
+    r->a = state->a;
+    r->b = state->b;
+    r->c = state->c;
+    r->d = state->d;
+    r->e = state->e;
+    r->h = state->h;
+    r->l = state->l;
+    r->flags = PackFlags(state);
+    TraceCommit(state->trace);
+}
+
+int ConditionMet(State8080* state, uint8_t opcode) {
+    // Condition encoded in bits 3-5 of Jcc/Ccc/Rcc: NZ, Z, NC, C, PO, PE, P, M
+    switch ((opcode >> 3) & 7) {
+        case 0: return !state->cc.z;
+        case 1: return state->cc.z;
+        case 2: return !state->cc.cy;
+        case 3: return state->cc.cy;
+        case 4: return !state->cc.p;
+        case 5: return state->cc.p;
+        case 6: return !state->cc.s;
+    }
+    return state->cc.s;
+}
+
+/* Register operand groups.
+
+MOV r,r (0x40 - 0x7f) has the destination in bits 3-5 and the source in
+bits 0-2, the ALU group (0x80 - 0xbf) the operation and the source. All
+128 cases are generated from MOV_CASE and ALU_CASE. Every register index
+is a constant in its case, so each one compiles to its own short handler
+with nothing decoded at run time, and no variant can differ from the rest. */
+
+#define OPERAND(state, r)  ((r) == REG_M ? BusRead((state)->bus, (state)->h << 8 | (state)->l) : REGISTER(state, r))
+
+#define MOV_CASE(op)                                                                    \
+    case op:                                                                            \
+        if ((op) == 0x76) {                                                             \
+            state->halted = 1;              /* HLT takes the place of MOV M,M */        \
+        } else if (((op) >> 3 & 7) == REG_M) {                                          \
+            BusWrite(state->bus, state->h << 8 | state->l, REGISTER(state, (op) & 7));  \
+        } else {                                                                        \
+            REGISTER(state, (op) >> 3 & 7) = OPERAND(state, (op) & 7);                  \
+        }                                                                               \
+        break;
+
+#define ALU_CASE(op)                                                                    \
+    case op:                                                                            \
+        operand = OPERAND(state, (op) & 7);                                             \
+        switch ((op) >> 3 & 7) {                                                        \
+            case 0: goto alu_add;                                                       \
+            case 1: goto alu_adc;                                                       \
+            case 2: goto alu_sub;                                                       \
+            case 3: goto alu_sbb;                                                       \
+            case 4: goto alu_ana;                                                       \
+            case 5: goto alu_xra;                                                       \
+            case 6: goto alu_ora;                                                       \
+            default: goto alu_cmp;                                                      \
+        }
+
+#define OPCODES_8(X, first)   X(first) X(first + 1) X(first + 2) X(first + 3) \
+                              X(first + 4) X(first + 5) X(first + 6) X(first + 7)
+#define OPCODES_64(X, first)  OPCODES_8(X, first) OPCODES_8(X, first + 0x08) OPCODES_8(X, first + 0x10) \
+                              OPCODES_8(X, first + 0x18) OPCODES_8(X, first + 0x20) OPCODES_8(X, first + 0x28) \
+                              OPCODES_8(X, first + 0x30) OPCODES_8(X, first + 0x38)
+
 int Emulate8080(State8080* state) {
-	unsigned char *code = &state->memory[state->pc];
+	if (state->halted) {
+		// Nothing is fetched until an interrupt, time still passes
+		state->cycles += 4;
+		return 4;
+	}
+
+	uint8_t scratch[3];
+	unsigned char *code = BusFetch(state->bus, state->pc, scratch);
+	const OpcodeInfo *info = &OPCODE_INFO[*code];
 
-	//Disassembler(state->memory, state->pc);
+	if (state->trace) {
+		TraceInstruction(state, code);
+	}
 
 	state->pc += 1;				// inc pc by 1 since every instruction takes at least 1 byte
 
+	uint8_t operand;			// source of ALU_CASE
+
 	switch(*code) {
 	    case 0x00: break;  //	NOP
         case 0x01:  //  LXI   BC, 16bit_data
@@ -384,7 +512,7 @@ int Emulate8080(State8080* state) {
                   {
                     // Stores accumulator in memory pointed to by rp BC
                     uint16_t mem_reference = state->b << 8 | state->c;
-                    state->memory[mem_reference] = state->a;
+                    BusWrite(state->bus, mem_reference, state->a);
                     break;
                   }
         case 0x03: //	INX   BC
@@ -413,7 +541,7 @@ int Emulate8080(State8080* state) {
                   {
                     // Loads accumulator with value stored in memory pointed to by rp BC
                     uint16_t mem_reference = state->b << 8 | state->c;
-                    state->a = state->memory[mem_reference];
+                    state->a = BusRead(state->bus, mem_reference);
                     break;
                   }
         case 0x0b: //	DCX   BC
@@ -449,7 +577,7 @@ int Emulate8080(State8080* state) {
                   {
                     // Stores accumulator in memory pointed to by reg pair DE
                     uint16_t mem_reference = state->d << 8 | state->e;
-                    state->memory[mem_reference] = state->a;
+                    BusWrite(state->bus, mem_reference, state->a);
                     break;
                   }
         case 0x13: //  INX   DE
@@ -478,7 +606,7 @@ int Emulate8080(State8080* state) {
                   {
                     // Loads accumulator with value stored in memory pointed to by rp DE
                     uint16_t mem_reference = (state->d << 8) | state->e;
-                    state->a = state->memory[mem_reference];
+                    state->a = BusRead(state->bus, mem_reference);
                     break;
                   }
         case 0x1b: //	DCX   DE
@@ -513,8 +641,8 @@ int Emulate8080(State8080* state) {
                   {
                     // Store HL into passed address
                     uint16_t memory_reference = (code[2] << 8) | code[1];
-                    state->memory[memory_reference] = state->l;
-                    state->memory[memory_reference+1] = state->h;
+                    BusWrite(state->bus, memory_reference, state->l);
+                    BusWrite(state->bus, memory_reference+1, state->h);
                     state->pc += 2;
                     break;
                   }
@@ -530,22 +658,20 @@ int Emulate8080(State8080* state) {
         case 0x25: DCR(state, &state->h); break;                                //  DCR     H
         case 0x26: MOV(&state->h, code[1]); state->pc += 1; break;		          //	MVI     H, 8bit_data
         case 0x27: // DAA
-                  // only partial implementation sufficient to do hex->decimal conversion
+                  // Adds 6 to each digit that went past 9 or carried out,
+                  // carry is only ever set, never cleared
                   {
-                    if((state->a & 0x0f) > 0x09)
-                    {
-                      state->a += 0x06;
+                    uint8_t correction = 0;
+                    uint8_t carry = state->cc.cy;
+                    if (state->cc.ac || (state->a & 0x0f) > 0x09) {
+                      correction |= 0x06;
                     }
-                    if((state->a & 0xf0) > 0x90)
-                    {
-                      uint16_t result = state->a + 0x60;
-                      if (result > 0xff)
-                      {
-                        state->cc.cy = 1;
-                      }
-                      HandleZSP_Flags(state, result);
-                      state->a = (uint8_t)result;
+                    if (state->cc.cy || state->a > 0x99) {
+                      correction |= 0x60;
+                      carry = 1;
                     }
+                    Arithmetic(state, correction, ADD, NO_CARRY);
+                    state->cc.cy = carry;
                   }
                   break;
         case 0x28: break;		                                                    //	NOP
@@ -554,8 +680,8 @@ int Emulate8080(State8080* state) {
                   {
                     // Load value from passed address into HL
                     uint16_t memory_reference = code[1] | (code[2] << 8);
-                    state->l = state->memory[memory_reference];
-                    state->h = state->memory[memory_reference+1];
+                    state->l = BusRead(state->bus, memory_reference);
+                    state->h = BusRead(state->bus, memory_reference+1);
                     state->pc += 2;
                     break;
                   }
@@ -588,7 +714,7 @@ int Emulate8080(State8080* state) {
                   {
                     // Stores accumulator in memory at passed addr
                     uint16_t mem_reference = (code[2] << 8) | code[1];
-                    state->memory[mem_reference] = state->a;
+                    BusWrite(state->bus, mem_reference, state->a);
                     state->pc += 2;
                     break;
                   }
@@ -597,21 +723,25 @@ int Emulate8080(State8080* state) {
                   {
                     // Increment the value stored in memory referenced by HL
                     uint16_t mem_reference = (state->h << 8) | state->l;
-                    INR(state, &state->memory[mem_reference]);
+                    uint8_t value = BusRead(state->bus, mem_reference);
+                    INR(state, &value);
+                    BusWrite(state->bus, mem_reference, value);
                     break;
                   }
         case 0x35: //	DCR   M
                   {
                     // Decrement the value stored in memory referenced by HL
                     uint16_t mem_reference = (state->h << 8) | state->l;
-                    DCR(state, &state->memory[mem_reference]);
+                    uint8_t value = BusRead(state->bus, mem_reference);
+                    DCR(state, &value);
+                    BusWrite(state->bus, mem_reference, value);
                     break;
                   }
         case 0x36: //	MVI   M, 8bit_data
                   {
                     // Move passed value into memory at address referenced by HL
                     uint16_t mem_reference = (state->h << 8) | state->l;
-                    MOV(&state->memory[mem_reference], code[1]);
+                    BusWrite(state->bus, mem_reference, code[1]);
                     state->pc += 1;
                     break;
                   }                 
@@ -625,7 +755,7 @@ int Emulate8080(State8080* state) {
                   {
                     // Loads accumulator with value stored in memory at passed addr
                     uint16_t mem_reference = code[2] << 8 | code[1];
-                    state->a = state->memory[mem_reference];
+                    state->a = BusRead(state->bus, mem_reference);
                     state->pc += 2;
                     break;
                   }
@@ -637,314 +767,17 @@ int Emulate8080(State8080* state) {
                   // carry = !carry
                   state->cc.cy = !state->cc.cy;
                   break;
-        case 0x40: MOV(&state->b, state->b); break;       		                  //	MOV     B, B
-        case 0x41: MOV(&state->b, state->c); break;		                          //	MOV     B, C
-        case 0x42: MOV(&state->b, state->d); break;		                          //	MOV     B, D
-        case 0x43: MOV(&state->b, state->e); break;		                          //	MOV     B, E
-        case 0x44: MOV(&state->b, state->h); break;		    		                  //	MOV     B, H
-        case 0x45: MOV(&state->b, state->l); break;		    		                  //	MOV     B, L
-        case 0x46: //	MOV   B, M
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    MOV(&state->b, state->memory[mem_reference]);
-                    break;
-                  }
-        case 0x47: MOV(&state->b, state->a); break;		    		                  //	MOV     B, A
-        case 0x48: MOV(&state->c, state->b); break;		    		                  //	MOV     C, B
-        case 0x49: MOV(&state->c, state->c); break;		    		                  //	MOV     C, C
-        case 0x4a: MOV(&state->c, state->d); break;		    		                  //	MOV     C, D
-        case 0x4b: MOV(&state->c, state->e); break;		    		                  //	MOV     C, E
-        case 0x4c: MOV(&state->c, state->h); break;		    		                  //	MOV     C, H
-        case 0x4d: MOV(&state->c, state->l); break;		    		                  //	MOV     C, L
-        case 0x4e: //	MOV   C, M
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    MOV(&state->c, state->memory[mem_reference]);
-                    break;
-                  }
-        case 0x4f: MOV(&state->c, state->a); break;		    		                  //	MOV     C, A
-        case 0x50: MOV(&state->d, state->b); break;		    		                  //	MOV     D, B
-        case 0x51: MOV(&state->d, state->c); break;		    		                  //	MOV     D, C
-        case 0x52: MOV(&state->d, state->d); break;		    		                  //	MOV     D, D
-        case 0x53: MOV(&state->d, state->e); break;		    		                  //	MOV     D, E
-        case 0x54: MOV(&state->d, state->h); break;		    		                  //	MOV     D, H
-        case 0x55: MOV(&state->d, state->l); break;		    		                  //	MOV     D, L
-        case 0x56: //	MOV   D, M
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    MOV(&state->d, state->memory[mem_reference]);
-                    break;
-                  }
-        case 0x57: MOV(&state->d, state->a); break;		    		                  //	MOV     D, A
-        case 0x58: MOV(&state->e, state->b); break;		    		                  //	MOV     E, B
-        case 0x59: MOV(&state->e, state->c); break;		    		                  //	MOV     E, C
-        case 0x5a: MOV(&state->e, state->d); break;		    		                  //	MOV     E, D
-        case 0x5b: MOV(&state->e, state->e); break;		    		                  //	MOV     E, E
-        case 0x5c: MOV(&state->e, state->h); break;		    		                  //	MOV     E, H
-        case 0x5d: MOV(&state->e, state->l); break;		    		                  //	MOV     E, L
-        case 0x5e: //	MOV   E, M
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    MOV(&state->e, state->memory[mem_reference]);
-                    break;
-                  }
-        case 0x5f: MOV(&state->e, state->a); break;		    		                  //	MOV     E, A
-        case 0x60: MOV(&state->h, state->b); break;		    		                  //	MOV     H, B
-        case 0x61: MOV(&state->h, state->c); break;		    		                  //	MOV     H, C
-        case 0x62: MOV(&state->h, state->d); break;		    		                  //	MOV     H, D
-        case 0x63: MOV(&state->h, state->e); break;		    		                  //	MOV     H, E
-        case 0x64: MOV(&state->h, state->h); break;		    		                  //	MOV     H, H
-        case 0x65: MOV(&state->h, state->l); break;		    		                  //	MOV     H, L
-        case 0x66: //	MOV   H, M
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    MOV(&state->h, state->memory[mem_reference]);
-                    break;
-                  }
-        case 0x67: MOV(&state->h, state->a); break;		    		                  //	MOV     H, A
-        case 0x68: MOV(&state->l, state->b); break;		    		                  //	MOV     L, B
-        case 0x69: MOV(&state->l, state->c); break;		    		                  //	MOV     L, C
-        case 0x6a: MOV(&state->l, state->d); break;		    		                  //	MOV     L, D
-        case 0x6b: MOV(&state->l, state->e); break;		    		                  //	MOV     L, E
-        case 0x6c: MOV(&state->l, state->h); break;		    		                  //	MOV     L, H
-        case 0x6d: MOV(&state->l, state->l); break;		    		                  //	MOV     L, L
-        case 0x6e: //	MOV   L, M
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    MOV(&state->l, state->memory[mem_reference]);
-                    break;
-                  }
-        case 0x6f: MOV(&state->l, state->a); break;		    		                  //	MOV     L, A
-        case 0x70: //	MOV   M, B
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    MOV(&state->memory[mem_reference], state->b);
-                    break;
-                  }
-        case 0x71: //	MOV   M, C
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    MOV(&state->memory[mem_reference], state->c);
-                    break;
-                  }
-        case 0x72: //	MOV   M, D
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    MOV(&state->memory[mem_reference], state->d);
-                    break;
-                  }
-        case 0x73: //	MOV   M, E
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    MOV(&state->memory[mem_reference], state->e);
-                    break;
-                  }
-        case 0x74: //	MOV   M, H
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    MOV(&state->memory[mem_reference], state->h);
-                    break;
-                  }
-        case 0x75: // 	MOV   M, L
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    MOV(&state->memory[mem_reference], state->l);
-                    break;
-                  }
-        case 0x76: UnimplementedInstruction(state); break;		                  //	HLT
-        case 0x77: //	MOV   M, A
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    MOV(&state->memory[mem_reference], state->a);
-                    break;
-                  }
-        case 0x78: MOV(&state->a, state->b); break;		    		                  //	MOV     A, B
-        case 0x79: MOV(&state->a, state->c); break;		    		                  //	MOV     A, C
-        case 0x7a: MOV(&state->a, state->d); break;		    		                  //	MOV     A, D
-        case 0x7b: MOV(&state->a, state->e); break;		    		                  //	MOV     A, E
-        case 0x7c: MOV(&state->a, state->h); break;		    	                  	//	MOV     A, H
-        case 0x7d: MOV(&state->a, state->l); break;		    	                  	//	MOV     A, L
-        case 0x7e: //	MOV   A, M
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    MOV(&state->a, state->memory[mem_reference]);
-                    break;
-                  }
-        case 0x7f: MOV(&state->a, state->a); break;		    	                  	//	MOV     A, A
-
-        case 0x80: Arithmetic(state, state->b, ADD, NO_CARRY); break;           //  ADD     B
-        case 0x81: Arithmetic(state, state->c, ADD, NO_CARRY); break;	          //	ADD     C
-        case 0x82: Arithmetic(state, state->d, ADD, NO_CARRY); break;		        //	ADD     D
-        case 0x83: Arithmetic(state, state->e, ADD, NO_CARRY); break;		        //	ADD     E
-        case 0x84: Arithmetic(state, state->h, ADD, NO_CARRY); break;		        //	ADD     H
-        case 0x85: Arithmetic(state, state->l, ADD, NO_CARRY); break;		        //	ADD     L
-        case 0x86: //	ADD   M
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    Arithmetic(state, state->memory[mem_reference], ADD, NO_CARRY); break;
-                  }
-        case 0x87: Arithmetic(state, state->a, ADD, NO_CARRY); break;		        //	ADD     A
-        case 0x88: Arithmetic(state, state->b, ADD, CARRY); break;		          //	ADC     B
-        case 0x89: Arithmetic(state, state->c, ADD, CARRY);	break;              //	ADC     C
-        case 0x8a: Arithmetic(state, state->d, ADD, CARRY);	break;  	          //	ADC     D
-        case 0x8b: Arithmetic(state, state->e, ADD, CARRY);	break;		          //	ADC     E
-        case 0x8c: Arithmetic(state, state->h, ADD, CARRY);	break;		          //	ADC     H
-        case 0x8d: Arithmetic(state, state->l, ADD, CARRY);	break;		          //	ADC     L
-        case 0x8e: //	ADC   M
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    Arithmetic(state, state->memory[mem_reference], ADD, CARRY); break;
-                  }
-        case 0x8f: Arithmetic(state, state->a, ADD, CARRY);	break;		          //	ADC     A
-        case 0x90: Arithmetic(state, state->b, SUB, NO_CARRY);	break;		      //	SUB     B
-        case 0x91: Arithmetic(state, state->c, SUB, NO_CARRY);	break;		      //	SUB     C
-        case 0x92: Arithmetic(state, state->d, SUB, NO_CARRY);	break;		      //	SUB     D
-        case 0x93: Arithmetic(state, state->e, SUB, NO_CARRY);	break;		      //	SUB     E
-        case 0x94: Arithmetic(state, state->h, SUB, NO_CARRY);	break;		      //	SUB     H
-        case 0x95: Arithmetic(state, state->l, SUB, NO_CARRY);	break;		      //	SUB     L
-        case 0x96: //	SUB   M
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    Arithmetic(state, state->memory[mem_reference], SUB, NO_CARRY); break;
-                  }
-        case 0x97: Arithmetic(state, state->a, SUB, NO_CARRY);	break;		      //	SUB     A
-        case 0x98: Arithmetic(state, state->b, SUB, CARRY);	break;		          //	SBB     B
-        case 0x99: Arithmetic(state, state->c, SUB, CARRY);	break;		          //	SBB     C
-        case 0x9a: Arithmetic(state, state->d, SUB, CARRY);	break;		          //	SBB     D
-        case 0x9b: Arithmetic(state, state->e, SUB, CARRY);	break;		          //	SBB     E
-        case 0x9c: Arithmetic(state, state->h, SUB, CARRY);	break;		          //	SBB     H
-        case 0x9d: Arithmetic(state, state->l, SUB, CARRY);	break;		          //	SBB     L
-        case 0x9e: //	SBB   M
-                  {
-                    uint16_t mem_reference = (state->h << 8 | state->l);
-                    Arithmetic(state, state->memory[mem_reference], SUB, CARRY); break;
-                  }
-        case 0x9f: Arithmetic(state, state->a, SUB, CARRY);	break;		          //	SBB     A
-        case 0xa0: //  ANA  B
-                  // A <- A & B
-                  AND(state, state->b);
-                  break;
-        case 0xa1: //  ANA  C
-                  // A <- A & C
-                  AND(state, state->c);
-                  break;
-        case 0xa2: //  ANA  D
-                  // A <- A & D
-                  AND(state, state->d);
-                  break;
-        case 0xa3: //  ANA  E
-                  // A <- A & E
-                  AND(state, state->e);
-                  break;
-        case 0xa4: //  ANA  H
-                  // A <- A & H
-                  AND(state, state->h);
-                  break;
-        case 0xa5: //  ANA  L
-                  // A <- A & L
-                  AND(state, state->l);
-                  break;
-        case 0xa6: //  ANA  M
-                  // A <- A & M
-                  {
-                    uint16_t memory_reference = (state->h << 8) | state->l;
-                    AND(state, state->memory[memory_reference]);
-                    break;
-                  }
-        case 0xa7: //  ANA  A
-                  // A <- A & A
-                  AND(state, state->a);
-                  break;
-        case 0xa8: //  XRA  B
-                  // A <- A ^ B
-                  XOR(state, state->b);
-                  break;
-        case 0xa9: //  XRA  C
-                  // A <- A ^ C
-                  XOR(state, state->c);
-                  break;
-        case 0xaa: //  XRA  D
-                  // A <- A ^ D
-                  XOR(state, state->d);
-                  break;
-        case 0xab: //  XRA  E
-                  // A <- A ^ E
-                  XOR(state, state->e);
-                  break;
-        case 0xac: //  XRA  H
-                  // A <- A ^ H
-                  XOR(state, state->h);
-                  break;
-        case 0xad: //  XRA  L
-                  // A <- A ^ L
-                  XOR(state, state->l);
-                  break;
-        case 0xae: UnimplementedInstruction(state); break;	//  XRA     M
-        case 0xaf: //  XRA  A
-                  // A <- A ^ A
-                  XOR(state, state->a);
-                  break;
-        case 0xb0: //  ORA  B
-                  // A <- A | B
-                  ORA(state, state->b);
-                  break;
-        case 0xb1: //  ORA  C
-                  // A <- A | C
-                  ORA(state, state->c);
-                  break;
-        case 0xb2: //  ORA  D
-                  // A <- A | D
-                  ORA(state, state->d);
-                  break;
-        case 0xb3: //  ORA  E
-                  // A <- A | E
-                  ORA(state, state->e);
-                  break;
-        case 0xb4: //  ORA  H
-                  // A <- A | H
-                  ORA(state, state->h);
-                  break;
-        case 0xb5: //  ORA L
-                  // A <- A | L
-                  ORA(state, state->l);
-                  break;
-        case 0xb6: //  ORA  M
-                  {
-                    uint16_t memory_reference = (state->h << 8 | state->l);
-                    ORA(state, state->memory[memory_reference]);
-                    break; 
-                  }
-        case 0xb7: //  ORA  A
-                  // A <- A | A
-                  ORA(state, state->a);
-                  break;
-        case 0xb8: //  CMP  B
-                  CMP(state, state->b);
-                  break;
-        case 0xb9: //  CMP  C
-                  CMP(state, state->c);
-                  break;
-        case 0xba: //  CMP  D
-                  CMP(state, state->d);
-                  break;
-        case 0xbb: //  CMP  E
-                  CMP(state, state->e);
-                  break;
-        case 0xbc: //  CMP  H
-                  CMP(state, state->h);
-                  break;
-        case 0xbd: //  CMP  L
-                  CMP(state, state->l);
-                  break;
-        case 0xbe: //  CMP  M
-                  {
-                    uint16_t memory_reference = (state->h << 8) | state->l;
-                    CMP(state, state->memory[memory_reference]);
-                    break;
-                  }
-        case 0xbf: //  CMP  A
-                  CMP(state, state->a);
-                  break;
+        OPCODES_64(MOV_CASE, 0x40)                                              //  MOV     r, r and HLT
+        OPCODES_64(ALU_CASE, 0x80)                                              //  ADD ... CMP r
+        alu_add: Arithmetic(state, operand, ADD, NO_CARRY); break;              //  operations of ALU_CASE
+        alu_adc: Arithmetic(state, operand, ADD, CARRY); break;
+        alu_sub: Arithmetic(state, operand, SUB, NO_CARRY); break;
+        alu_sbb: Arithmetic(state, operand, SUB, CARRY); break;
+        alu_ana: AND(state, operand); break;
+        alu_xra: XOR(state, operand); break;
+        alu_ora: ORA(state, operand); break;
+        alu_cmp: CMP(state, operand); break;
+
         case 0xc0: //  RNZ
                   if (0 == state->cc.z) {
                       RET(state);
@@ -1031,7 +864,11 @@ int Emulate8080(State8080* state) {
                       state->pc += 2;
                   }
                   break;
-        case 0xd3: // OUT placeholder until we get to video and sound.
+        case 0xd3: //  OUT port
+                  // Write the accumulator to the machine's output port
+                  if (state->port_out) {
+                      state->port_out(state, code[1], state->a);
+                  }
                   state->pc++;
                   break;
         case 0xd4: //  CNC address
@@ -1064,7 +901,9 @@ int Emulate8080(State8080* state) {
                       state->pc += 2;
                   }
                   break;
-        case 0xdb: // IN placeholder until we get to video and sound.
+        case 0xdb: //  IN port
+                  // Read the machine's input port into the accumulator
+                  state->a = state->port_in ? state->port_in(state, code[1]) : 0;
                   state->pc++;
                   break;
         case 0xdc: //  CC address
@@ -1101,10 +940,10 @@ int Emulate8080(State8080* state) {
                   {
                     uint8_t h = state->h;
                     uint8_t l = state->l;
-                    state->l = state->memory[state->sp];
-                    state->h = state->memory[state->sp+1];
-                    state->memory[state->sp] = l;
-                    state->memory[state->sp+1] = h;
+                    state->l = BusRead(state->bus, state->sp);
+                    state->h = BusRead(state->bus, state->sp+1);
+                    BusWrite(state->bus, state->sp, l);
+                    BusWrite(state->bus, state->sp+1, h);
                     //UnimplementedInstruction(state); break;		//  XTHL
                     break;
                   }
@@ -1165,7 +1004,10 @@ int Emulate8080(State8080* state) {
                   }
                   break;
         case 0xed: break; //  NOP
-        case 0xee: UnimplementedInstruction(state); break;		//  XRI     8bit_data
+        case 0xee: //  XRI     8bit_data
+                  XOR(state, code[1]);
+                  state->pc += 1;
+                  break;
         case 0xef: //  RST     5
                   RST(state, 5);
                   break;
@@ -1221,7 +1063,9 @@ int Emulate8080(State8080* state) {
                       RET(state);
                   } 
                   break;
-        case 0xf9: UnimplementedInstruction(state); break;		//  SPHL
+        case 0xf9: //  SPHL
+                  state->sp = (state->h << 8) | state->l;
+                  break;
         case 0xfa: //  JM address
                   if (1 == state->cc.s) {
                       JMP(state, code);
@@ -1248,6 +1092,208 @@ int Emulate8080(State8080* state) {
         case 0xff: //  RST     7
                   RST(state, 7);
                   break;
+        default:
+                  UnimplementedInstruction(state);
+                  break;
 	}
-	return cycles[*code];
+
+	// Conditional calls and returns are cheaper when not taken (flags are unchanged by them)
+	int n = info->cycles;
+	if ((info->flow & FLOW_CONDITIONAL) && !ConditionMet(state, info - OPCODE_INFO)) {
+		n = info->cycles_not_taken;
+	}
+	state->cycles += n;
+	return n;
+}
+
+/* Idle loop skipping.
+
+Games poll RAM in tight loops waiting for an interrupt handler to change a
+flag. When a short backward jump is taken, the loop body is checked: no
+stores, stack, IO (except OUT to quiet ports) or interrupt control, and
+every jump stays inside the loop. One more iteration is then run for real.
+If it leaves every register as it was, all further iterations are
+identical until an interrupt, so whole iterations are skipped up to the
+end of the run. Only whole iterations are skipped, the instruction
+boundaries and cycle counts are exactly those of running them.
+
+Most short loops aren't idle, they count or copy. Verdicts of loops in ROM
+are cached, and a loop whose probe finds the registers changing is left
+alone for exponentially more of its iterations, so a counting loop costs
+a table lookup per iteration rather than a probe. */
+
+static int IdleLoopBody(State8080 *state, uint16_t target, uint16_t branch) {
+    MemoryBus *bus = state->bus;
+    uint16_t pc = target;
+    while (pc < branch) {
+        const OpcodeInfo *info = &OPCODE_INFO[BusRead(bus, pc)];
+        int flow = info->flow & ~FLOW_CONDITIONAL;
+
+        if (flow == FLOW_JUMP) {
+            uint16_t dest = BusRead(bus, pc + 1) | BusRead(bus, pc + 2) << 8;
+            if (dest < target || dest > branch) {
+                return IDLE_IMPURE;
+            }
+        } else if (flow != FLOW_NONE) {
+            return IDLE_IMPURE;
+        }
+
+        switch (info->mnemonic) {
+            case MN_MOV: case MN_MVI: case MN_INR: case MN_DCR:
+                if (info->operand[0] == OP_M) {
+                    return IDLE_IMPURE;
+                }
+                break;
+            case MN_NOP: case MN_LXI: case MN_INX: case MN_DCX: case MN_DAD:
+            case MN_LDA: case MN_LDAX: case MN_LHLD: case MN_XCHG:
+            case MN_ADD: case MN_ADC: case MN_SUB: case MN_SBB:
+            case MN_ANA: case MN_XRA: case MN_ORA: case MN_CMP:
+            case MN_ADI: case MN_ACI: case MN_SUI: case MN_SBI:
+            case MN_ANI: case MN_XRI: case MN_ORI: case MN_CPI:
+            case MN_RLC: case MN_RRC: case MN_RAL: case MN_RAR:
+            case MN_CMA: case MN_CMC: case MN_STC: case MN_DAA:
+            case MN_JMP: case MN_JNZ: case MN_JZ: case MN_JNC: case MN_JC:
+            case MN_JPO: case MN_JPE: case MN_JP: case MN_JM:
+                break;
+            case MN_OUT:
+            {
+                uint8_t port = BusRead(bus, pc + 1);
+                if (!(state->quiet_ports[port >> 3] & 1 << (port & 7))) {
+                    return IDLE_IMPURE;
+                }
+                break;
+            }
+            default:
+                return IDLE_IMPURE;
+        }
+        pc += info->length;
+    }
+
+    // The loop has to close with a jump starting exactly at branch
+    int flow = OPCODE_INFO[BusRead(bus, pc)].flow & ~FLOW_CONDITIONAL;
+    return pc == branch && flow == FLOW_JUMP ? IDLE_PURE : IDLE_IMPURE;
+}
+
+static IdleEntry* IdleLookup(State8080 *state, uint16_t target, uint16_t branch) {
+    // The loop's entry, taken over from whichever loop had the slot before
+    IdleEntry *entry = &state->idle[branch & (IDLE_CACHE_SIZE - 1)];
+    if (entry->target != target || entry->branch != branch) {
+        memset(entry, 0, sizeof(IdleEntry));
+        entry->target = target;
+        entry->branch = branch;
+    }
+    return entry;
 }
+
+static void IdleMiss(IdleEntry *entry) {
+    // The loop did work this time, wait twice as long as before to look again
+    if (entry->misses < IDLE_BACKOFF_MAX) {
+        entry->misses++;
+    }
+    entry->backoff = (1 << entry->misses) - 1;
+}
+
+int IdleLoopVerdict(State8080 *state, uint16_t target, uint16_t branch) {
+    // Loops in ROM can't change, their verdict is cached
+    MemoryBus *bus = state->bus;
+    int rom = bus->attr[target >> PAGE_SHIFT] == PAGE_ROM && bus->attr[branch >> PAGE_SHIFT] == PAGE_ROM;
+    IdleEntry *entry = IdleLookup(state, target, branch);
+
+    if (entry->verdict != IDLE_UNKNOWN) {
+        return entry->verdict;
+    }
+    int verdict = IdleLoopBody(state, target, branch);
+    if (rom) {
+        entry->verdict = verdict;
+    }
+    return verdict;
+}
+
+int SkipIdleLoop(State8080 *state, uint16_t branch, int cycles, int until) {
+    // Called after the jump at branch went back to state->pc. Returns the
+    // updated cycle count.
+    // Reads through handlers (MMIO, watchpoints) may change by themselves
+    uint16_t target = state->pc;
+    if (state->trace || state->bus->read_handlers) {
+        return cycles;
+    }
+
+    IdleEntry *entry = IdleLookup(state, target, branch);
+    if (entry->backoff) {
+        entry->backoff--;
+        return cycles;
+    }
+    if (IdleLoopVerdict(state, target, branch) != IDLE_PURE) {
+        IdleMiss(entry);
+        return cycles;
+    }
+
+    uint8_t a = state->a, b = state->b, c = state->c, d = state->d;
+    uint8_t e = state->e, h = state->h, l = state->l, flags = PackFlags(state);
+    uint16_t sp = state->sp;
+    uint64_t start = state->cycles;
+
+    // One real iteration, stopping like the caller would
+    for (;;) {
+        if (cycles >= until) {
+            return cycles;
+        }
+        uint16_t pc = state->pc;
+        cycles += Emulate8080(state);
+        if (state->pc < target || state->pc > branch) {
+            IdleMiss(entry);
+            return cycles;
+        }
+        if (pc == branch && state->pc == target) {
+            break;
+        }
+    }
+
+    if (state->a != a || state->b != b || state->c != c || state->d != d || state->e != e ||
+        state->h != h || state->l != l || state->sp != sp || PackFlags(state) != flags) {
+        IdleMiss(entry);
+        return cycles;
+    }
+    entry->misses = 0;
+
+    uint64_t period = state->cycles - start;
+    uint64_t skipped = (until - cycles) / period * period;
+    state->cycles += skipped;
+    state->idle_cycles += skipped;
+    return cycles + skipped;
+}
+
+int Run8080(State8080* state, int cycles, int until) {
+    // Runs whole instructions until the cycle count reaches until. A halted
+    // CPU skips straight to until, the earliest an interrupt can wake it.
+    // Idle loops are skipped as well unless state->strict is set.
+    while (cycles < until) {
+        if (state->halted) {
+            state->cycles += until - cycles;
+            return until;
+        }
+        uint16_t pc = state->pc;
+        cycles += Emulate8080(state);
+        if (state->pc < pc && pc - state->pc <= IDLE_LOOP_MAX && !state->strict) {
+            cycles = SkipIdleLoop(state, pc, cycles, until);
+        }
+    }
+    return cycles;
+}
+
+#else
+
+// Compiled into libcore8080, see core/core8080.h
+void GenerateInterrupt(State8080* state, int interrupt_num);
+int ParityCheck(uint8_t value);
+uint8_t PackFlags(const State8080* state);
+void UnpackFlags(State8080* state, uint8_t psw);
+int ConditionMet(State8080* state, uint8_t opcode);
+int Emulate8080(State8080* state);
+int IdleLoopVerdict(State8080 *state, uint16_t target, uint16_t branch);
+int SkipIdleLoop(State8080 *state, uint16_t branch, int cycles, int until);
+int Run8080(State8080* state, int cycles, int until);
+
+#endif
+
+#endif
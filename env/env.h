@@ -0,0 +1,214 @@
+#ifndef ENV_H
+#define ENV_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../invaders/invaders.h"
+#include "../romset/romset.h"
+
+/* Batched environment for training agents.
+
+A batch is count independent single player games. EnvStep applies one
+action per game, runs frameskip frames and writes every observation into
+one contiguous caller buffer, either the raw 1bpp video RAM or one palette
+index byte per pixel. Score and lives come straight from work RAM. Nothing
+is allocated after EnvNew: a reset copies a snapshot of the first frame of
+a game, taken once by inserting a coin and pressing start. A snapshot saved
+before (headless --start --save) skips even that, see EnvNewFromSnapshot
+and EnvNewFromFile. */
+
+#define ENV_OBS_1BPP  0     // INVADERS_VRAM_SIZE bytes, the video RAM as is
+#define ENV_OBS_8BPP  1     // INVADERS_WIDTH * INVADERS_HEIGHT COLOR_* indices, top row first
+
+#define ENV_NOOP        0
+#define ENV_FIRE        1
+#define ENV_LEFT        2
+#define ENV_RIGHT       3
+#define ENV_LEFT_FIRE   4
+#define ENV_RIGHT_FIRE  5
+#define ENV_ACTIONS     6
+
+// Player 1 state in work RAM
+#define ENV_GAME_MODE     0x20ef    // 1 while a game is running
+#define ENV_PLAYER_ALIVE  0x2015    // 0xff unless the ship is exploding
+#define ENV_SCORE         0x20f8    // 4 BCD digits, low byte first
+#define ENV_SHIPS         0x21ff    // ships in reserve
+
+#define ENV_START_TIMEOUT  1000     // frames to wait for the game to start
+
+static const uint8_t ENV_ACTION_INPUTS[ENV_ACTIONS] = { 0x00, 0x10, 0x20, 0x40, 0x30, 0x50 };
+
+typedef struct EnvInfo {
+    int32_t     reward;         // points scored this step
+    uint16_t    score;
+    uint8_t     lives;          // including the ship in play, 0 after the game ends
+    uint8_t     done;           // the game ended this step, the game has been reset
+} EnvInfo;
+
+typedef struct EnvBatch {
+    int                 count;
+    int                 obs_format;
+    int                 frameskip;
+    Invaders            *machines;
+    InvadersSnapshot    start;
+    uint64_t            steps;
+    uint64_t            episodes;
+} EnvBatch;
+
+static uint16_t EnvScore(const Invaders *m) {
+    const uint8_t *bcd = &m->memory[ENV_SCORE];
+    return (bcd[1] >> 4) * 1000 + (bcd[1] & 0xf) * 100 + (bcd[0] >> 4) * 10 + (bcd[0] & 0xf);
+}
+
+static int EnvGameOver(const Invaders *m) {
+    // The game mode only drops after the game over message, the last ship
+    // exploding is the end as far as the agent is concerned
+    return m->memory[ENV_GAME_MODE] == 0 ||
+           (m->memory[ENV_SHIPS] == 0 && m->memory[ENV_PLAYER_ALIVE] != 0xff);
+}
+
+size_t EnvObsSize(const EnvBatch *env) {
+    // Bytes of observation per game
+    return env->obs_format == ENV_OBS_1BPP ? INVADERS_VRAM_SIZE : INVADERS_WIDTH * INVADERS_HEIGHT;
+}
+
+static void EnvObserve(const EnvBatch *env, const Invaders *m, uint8_t *obs) {
+    if (env->obs_format == ENV_OBS_1BPP) {
+        memcpy(obs, &m->memory[INVADERS_VRAM], INVADERS_VRAM_SIZE);
+    } else {
+        ConvertVideoIndices(&m->memory[INVADERS_VRAM], obs);
+    }
+}
+
+static void EnvInfoOf(const Invaders *m, EnvInfo *info) {
+    info->score = EnvScore(m);
+    info->lives = EnvGameOver(m) ? 0 : m->memory[ENV_SHIPS] + 1;
+}
+
+void EnvFree(EnvBatch *env) {
+    free(env->machines);
+    free(env);
+}
+
+int EnvBoot(Invaders *m) {
+    // Runs a machine from power on, inserts a coin and presses 1 player
+    // start. Returns 0 at the first frame of the game with its ships set up,
+    // the game mode goes up a few frames before that. -1 if it never started.
+    int frame = 0;
+    for (; frame < ENV_START_TIMEOUT && (m->memory[ENV_GAME_MODE] == 0 || m->memory[ENV_SHIPS] == 0); frame++) {
+        m->input_port1 = 0x08 | (frame >= 10 && frame < 14 ? 0x01 : 0) | (frame >= 30 && frame < 34 ? 0x04 : 0);
+        InvadersRunFrame(m);
+    }
+    m->input_port1 = 0x08;
+    if (frame == ENV_START_TIMEOUT) {
+        fprintf(stderr, "error: the game didn't start\n");
+        return -1;
+    }
+    return 0;
+}
+
+EnvBatch* EnvNewFromSnapshot(const RomSet *roms, int count, int obs_format, int frameskip, const InvadersSnapshot *start) {
+    // Returns count games that start from start instead of booting, such as
+    // a snapshot saved by headless --start --save. NULL if it isn't valid.
+    EnvBatch *env = calloc(1, sizeof(EnvBatch));
+    env->count = count;
+    env->obs_format = obs_format;
+    env->frameskip = frameskip > 0 ? frameskip : 1;
+    env->machines = malloc(count * sizeof(Invaders));
+    env->start = *start;
+    for (int i = 0; i < count; i++) {
+        InvadersInit(&env->machines[i]);
+        BusMapRomSet(&env->machines[i].bus, roms);
+        if (InvadersRestore(&env->machines[i], &env->start) != 0) {
+            fprintf(stderr, "error: not a version %d snapshot\n", INVADERS_SNAPSHOT_VERSION);
+            EnvFree(env);
+            return NULL;
+        }
+    }
+    return env;
+}
+
+EnvBatch* EnvNewFromFile(const RomSet *roms, int count, int obs_format, int frameskip, const char *filename) {
+    // EnvNewFromSnapshot with a snapshot file such as workloads/game_start.snapshot
+    InvadersSnapshot *start = malloc(sizeof(InvadersSnapshot));
+    EnvBatch *env = NULL;
+    if (InvadersReadFile(start, filename) == 0) {
+        env = EnvNewFromSnapshot(roms, count, obs_format, frameskip, start);
+    }
+    free(start);
+    return env;
+}
+
+EnvBatch* EnvNew(const RomSet *roms, int count, int obs_format, int frameskip) {
+    // Returns count games ready to play, NULL if the ROMs never start a game
+    Invaders *m = malloc(sizeof(Invaders));
+    InvadersInit(m);
+    BusMapRomSet(&m->bus, roms);
+    if (EnvBoot(m) != 0) {
+        free(m);
+        return NULL;
+    }
+    InvadersSnapshot *start = malloc(sizeof(InvadersSnapshot));
+    InvadersSave(m, start);
+    EnvBatch *env = EnvNewFromSnapshot(roms, count, obs_format, frameskip, start);
+    free(start);
+    free(m);
+    return env;
+}
+
+void EnvReset(EnvBatch *env, int index, uint8_t *obs, EnvInfo *info) {
+    // Starts game index over, obs and info may be NULL
+    Invaders *m = &env->machines[index];
+    InvadersRestore(m, &env->start);
+    if (obs) {
+        EnvObserve(env, m, obs);
+    }
+    if (info) {
+        EnvInfoOf(m, info);
+        info->reward = 0;
+        info->done = 0;
+    }
+}
+
+void EnvResetAll(EnvBatch *env, uint8_t *obs, EnvInfo *info) {
+    // obs holds count * EnvObsSize bytes, info count entries
+    size_t size = EnvObsSize(env);
+    for (int i = 0; i < env->count; i++) {
+        EnvReset(env, i, obs ? obs + i * size : NULL, info ? &info[i] : NULL);
+    }
+}
+
+void EnvStep(EnvBatch *env, const uint8_t *actions, uint8_t *obs, EnvInfo *info) {
+    // Plays actions[i] in game i for frameskip frames. A game that ends is
+    // reset right away: its info describes the step that ended it and obs
+    // is the first frame of the next game.
+    size_t size = EnvObsSize(env);
+    for (int i = 0; i < env->count; i++) {
+        Invaders *m = &env->machines[i];
+        uint16_t before = EnvScore(m);
+        m->input_port1 = 0x08 | ENV_ACTION_INPUTS[actions[i] < ENV_ACTIONS ? actions[i] : ENV_NOOP];
+        int done = 0;
+        for (int f = 0; f < env->frameskip && !done; f++) {
+            InvadersRunFrame(m);
+            done = EnvGameOver(m);
+        }
+
+        EnvInfoOf(m, &info[i]);
+        info[i].reward = info[i].score - before;
+        if (info[i].reward < 0) {
+            info[i].reward += 10000;        // the score counter rolled over
+        }
+        info[i].done = done;
+        if (done) {
+            InvadersRestore(m, &env->start);
+            env->episodes++;
+        }
+        EnvObserve(env, m, obs + i * size);
+    }
+    env->steps += env->count;
+}
+
+#endif
@@ -0,0 +1,261 @@
+/* Runs Space Invaders without a frontend and reports the speed.
+
+    headless [--frames <n>] [--play <file>] [--demo] [--record <file>] [--strict]
+             [--heatmap <prefix>] [--heatmap-period <n>] [--heatmap-line <bytes>]
+             [--boot <snapshot>] [--start] [--save <snapshot>] [--audio <file.wav>]
+
+An input file holds input ports 1 and 2 for each frame, two bytes per frame,
+as written by main --inputs or by --record here. --play feeds the ports from
+one and stops at its end unless --frames says otherwise. --demo plays a game
+itself instead: coin, start, then random moves and shots. Without either the
+machine stays in attract mode. Frames run exactly as in the SDL frontend,
+with the inputs read at mid screen, so a recording replays the same game.
+
+--boot starts from a snapshot instead of power on, --start plays the boot
+sequence, a coin and 1 player start up to the first frame of the game. The
+frames and inputs counted by the other options follow either. --save writes
+a snapshot after the last frame, so the game start every episode can begin
+from is made with
+
+    headless --start --frames 0 --save workloads/game_start.snapshot
+
+--audio mixes the sound of the run into a WAV file. It is rendered from
+emulated time, so it is the same as the SDL frontend's at any speed.
+
+--heatmap samples one frame in --heatmap-period (default 8) for a memory
+access heatmap, per address or per --heatmap-line bytes, and writes it to
+<prefix>.csv and <prefix>.ppm at the end.
+
+Built with make EMBED=1 the ROMs are part of the executable, see
+embed/embed.h, and it runs from any directory.
+
+The checksum of RAM at the end tells apart builds that don't emulate alike.
+The Makefile's pgo target trains on workloads/gameplay.inputs. */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "./emulator/emulator.h"
+#include "./romset/romset.h"
+#include "./invaders/invaders.h"
+#include "./heatmap/heatmap.h"
+#include "./embed/sounds.h"
+#include "./env/env.h"
+
+#define DEFAULT_FRAMES  3600
+#define GAME_MODE       0x20ef      // work RAM, 1 while a game is running
+#define HEATMAP_PERIOD  8
+
+void HeadlessFrame(Invaders *m, const uint8_t *ports) {
+    // Same steps as a frame of main.c, ports may be NULL to leave them be
+    int cycles = InvadersRun(m, 0, INVADERS_CYCLES_PER_FRAME / 2);
+    InvadersInterrupt(m, 1);
+    if (ports) {
+        m->input_port1 = ports[0];
+        m->input_port2 = ports[1];
+    }
+    InvadersRun(m, cycles, INVADERS_CYCLES_PER_FRAME);
+    InvadersInterrupt(m, 2);
+    m->frames++;
+}
+
+void DemoInput(const Invaders *m, uint32_t *seed, uint8_t *ports) {
+    // Coin and start while no game runs, otherwise a new random direction
+    // and fire button every 8 frames
+    uint64_t frame = m->frames;
+    if (m->memory[GAME_MODE] == 0) {
+        int phase = frame % 120;
+        ports[0] = 0x08 | (phase < 4 ? 0x01 : 0) | (phase >= 60 && phase < 64 ? 0x04 : 0);
+    } else if (frame % 8 == 0) {
+        *seed = *seed * 1103515245 + 12345;
+        static const uint8_t moves[4] = { 0x00, 0x20, 0x40, 0x00 };
+        ports[0] = 0x08 | moves[(*seed >> 16) & 3] | ((*seed >> 20) & 1 ? 0x10 : 0);
+    }
+    ports[1] = 0;
+}
+
+void HeadlessSound(Invaders *m, uint8_t port, uint8_t value) {
+    MixerWrite(m->user, m->cpu.cycles, port, value);
+}
+
+uint8_t* LoadInputs(const char *filename, long *frames) {
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "error: Couldn't open %s\n", filename);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *inputs = malloc(size > 0 ? size : 1);
+    if (fread(inputs, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "error: Couldn't read %s\n", filename);
+        free(inputs);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    *frames = size / 2;
+    return inputs;
+}
+
+int main (int argc, char**argv)
+{
+    long frames = -1;
+    const char *play = NULL;
+    const char *record = NULL;
+    int demo = 0;
+    int strict = 0;
+    const char *heatmap_prefix = NULL;
+    int heatmap_period = HEATMAP_PERIOD;
+    int heatmap_line = 1;
+    const char *boot = NULL;
+    const char *save = NULL;
+    int start_game = 0;
+    const char *audio = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc) {
+            play = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record = argv[++i];
+        } else if (strcmp(argv[i], "--demo") == 0) {
+            demo = 1;
+        } else if (strcmp(argv[i], "--strict") == 0) {
+            strict = 1;
+        } else if (strcmp(argv[i], "--heatmap") == 0 && i + 1 < argc) {
+            heatmap_prefix = argv[++i];
+        } else if (strcmp(argv[i], "--heatmap-period") == 0 && i + 1 < argc) {
+            heatmap_period = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--heatmap-line") == 0 && i + 1 < argc) {
+            heatmap_line = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--boot") == 0 && i + 1 < argc) {
+            boot = argv[++i];
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save = argv[++i];
+        } else if (strcmp(argv[i], "--start") == 0) {
+            start_game = 1;
+        } else if (strcmp(argv[i], "--audio") == 0 && i + 1 < argc) {
+            audio = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--frames <n>] [--play <file>] [--demo] [--record <file>] [--strict]\n"
+                            "       [--heatmap <prefix>] [--heatmap-period <n>] [--heatmap-line <bytes>]\n"
+                            "       [--boot <snapshot>] [--start] [--save <snapshot>] [--audio <file.wav>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    uint8_t *inputs = NULL;
+    long recorded = 0;
+    if (play) {
+        inputs = LoadInputs(play, &recorded);
+        if (inputs == NULL) {
+            return 1;
+        }
+    }
+    if (frames < 0) {
+        frames = play ? recorded : DEFAULT_FRAMES;
+    }
+    FILE *out = NULL;
+    if (record) {
+        out = fopen(record, "wb");
+        if (out == NULL) {
+            fprintf(stderr, "error: Couldn't create %s\n", record);
+            return 1;
+        }
+    }
+
+    RomSet roms;
+    if (LoadInvadersRomSet(&roms, "./ROMs") != 0) {
+        return 1;
+    }
+    Invaders *m = InvadersNew(&roms);
+    m->cpu.strict = strict;
+    if (boot && InvadersLoadFile(m, boot) != 0) {
+        return 1;
+    }
+    if (start_game && EnvBoot(m) != 0) {
+        return 1;
+    }
+
+    Mixer *mixer = NULL;
+    if (audio) {
+        mixer = MixerNew(0);
+        LoadInvadersSounds(mixer, "./ROMs/sound");
+        if (MixerRecord(mixer, audio) != 0) {
+            return 1;
+        }
+        m->user = mixer;
+        m->sound = HeadlessSound;
+    }
+
+    Heatmap *heatmap = NULL;
+    if (heatmap_prefix) {
+        int line_shift = 0;
+        while ((1 << line_shift) < heatmap_line) {
+            line_shift++;
+        }
+        heatmap = HeatmapNew(&m->cpu, line_shift, heatmap_period);
+        if (heatmap == NULL) {
+            return 1;
+        }
+    }
+
+    uint8_t ports[2] = { 0x08, 0 };
+    uint32_t seed = 1;
+    clock_t start = clock();
+    for (long f = 0; f < frames; f++) {
+        const uint8_t *frame_ports = NULL;
+        if (f < recorded) {
+            frame_ports = &inputs[f * 2];
+        } else if (demo) {
+            DemoInput(m, &seed, ports);
+            frame_ports = ports;
+        }
+        if (out) {
+            const uint8_t *written = frame_ports ? frame_ports : (uint8_t[2]){ m->input_port1, m->input_port2 };
+            fwrite(written, 1, 2, out);
+        }
+        if (heatmap) {
+            HeatmapFrame(heatmap);
+        }
+        HeadlessFrame(m, frame_ports);
+        if (mixer) {
+            MixerRender(mixer, m->cpu.cycles);
+        }
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%ld frames in %.3f s: %.0f frames/s, %.1fx real time\n", frames, seconds,
+           frames / seconds, frames / seconds / INVADERS_FPS);
+    printf("%llu cycles, %.1f%% skipped in idle loops\n", (unsigned long long)m->cpu.cycles,
+           m->cpu.cycles ? 100.0 * m->cpu.idle_cycles / m->cpu.cycles : 0.0);
+    printf("RAM checksum %08x\n", Crc32(&m->memory[INVADERS_RAM], sizeof(m->memory) - INVADERS_RAM));
+
+    if (save && InvadersSaveFile(m, save) != 0) {
+        return 1;
+    }
+    if (heatmap) {
+        char name[600];
+        printf("Heatmap of %llu sampled frames\n", (unsigned long long)heatmap->samples);
+        snprintf(name, sizeof(name), "%s.csv", heatmap_prefix);
+        HeatmapWriteCSV(heatmap, name);
+        snprintf(name, sizeof(name), "%s.ppm", heatmap_prefix);
+        HeatmapWritePPM(heatmap, name);
+        HeatmapFree(heatmap);
+    }
+    if (mixer) {
+        MixerFree(mixer);
+    }
+    if (out) {
+        fclose(out);
+    }
+    free(inputs);
+    free(m);
+    FreeRomSet(&roms);
+    return 0;
+}
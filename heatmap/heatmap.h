@@ -0,0 +1,211 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../emulator/emulator.h"
+
+/* Memory access heatmap.
+
+Counts reads, writes and instruction fetches per address, or per line of
+2^line_shift bytes, into one array of counters. Like the debugger's
+watchpoints it works through the bus page table: on a sampled frame every
+page is pointed at the heatmap handlers, which count and then forward to
+the page's real mapping. Between samples the page table is put back, so
+the emulator runs at full speed on all other frames. Only every period-th
+frame is sampled; the counts are a picture of where the program spends its
+accesses, not exact totals.
+
+Every page goes through the handlers while sampling, so BusFetch gathers
+each instruction's bytes through them with bus->fetching set; those count
+as fetches. Idle loops are run for real while sampling so their fetches
+show up and their analysis doesn't read the code.
+
+Attach it while no watchpoints are set and not to a CowRunner, both remap
+pages behind its back. */
+
+#define HEATMAP_READ     0
+#define HEATMAP_WRITE    1
+#define HEATMAP_FETCH    2
+
+#define HEATMAP_SIZE     256        // image is one row of pixels per page
+
+typedef struct HeatmapLine {
+    uint32_t    count[3];           // indexed by HEATMAP_*
+} HeatmapLine;
+
+typedef struct Heatmap {
+    State8080           *cpu;
+    int                 line_shift;     // 0 counts every address, 4 every 16 bytes
+    int                 period;         // sample one frame in period
+    int                 sampling;       // page table points at the heatmap handlers
+    uint8_t             strict;         // cpu->strict outside the samples
+    uint64_t            frames;         // frames seen by HeatmapFrame
+    uint64_t            samples;        // of which sampled
+
+    // Page table entries replaced while sampling
+    uint8_t             *saved_read[PAGE_COUNT];
+    uint8_t             *saved_write[PAGE_COUNT];
+    BusReadHandler      saved_read_handler[PAGE_COUNT];
+    BusWriteHandler     saved_write_handler[PAGE_COUNT];
+
+    HeatmapLine         *lines;         // 0x10000 >> line_shift of them
+} Heatmap;
+
+static inline HeatmapLine* HeatmapAt(Heatmap *h, uint16_t addr) {
+    return &h->lines[addr >> h->line_shift];
+}
+
+uint8_t HeatmapRead(MemoryBus *bus, uint16_t addr) {
+    // Read handler while sampling, forwards to the page's real mapping
+    Heatmap *h = bus->heatmap;
+    int page = addr >> PAGE_SHIFT;
+
+    HeatmapAt(h, addr)->count[bus->fetching ? HEATMAP_FETCH : HEATMAP_READ]++;
+    if (h->saved_read[page]) {
+        return h->saved_read[page][addr & PAGE_MASK];
+    }
+    return h->saved_read_handler[page](bus, addr);
+}
+
+void HeatmapWrite(MemoryBus *bus, uint16_t addr, uint8_t value) {
+    // Write handler while sampling, forwards to the page's real mapping
+    Heatmap *h = bus->heatmap;
+    int page = addr >> PAGE_SHIFT;
+
+    HeatmapAt(h, addr)->count[HEATMAP_WRITE]++;
+    if (h->saved_write[page]) {
+        h->saved_write[page][addr & PAGE_MASK] = value;
+        return;
+    }
+    h->saved_write_handler[page](bus, addr, value);
+}
+
+static void HeatmapHook(Heatmap *h) {
+    MemoryBus *bus = h->cpu->bus;
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        h->saved_read[page] = bus->read[page];
+        h->saved_write[page] = bus->write[page];
+        h->saved_read_handler[page] = bus->read_handler[page];
+        h->saved_write_handler[page] = bus->write_handler[page];
+        bus->read[page] = NULL;
+        bus->write[page] = NULL;
+        bus->read_handler[page] = HeatmapRead;
+        bus->write_handler[page] = HeatmapWrite;
+    }
+    BusCountHandlers(bus);
+    h->strict = h->cpu->strict;
+    h->cpu->strict = 1;
+    h->sampling = 1;
+}
+
+static void HeatmapUnhook(Heatmap *h) {
+    MemoryBus *bus = h->cpu->bus;
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        bus->read[page] = h->saved_read[page];
+        bus->write[page] = h->saved_write[page];
+        bus->read_handler[page] = h->saved_read_handler[page];
+        bus->write_handler[page] = h->saved_write_handler[page];
+    }
+    BusCountHandlers(bus);
+    h->cpu->strict = h->strict;
+    h->sampling = 0;
+}
+
+Heatmap* HeatmapNew(State8080 *cpu, int line_shift, int period) {
+    // line_shift 0..8, period >= 1. Nothing is counted before HeatmapFrame.
+    if (line_shift < 0 || line_shift > PAGE_SHIFT || period < 1) {
+        fprintf(stderr, "error: Heatmap lines of 2^%d bytes every %d frames\n", line_shift, period);
+        return NULL;
+    }
+    Heatmap *h = calloc(1, sizeof(Heatmap));
+    h->lines = calloc(0x10000 >> line_shift, sizeof(HeatmapLine));
+    h->cpu = cpu;
+    h->line_shift = line_shift;
+    h->period = period;
+    cpu->bus->heatmap = h;
+    return h;
+}
+
+void HeatmapFrame(Heatmap *h) {
+    // Call before every frame, samples this one or lets it run untouched
+    int sample = h->frames++ % h->period == 0;
+    if (sample && !h->sampling) {
+        HeatmapHook(h);
+    } else if (!sample && h->sampling) {
+        HeatmapUnhook(h);
+    }
+    h->samples += sample;
+}
+
+void HeatmapFree(Heatmap *h) {
+    // Gives the bus its page table back
+    if (h->sampling) {
+        HeatmapUnhook(h);
+    }
+    h->cpu->bus->heatmap = NULL;
+    free(h->lines);
+    free(h);
+}
+
+int HeatmapWriteCSV(const Heatmap *h, const char *filename) {
+    // address,reads,writes,fetches for every line that was touched
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "error: Couldn't create %s\n", filename);
+        return -1;
+    }
+    fprintf(f, "address,reads,writes,fetches\n");
+    for (int i = 0; i < 0x10000 >> h->line_shift; i++) {
+        const uint32_t *c = h->lines[i].count;
+        if (c[HEATMAP_READ] | c[HEATMAP_WRITE] | c[HEATMAP_FETCH]) {
+            fprintf(f, "%04x,%u,%u,%u\n", i << h->line_shift, c[HEATMAP_READ], c[HEATMAP_WRITE], c[HEATMAP_FETCH]);
+        }
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+static int HeatmapBits(uint32_t v) {
+    int bits = 0;
+    while (v) {
+        bits++;
+        v >>= 1;
+    }
+    return bits;
+}
+
+int HeatmapWritePPM(const Heatmap *h, const char *filename) {
+    // 256x256 binary PPM, a row per page and a pixel per address. Red is
+    // writes, green reads and blue fetches, each on a log scale up to the
+    // busiest line; untouched addresses are black.
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "error: Couldn't create %s\n", filename);
+        return -1;
+    }
+    static const int channel[3] = { HEATMAP_WRITE, HEATMAP_READ, HEATMAP_FETCH };
+    int max_bits[3] = { 0 };
+    for (int i = 0; i < 0x10000 >> h->line_shift; i++) {
+        for (int k = 0; k < 3; k++) {
+            int bits = HeatmapBits(h->lines[i].count[k]);
+            max_bits[k] = bits > max_bits[k] ? bits : max_bits[k];
+        }
+    }
+
+    fprintf(f, "P6\n%d %d\n255\n", HEATMAP_SIZE, HEATMAP_SIZE);
+    for (uint32_t addr = 0; addr < 0x10000; addr++) {
+        const HeatmapLine *line = &h->lines[addr >> h->line_shift];
+        uint8_t rgb[3];
+        for (int k = 0; k < 3; k++) {
+            uint32_t count = line->count[channel[k]];
+            rgb[k] = count ? 55 + 200 * HeatmapBits(count) / max_bits[channel[k]] : 0;
+        }
+        fwrite(rgb, 3, 1, f);
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,342 @@
+#ifndef INVADERS_H
+#define INVADERS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../emulator/emulator.h"
+#include "../romset/romset.h"
+
+/* Space Invaders machine without any frontend.
+
+Holds the CPU, the bus with the game's memory map, the input/output ports
+and the external shift register. Everything lives in one struct so several
+machines can run side by side and a frame can be run headless. Frontends
+set the input ports, hook sound through the sound callback and turn video
+RAM into pixels with ConvertVideoRAM. */
+
+#define INVADERS_WIDTH   224
+#define INVADERS_HEIGHT  256
+
+#define INVADERS_CLOCK             2000000                     // 8080 runs at 2 Mhz
+#define INVADERS_FPS               60
+#define INVADERS_CYCLES_PER_FRAME  (INVADERS_CLOCK / INVADERS_FPS)
+
+#define INVADERS_RAM   0x2000      // work RAM, video RAM follows at 0x2400
+#define INVADERS_VRAM  0x2400
+#define INVADERS_VRAM_SIZE  (INVADERS_WIDTH * INVADERS_HEIGHT / 8)     // 0x1c00 bytes, 1 bit per pixel
+
+// The cabinet colors the monochrome monitor with strips of cellophane
+#define COLOR_BLACK  0
+#define COLOR_WHITE  1
+#define COLOR_GREEN  2
+#define COLOR_RED    3
+
+typedef struct Invaders {
+    State8080   cpu;
+    MemoryBus   bus;
+    uint8_t     memory[0x4000];     // ROM 0x0000 - 0x1fff, RAM 0x2000 - 0x3fff
+    uint8_t     input_port1;
+    uint8_t     input_port2;
+    uint8_t     output_port3;
+    uint8_t     output_port5;
+    uint16_t    shift_register;
+    uint8_t     shift_offset;       // offset for external shift hardware
+    uint64_t    frames;
+    void        (*sound)(struct Invaders *m, uint8_t port, uint8_t value);   // OUT 3 / OUT 5, may be NULL
+    void        *user;              // frontend data
+} Invaders;
+
+#ifndef CORE8080_LIBRARY
+
+uint8_t InvadersIN(State8080 *state, uint8_t port) {
+    // returns value to be put into state->a
+    Invaders *m = state->machine;
+    switch (port) {
+        case 0:
+            return 1;
+        case 1:
+            return m->input_port1;
+        case 2:
+            return m->input_port2;
+        case 3: // returns data shifted by the shift amount
+            return m->shift_register >> (8 - m->shift_offset);
+    }
+    return 0;
+}
+
+void InvadersOUT(State8080 *state, uint8_t port, uint8_t value) {
+    Invaders *m = state->machine;
+    switch (port) {
+        case 2: // sets the shift amount
+            m->shift_offset = value & 7;
+            break;
+        case 3: // sets output port for sound
+            m->output_port3 = value;
+            break;
+        case 4: // sets the data in the shift registers
+            m->shift_register = (value << 8) | (m->shift_register >> 8);
+            break;
+        case 5: // sets output port for sound
+            m->output_port5 = value;
+            break;
+    }
+    if ((port == 3 || port == 5) && m->sound) {
+        m->sound(m, port, value);
+    }
+}
+
+void InvadersInit(Invaders *m) {
+    // Space Invaders memory map:
+    // 0x0000 - 0x1fff  ROM (writes are ignored)
+    // 0x2000 - 0x23ff  work RAM
+    // 0x2400 - 0x3fff  video RAM
+    // 0x4000 - 0xffff  mirror of RAM
+    memset(m, 0, sizeof(Invaders));
+    BusInit(&m->bus);
+    BusMapROM(&m->bus, 0x00, 0x20, &m->memory[0x0000]);
+    BusMapRAM(&m->bus, 0x20, 0x20, &m->memory[INVADERS_RAM]);
+    BusMapMirror(&m->bus, 0x40, 0xc0, 0x20, 0x20);
+
+    m->cpu.memory = m->memory;
+    m->cpu.bus = &m->bus;
+    m->cpu.port_in = InvadersIN;
+    m->cpu.port_out = InvadersOUT;
+    m->cpu.machine = m;
+    m->cpu.quiet_ports[0] = 1 << 6;     // OUT 6 feeds the watchdog, which isn't emulated
+}
+
+Invaders* InvadersNew(const RomSet *roms) {
+    // Returns a machine at reset with the ROM set mapped, roms may be NULL
+    Invaders *m = malloc(sizeof(Invaders));
+    InvadersInit(m);
+    if (roms) {
+        BusMapRomSet(&m->bus, roms);
+    }
+    return m;
+}
+
+int InvadersRun(Invaders *m, int cycles, int until) {
+    // Runs until the frame cycle count reaches until, see Run8080
+    return Run8080(&m->cpu, cycles, until);
+}
+
+void InvadersInterrupt(Invaders *m, int num) {
+    // The video hardware raises RST 1 mid screen and RST 2 at vblank
+    if (m->cpu.int_enable) {
+        GenerateInterrupt(&m->cpu, num);
+    }
+}
+
+void InvadersRunFrame(Invaders *m) {
+    int cycles = InvadersRun(m, 0, INVADERS_CYCLES_PER_FRAME / 2);
+    InvadersInterrupt(m, 1);
+    InvadersRun(m, cycles, INVADERS_CYCLES_PER_FRAME);
+    InvadersInterrupt(m, 2);
+    m->frames++;
+}
+
+const uint32_t INVADERS_PALETTE[4] = { 0x000000, 0xFFFFFF, 0x00FF00, 0xFF0000 };
+
+static inline int VideoColor(int row) {
+    // Color of lit pixels in the band of 8 rows ending at row
+    if (row >= 188 && row <= 240) {
+        return COLOR_GREEN;             // color player ship and cover green
+    } else if (row >= 33 && row <= 55) {
+        return COLOR_RED;               // color ufo red
+    }
+    return COLOR_WHITE;                 // color the rest simply white
+}
+
+void ConvertVideoRAM(const uint8_t *vram, uint32_t *pix) {
+    // Turns the 1bpp video RAM into INVADERS_WIDTH x INVADERS_HEIGHT 32 bit
+    // pixels. The monitor is rotated, each byte is 8 pixels of a column
+    // going up the screen.
+    int i = 0;
+    for (int col = 0; col < INVADERS_WIDTH; col++) {
+        for (int row = INVADERS_HEIGHT; row > 0; row -= 8) {
+            uint32_t color = INVADERS_PALETTE[VideoColor(row)];
+            for (int j = 0; j < 8; j++) {
+                int idx = (row - 1 - j) * INVADERS_WIDTH + col;
+                pix[idx] = (vram[i] & 1 << j) ? color : 0x000000;
+            }
+            i++;
+        }
+    }
+}
+
+void ConvertVideoIndices(const uint8_t *vram, uint8_t *idx) {
+    // Same as ConvertVideoRAM, one COLOR_* palette index per pixel
+    int i = 0;
+    for (int col = 0; col < INVADERS_WIDTH; col++) {
+        for (int row = INVADERS_HEIGHT; row > 0; row -= 8) {
+            uint8_t color = VideoColor(row);
+            for (int j = 0; j < 8; j++) {
+                idx[(row - 1 - j) * INVADERS_WIDTH + col] = (vram[i] & 1 << j) ? color : COLOR_BLACK;
+            }
+            i++;
+        }
+    }
+}
+
+#else
+
+// Compiled into libcore8080, see core/core8080.h
+extern const uint32_t INVADERS_PALETTE[4];
+uint8_t InvadersIN(State8080 *state, uint8_t port);
+void InvadersOUT(State8080 *state, uint8_t port, uint8_t value);
+void InvadersInit(Invaders *m);
+Invaders* InvadersNew(const RomSet *roms);
+int InvadersRun(Invaders *m, int cycles, int until);
+void InvadersInterrupt(Invaders *m, int num);
+void InvadersRunFrame(Invaders *m);
+void ConvertVideoRAM(const uint8_t *vram, uint32_t *pix);
+void ConvertVideoIndices(const uint8_t *vram, uint8_t *idx);
+
+#endif
+
+/* Save states.
+
+A snapshot is the CPU registers, the 8K of RAM and the IO latches. The ROM
+isn't included, it has to be the same set when the snapshot is restored. */
+
+#define INVADERS_SNAPSHOT_MAGIC    "8080SNP"
+#define INVADERS_SNAPSHOT_VERSION  2
+
+typedef struct InvadersSnapshot {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    size;               // sizeof(InvadersSnapshot)
+    uint64_t    cycles;
+    uint64_t    frames;
+    uint16_t    sp;
+    uint16_t    pc;
+    uint8_t     a, b, c, d, e, h, l;
+    uint8_t     flags;              // PSW layout
+    uint8_t     int_enable;
+    uint8_t     halted;
+    uint8_t     input_port1;
+    uint8_t     input_port2;
+    uint8_t     output_port3;
+    uint8_t     output_port5;
+    uint8_t     shift_offset;
+    uint16_t    shift_register;
+    uint8_t     ram[0x2000];
+} InvadersSnapshot;
+
+#ifndef CORE8080_LIBRARY
+
+void InvadersSave(const Invaders *m, InvadersSnapshot *s) {
+    memset(s, 0, sizeof(InvadersSnapshot));
+    memcpy(s->magic, INVADERS_SNAPSHOT_MAGIC, 8);
+    s->version = INVADERS_SNAPSHOT_VERSION;
+    s->size = sizeof(InvadersSnapshot);
+    s->cycles = m->cpu.cycles;
+    s->frames = m->frames;
+    s->sp = m->cpu.sp;
+    s->pc = m->cpu.pc;
+    s->a = m->cpu.a;
+    s->b = m->cpu.b;
+    s->c = m->cpu.c;
+    s->d = m->cpu.d;
+    s->e = m->cpu.e;
+    s->h = m->cpu.h;
+    s->l = m->cpu.l;
+    s->flags = PackFlags(&m->cpu);
+    s->int_enable = m->cpu.int_enable;
+    s->halted = m->cpu.halted;
+    s->input_port1 = m->input_port1;
+    s->input_port2 = m->input_port2;
+    s->output_port3 = m->output_port3;
+    s->output_port5 = m->output_port5;
+    s->shift_offset = m->shift_offset;
+    s->shift_register = m->shift_register;
+    memcpy(s->ram, &m->memory[INVADERS_RAM], sizeof(s->ram));
+}
+
+static int InvadersSnapshotValid(const InvadersSnapshot *s) {
+    return memcmp(s->magic, INVADERS_SNAPSHOT_MAGIC, 8) == 0 &&
+           s->version == INVADERS_SNAPSHOT_VERSION && s->size == sizeof(InvadersSnapshot);
+}
+
+int InvadersRestore(Invaders *m, const InvadersSnapshot *s) {
+    // Returns -1 and leaves the machine alone if s isn't a valid snapshot
+    if (!InvadersSnapshotValid(s)) {
+        return -1;
+    }
+    m->cpu.cycles = s->cycles;
+    m->frames = s->frames;
+    m->cpu.sp = s->sp;
+    m->cpu.pc = s->pc;
+    m->cpu.a = s->a;
+    m->cpu.b = s->b;
+    m->cpu.c = s->c;
+    m->cpu.d = s->d;
+    m->cpu.e = s->e;
+    m->cpu.h = s->h;
+    m->cpu.l = s->l;
+    UnpackFlags(&m->cpu, s->flags);
+    m->cpu.int_enable = s->int_enable;
+    m->cpu.halted = s->halted;
+    m->input_port1 = s->input_port1;
+    m->input_port2 = s->input_port2;
+    m->output_port3 = s->output_port3;
+    m->output_port5 = s->output_port5;
+    m->shift_offset = s->shift_offset;
+    m->shift_register = s->shift_register;
+    memcpy(&m->memory[INVADERS_RAM], s->ram, sizeof(s->ram));
+    return 0;
+}
+
+int InvadersSaveFile(const Invaders *m, const char *filename) {
+    InvadersSnapshot *s = malloc(sizeof(InvadersSnapshot));
+    InvadersSave(m, s);
+
+    FILE *f = fopen(filename, "wb");
+    int ok = f != NULL && fwrite(s, sizeof(InvadersSnapshot), 1, f) == 1;
+    if (f) {
+        ok = fclose(f) == 0 && ok;
+    }
+    free(s);
+    if (!ok) {
+        fprintf(stderr, "error: Couldn't write snapshot %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+int InvadersReadFile(InvadersSnapshot *s, const char *filename) {
+    // Reads a snapshot file into s without restoring it anywhere
+    FILE *f = fopen(filename, "rb");
+    int ok = f != NULL && fread(s, sizeof(InvadersSnapshot), 1, f) == 1 && InvadersSnapshotValid(s);
+    if (f) {
+        fclose(f);
+    }
+    if (!ok) {
+        fprintf(stderr, "error: %s is not a version %d snapshot\n", filename, INVADERS_SNAPSHOT_VERSION);
+        return -1;
+    }
+    return 0;
+}
+
+int InvadersLoadFile(Invaders *m, const char *filename) {
+    InvadersSnapshot *s = malloc(sizeof(InvadersSnapshot));
+    int result = InvadersReadFile(s, filename) == 0 ? InvadersRestore(m, s) : -1;
+    free(s);
+    return result;
+}
+
+#else
+
+// Compiled into libcore8080, see core/core8080.h
+void InvadersSave(const Invaders *m, InvadersSnapshot *s);
+int InvadersRestore(Invaders *m, const InvadersSnapshot *s);
+int InvadersSaveFile(const Invaders *m, const char *filename);
+int InvadersReadFile(InvadersSnapshot *s, const char *filename);
+int InvadersLoadFile(Invaders *m, const char *filename);
+
+#endif
+
+#endif
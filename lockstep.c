@@ -0,0 +1,131 @@
+/* Runs a CPU core in lockstep with the reference Emulate8080 and reports
+the first instruction where they disagree.
+
+    lockstep [--core <name>] [--seed <n>] [--trials <n>] [--frames <n>]
+
+The cores are "batch", the SIMD lane kernels of batch/batch.h run on a
+single lane (the default), and "reference" itself. Before any of them the
+harness checks itself: a core with the carry of CMP inverted has to be
+caught. Random instruction streams are run first, then frames of the Space
+Invaders attract mode when the ROMs are in ./ROMs. Finally idle loop
+skipping is checked against strict mode. */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "./emulator/emulator.h"
+#include "./lockstep/lockstep.h"
+#include "./batch/batch.h"
+
+#define DEFAULT_TRIALS  200000
+#define TRIAL_STEPS     32
+#define DEFAULT_FRAMES  600
+
+typedef struct NamedCore {
+    const char  *name;
+    CpuCore     core;
+} NamedCore;
+
+// Cores that can be checked against the reference, add new engines here.
+// The last one is checked by default.
+const NamedCore CORES[] = {
+    { "reference", Emulate8080 },
+    { "batch", BatchStep },
+};
+
+#define CORE_COUNT  (int)(sizeof(CORES) / sizeof(CORES[0]))
+
+int BrokenCompare(State8080 *state) {
+    // Emulate8080 with the carry of CMP and CPI inverted, see SelfCheck
+    uint8_t opcode = state->halted ? 0 : BusRead(state->bus, state->pc);
+    int cycles = Emulate8080(state);
+    if ((opcode & 0xf8) == 0xb8 || opcode == 0xfe) {
+        state->cc.cy ^= 1;
+    }
+    return cycles;
+}
+
+int SelfCheck(uint64_t seed, Divergence *div) {
+    // A harness that can't fail proves nothing: it has to report the broken
+    // core, and at a compare. Returns 0 if it did.
+    int64_t n = LockstepRandomRun(Emulate8080, BrokenCompare, seed, DEFAULT_TRIALS, TRIAL_STEPS, div);
+    uint8_t opcode = div->code[0];
+    if (n >= 0 || ((opcode & 0xf8) != 0xb8 && opcode != 0xfe) || div->ref.cc.cy == div->alt.cc.cy) {
+        printf("FAIL self-check, a core with CMP's carry inverted went unnoticed\n");
+        return -1;
+    }
+    printf("PASS self-check, a core with CMP's carry inverted fails at instruction %llu\n",
+           (unsigned long long)div->step);
+    return 0;
+}
+
+int main (int argc, char**argv)
+{
+    const NamedCore *candidate = &CORES[CORE_COUNT - 1];
+    uint64_t seed = 1;
+    int trials = DEFAULT_TRIALS;
+    int frames = DEFAULT_FRAMES;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--core") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            candidate = NULL;
+            for (int c = 0; c < CORE_COUNT; c++) {
+                if (strcmp(CORES[c].name, name) == 0) {
+                    candidate = &CORES[c];
+                }
+            }
+            if (candidate == NULL) {
+                fprintf(stderr, "error: Unknown core %s\n", name);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--trials") == 0 && i + 1 < argc) {
+            trials = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--core <name>] [--seed <n>] [--trials <n>] [--frames <n>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    Divergence *div = malloc(sizeof(Divergence));
+    if (SelfCheck(seed, div) != 0) {
+        return 1;
+    }
+
+    int64_t n = LockstepRandomRun(Emulate8080, candidate->core, seed, trials, TRIAL_STEPS, div);
+    if (n < 0) {
+        printf("FAIL %s, random streams (seed %llu)\n", candidate->name, (unsigned long long)seed);
+        PrintDivergence(stdout, div);
+        return 1;
+    }
+    printf("PASS %s, random streams: %lld instructions\n", candidate->name, (long long)n);
+
+    RomSet roms;
+    if (LoadRomSet(&roms, "./ROMs", INVADERS_MANIFEST, INVADERS_MANIFEST_COUNT) != 0) {
+        printf("SKIP %s, Space Invaders: ROMs not found\n", candidate->name);
+        return 0;
+    }
+    n = LockstepInvadersRun(Emulate8080, candidate->core, &roms, frames, div);
+    if (n < 0) {
+        printf("FAIL %s, Space Invaders\n", candidate->name);
+        PrintDivergence(stdout, div);
+        return 1;
+    }
+    printf("PASS %s, Space Invaders: %d frames, %lld instructions\n", candidate->name, frames, (long long)n);
+
+    int frame = LockstepIdleRun(&roms, frames * 10);
+    if (frame >= 0) {
+        printf("FAIL idle loop skipping, frame %d differs from strict mode\n", frame);
+        return 1;
+    }
+    printf("PASS idle loop skipping: %d frames match strict mode\n", frames * 10);
+
+    FreeRomSet(&roms);
+    free(div);
+    return 0;
+}
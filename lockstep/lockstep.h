@@ -0,0 +1,313 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../emulator/emulator.h"
+#include "../disassembler/disassembler.h"
+#include "../invaders/invaders.h"
+
+/* Lockstep differential testing of CPU cores.
+
+A core is any function that executes one instruction like Emulate8080 and
+returns its cycle count. Two machines with identical state run the
+reference core and the core under test one instruction at a time. After
+every instruction the registers, flags, cycle counts and the memory writes
+the instruction made are compared. The first difference is reported with
+the instruction and both register sets. */
+
+typedef int (*CpuCore)(State8080 *state);
+
+#define LOCKSTEP_MAX_WRITES  4       // an instruction writes at most 2 bytes
+
+typedef struct WriteLog {
+    int                 count;
+    uint16_t            addr[LOCKSTEP_MAX_WRITES];
+    uint8_t             value[LOCKSTEP_MAX_WRITES];
+    uint8_t             *write[PAGE_COUNT];         // the bus before the log was attached
+    BusWriteHandler     write_handler[PAGE_COUNT];
+} WriteLog;
+
+typedef struct Divergence {
+    uint64_t        step;               // instruction number in the run
+    uint16_t        pc;                 // address of the instruction that diverged
+    uint8_t         code[3];
+    State8080       ref;                // registers after the instruction
+    State8080       alt;
+    int             ref_cycles;
+    int             alt_cycles;
+    WriteLog        ref_writes;
+    WriteLog        alt_writes;
+} Divergence;
+
+void LogWrite(MemoryBus *bus, uint16_t addr, uint8_t value) {
+    WriteLog *log = bus->ctx;
+    int page = addr >> PAGE_SHIFT;
+    if (log->count < LOCKSTEP_MAX_WRITES) {
+        log->addr[log->count] = addr;
+        log->value[log->count] = value;
+    }
+    log->count++;
+
+    if (log->write[page]) {
+        log->write[page][addr & PAGE_MASK] = value;
+    } else {
+        log->write_handler[page](bus, addr, value);
+    }
+}
+
+void AttachWriteLog(MemoryBus *bus, WriteLog *log) {
+    // Routes every write through LogWrite, which then does what the bus did
+    memset(log, 0, sizeof(WriteLog));
+    for (int i = 0; i < PAGE_COUNT; i++) {
+        log->write[i] = bus->write[i];
+        log->write_handler[i] = bus->write_handler[i];
+        bus->write[i] = NULL;
+        bus->write_handler[i] = LogWrite;
+    }
+    bus->ctx = log;
+}
+
+int SameState(const State8080 *a, const State8080 *b) {
+    return a->a == b->a && a->b == b->b && a->c == b->c && a->d == b->d &&
+           a->e == b->e && a->h == b->h && a->l == b->l &&
+           a->sp == b->sp && a->pc == b->pc &&
+           PackFlags(a) == PackFlags(b) && a->int_enable == b->int_enable &&
+           a->halted == b->halted && a->cycles == b->cycles;
+}
+
+int SameWrites(const WriteLog *a, const WriteLog *b) {
+    if (a->count != b->count) {
+        return 0;
+    }
+    for (int i = 0; i < a->count && i < LOCKSTEP_MAX_WRITES; i++) {
+        if (a->addr[i] != b->addr[i] || a->value[i] != b->value[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int LockstepStep(State8080 *ref, CpuCore ref_core, State8080 *alt, CpuCore alt_core,
+                 uint64_t step, Divergence *div) {
+    // Runs one instruction on both machines. Returns 0, or -1 with div
+    // filled in if they no longer agree.
+    WriteLog *ref_log = ref->bus->ctx;
+    WriteLog *alt_log = alt->bus->ctx;
+    uint16_t pc = ref->pc;
+    uint8_t code[3] = { BusRead(ref->bus, pc), BusRead(ref->bus, pc + 1), BusRead(ref->bus, pc + 2) };
+
+    ref_log->count = 0;
+    alt_log->count = 0;
+    int ref_cycles = ref_core(ref);
+    int alt_cycles = alt_core(alt);
+
+    if (ref_cycles == alt_cycles && SameState(ref, alt) && SameWrites(ref_log, alt_log)) {
+        return 0;
+    }
+
+    div->step = step;
+    div->pc = pc;
+    memcpy(div->code, code, 3);
+    div->ref = *ref;
+    div->alt = *alt;
+    div->ref_cycles = ref_cycles;
+    div->alt_cycles = alt_cycles;
+    div->ref_writes = *ref_log;
+    div->alt_writes = *alt_log;
+    return -1;
+}
+
+void PrintCore(FILE *out, const char *name, const State8080 *s, int cycles, const WriteLog *log) {
+    uint8_t f = PackFlags(s);
+    fprintf(out, "  %-10s A $%02x B $%02x C $%02x D $%02x E $%02x H $%02x L $%02x SP %04x PC %04x %c%c%c%c%c IE %d  %d cycles (%llu total)\n",
+            name, s->a, s->b, s->c, s->d, s->e, s->h, s->l, s->sp, s->pc,
+            f & 0x40 ? 'z' : '.', f & 0x80 ? 's' : '.', f & 0x04 ? 'p' : '.',
+            f & 0x01 ? 'c' : '.', f & 0x10 ? 'a' : '.',
+            s->int_enable, cycles, (unsigned long long)s->cycles);
+    fprintf(out, "  %-10s %d write(s):", "", log->count);
+    for (int i = 0; i < log->count && i < LOCKSTEP_MAX_WRITES; i++) {
+        fprintf(out, " [%04x]=$%02x", log->addr[i], log->value[i]);
+    }
+    fprintf(out, "\n");
+}
+
+void PrintDivergence(FILE *out, const Divergence *div) {
+    Instruction ins;
+    char text[INSTRUCTION_TEXT_MAX];
+    DecodeInstruction(div->code, div->pc, &ins);
+    FormatInstruction(&ins, text, 0, sizeof(text));
+
+    fprintf(out, "divergence at instruction %llu: %04x  %s\n", (unsigned long long)div->step, div->pc, text);
+    PrintCore(out, "reference", &div->ref, div->ref_cycles, &div->ref_writes);
+    PrintCore(out, "candidate", &div->alt, div->alt_cycles, &div->alt_writes);
+}
+
+/* Random instruction streams.
+
+Both machines get the same random 64K of flat RAM. Every trial starts from
+random registers at a random address and runs a few instructions from
+there. */
+
+typedef struct LockstepRandom {
+    uint64_t    state;              // xorshift64*, never 0
+} LockstepRandom;
+
+uint32_t NextRandom(LockstepRandom *r) {
+    r->state ^= r->state >> 12;
+    r->state ^= r->state << 25;
+    r->state ^= r->state >> 27;
+    return (r->state * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+typedef struct FlatMachine {
+    State8080   cpu;
+    MemoryBus   bus;
+    WriteLog    log;
+    uint8_t     memory[0x10000];
+} FlatMachine;
+
+void InitFlatMachine(FlatMachine *m) {
+    memset(&m->cpu, 0, sizeof(State8080));
+    BusInit(&m->bus);
+    BusMapRAM(&m->bus, 0x00, PAGE_COUNT, m->memory);
+    AttachWriteLog(&m->bus, &m->log);
+    m->cpu.memory = m->memory;
+    m->cpu.bus = &m->bus;
+}
+
+int64_t LockstepRandomRun(CpuCore ref_core, CpuCore alt_core, uint64_t seed,
+                          int trials, int steps, Divergence *div) {
+    // Returns the number of instructions compared, or -1 with div filled in
+    LockstepRandom rng = { seed ? seed : 1 };
+    FlatMachine *ref = malloc(sizeof(FlatMachine));
+    FlatMachine *alt = malloc(sizeof(FlatMachine));
+    InitFlatMachine(ref);
+    InitFlatMachine(alt);
+
+    for (int i = 0; i < 0x10000; i++) {
+        ref->memory[i] = NextRandom(&rng);
+    }
+    memcpy(alt->memory, ref->memory, 0x10000);
+
+    uint64_t step = 0;
+    int result = 0;
+    for (int t = 0; t < trials && result == 0; t++) {
+        State8080 *s = &ref->cpu;
+        s->a = NextRandom(&rng);
+        s->b = NextRandom(&rng);
+        s->c = NextRandom(&rng);
+        s->d = NextRandom(&rng);
+        s->e = NextRandom(&rng);
+        s->h = NextRandom(&rng);
+        s->l = NextRandom(&rng);
+        s->sp = NextRandom(&rng);
+        s->pc = NextRandom(&rng);
+        UnpackFlags(s, NextRandom(&rng));
+        s->int_enable = NextRandom(&rng) & 1;
+        s->halted = 0;
+
+        alt->cpu.a = s->a;
+        alt->cpu.b = s->b;
+        alt->cpu.c = s->c;
+        alt->cpu.d = s->d;
+        alt->cpu.e = s->e;
+        alt->cpu.h = s->h;
+        alt->cpu.l = s->l;
+        alt->cpu.sp = s->sp;
+        alt->cpu.pc = s->pc;
+        alt->cpu.cc = s->cc;
+        alt->cpu.int_enable = s->int_enable;
+        alt->cpu.halted = 0;
+        alt->cpu.cycles = s->cycles;
+
+        for (int i = 0; i < steps; i++) {
+            if (LockstepStep(&ref->cpu, ref_core, &alt->cpu, alt_core, step, div) != 0) {
+                result = -1;
+                break;
+            }
+            step++;
+        }
+    }
+
+    free(ref);
+    free(alt);
+    return result ? -1 : (int64_t)step;
+}
+
+int LockstepIdleRun(const RomSet *roms, int frames) {
+    // Idle loop skipping has to be invisible: plays frames on a strict
+    // machine and a skipping one and compares them after every frame.
+    // Returns the first frame that differs, or -1.
+    Invaders *ref = InvadersNew(roms);
+    Invaders *alt = InvadersNew(roms);
+    InvadersSnapshot *ref_snap = malloc(sizeof(InvadersSnapshot));
+    InvadersSnapshot *alt_snap = malloc(sizeof(InvadersSnapshot));
+    ref->cpu.strict = 1;
+
+    int diverged = -1;
+    for (int f = 0; f < frames && diverged < 0; f++) {
+        InvadersRunFrame(ref);
+        InvadersRunFrame(alt);
+        InvadersSave(ref, ref_snap);
+        InvadersSave(alt, alt_snap);
+        if (memcmp(ref_snap, alt_snap, sizeof(InvadersSnapshot)) != 0) {
+            diverged = f;
+        }
+    }
+
+    free(ref_snap);
+    free(alt_snap);
+    free(ref);
+    free(alt);
+    return diverged;
+}
+
+int64_t LockstepInvadersRun(CpuCore ref_core, CpuCore alt_core, const RomSet *roms,
+                            int frames, Divergence *div) {
+    // Plays frames of the attract mode on two machines, interrupts are
+    // raised from the reference machine's cycle count. Returns the number of
+    // instructions compared, or -1 with div filled in.
+    Invaders *ref = InvadersNew(roms);
+    Invaders *alt = InvadersNew(roms);
+    WriteLog *ref_log = malloc(sizeof(WriteLog));
+    WriteLog *alt_log = malloc(sizeof(WriteLog));
+    AttachWriteLog(&ref->bus, ref_log);
+    AttachWriteLog(&alt->bus, alt_log);
+
+    uint64_t step = 0;
+    int result = 0;
+    for (int f = 0; f < frames && result == 0; f++) {
+        int cycles = 0;
+        for (int half = 1; half <= 2 && result == 0; half++) {
+            while (cycles < INVADERS_CYCLES_PER_FRAME * half / 2) {
+                if (ref->cpu.halted && alt->cpu.halted) {
+                    // Both asleep until the interrupt
+                    InvadersRun(alt, cycles, INVADERS_CYCLES_PER_FRAME * half / 2);
+                    cycles = InvadersRun(ref, cycles, INVADERS_CYCLES_PER_FRAME * half / 2);
+                    break;
+                }
+                uint64_t before = ref->cpu.cycles;
+                if (LockstepStep(&ref->cpu, ref_core, &alt->cpu, alt_core, step, div) != 0) {
+                    result = -1;
+                    break;
+                }
+                cycles += ref->cpu.cycles - before;
+                step++;
+            }
+            InvadersInterrupt(ref, half);
+            InvadersInterrupt(alt, half);
+        }
+    }
+
+    free(ref_log);
+    free(alt_log);
+    free(ref);
+    free(alt);
+    return result ? -1 : (int64_t)step;
+}
+
+#endif
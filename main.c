@@ -9,167 +9,90 @@
 
 #ifdef _WIN32
     #include <SDL.h>
-    #include <SDL_mixer.h>
-#elif __APPLE__
+#else
     #include <SDL2/SDL.h>
-    #include <SDL2/SDL_mixer.h>
 #endif
 
 #include "./disassembler/disassembler.h"
 #include "./emulator/emulator.h"
+#include "./romset/romset.h"
+#include "./debugger/debugger.h"
+#include "./invaders/invaders.h"
+#include "./scaler/scaler.h"
+#include "./capture/capture.h"
+#include "./mixer/mixer.h"
+#include "./netplay/netplay.h"
+#include "./shm/shm.h"
+#include "./embed/sounds.h"
 
 //Global variables
+RomSet roms;
 SDL_Surface *surface;
 int resizef;
 SDL_Window *window;
 SDL_Surface *winsurface;
-mem_t *ram;
-uint8_t input_port1 = 0;
-uint8_t input_port2 = 0;
-uint8_t output_port3 = 0;
-uint8_t output_port5 = 0;
-uint8_t last_output_port3 = 0;
-uint8_t last_output_port5 = 0;
-
-static uint16_t shift_register;
-uint8_t     shift_offset;   // offset for external shift hardware
-
-#define HEIGHT 256
-#define WIDTH  224
-
-#define FRAMERATE         (1000.0 / 60.0)   // ms per frame
-#define CYCLES_PER_MS      2000             // 8080 runs at 2 Mhz
-#define CYCLES_PER_FRAME  (CYCLES_PER_MS * FRAMERATE)
-
-#define NUM_SAMPLES  9
-
-//The sound effects that will be used
-Mix_Chunk *wav0 = NULL;
-Mix_Chunk *wav1 = NULL;
-Mix_Chunk *wav2 = NULL;
-Mix_Chunk *wav3 = NULL;
-Mix_Chunk *wav4 = NULL;
-Mix_Chunk *wav5 = NULL;
-Mix_Chunk *wav6 = NULL;
-Mix_Chunk *wav7 = NULL;
-Mix_Chunk *wav8 = NULL;
-/*
-Mix_Chunk *wav9 = NULL;
-Mix_Chunk *wav10 = NULL;
-Mix_Chunk *wav11 = NULL;
-Mix_Chunk *wav12 = NULL;
-Mix_Chunk *wav13 = NULL;
-Mix_Chunk *wav14 = NULL;
-Mix_Chunk *wav15 = NULL;
-Mix_Chunk *wav16 = NULL;
-Mix_Chunk *wav17 = NULL;
-Mix_Chunk *wav18 = NULL;
-*/
-
-void ReadFileIntoMemoryAt(State8080* state, char* filename, uint32_t offset)
-{
-	FILE *f= fopen(filename, "rb");
-	if (f==NULL)
-	{
-		printf("error: Couldn't open %s\n", filename);
-		exit(1);
-	}
-	fseek(f, 0L, SEEK_END);
-	int fsize = ftell(f);
-	fseek(f, 0L, SEEK_SET);
-	
-	uint8_t *buffer = &state->memory[offset];
-	fread(buffer, fsize, 1, f);
-	fclose(f);
+Scaler *scaler;             // built in upscaler, NULL leaves scaling to SDL
+int scale_mode = SCALE_NEAREST;
+int scanlines;
+SDL_Surface *scaled;
+Capture *capture;           // --record, NULL when not recording
+FILE *inputs;               // --inputs, NULL when not recording
+Mixer *mixer;
+SDL_AudioDeviceID audio;
+Netplay *netplay;           // --netplay, NULL for a local game
+SharedFrame *shared;        // --shm, NULL when not publishing
+const char *shared_name;
+
+#define HEIGHT INVADERS_HEIGHT
+#define WIDTH  INVADERS_WIDTH
+
+#define FRAMERATE         (1000.0 / INVADERS_FPS)   // ms per frame
+#define CYCLES_PER_FRAME  INVADERS_CYCLES_PER_FRAME
+
+
+void DrawScaled(void) {
+    // Upscales the frame by the largest integer factor that fits the window
+    // (the fixed factor for Scale2x/3x/4x) and centers it
+    winsurface = SDL_GetWindowSurface(window);
+    int factor = winsurface->w / WIDTH < winsurface->h / HEIGHT ? winsurface->w / WIDTH : winsurface->h / HEIGHT;
+    int k = ScaleFactor(scale_mode, factor);
+
+    if (scaled == NULL || scaled->w != WIDTH * k) {
+        SDL_FreeSurface(scaled);
+        scaled = SDL_CreateRGBSurface(0, WIDTH * k, HEIGHT * k, 32, 0, 0, 0, 0);
+    }
+    Scale(scaler, surface->pixels, WIDTH, HEIGHT, surface->pitch / 4,
+          scaled->pixels, scaled->pitch / 4, scale_mode, factor, scanlines);
+
+    SDL_Rect rect = { (winsurface->w - scaled->w) / 2, (winsurface->h - scaled->h) / 2, scaled->w, scaled->h };
+    SDL_FillRect(winsurface, NULL, 0);
+    if (rect.x < 0 || rect.y < 0) {
+        SDL_BlitScaled(scaled, NULL, winsurface, NULL);     // window smaller than a fixed factor
+    } else {
+        SDL_BlitSurface(scaled, NULL, winsurface, &rect);
+    }
 }
 
-void DrawVideoRAM(State8080* state) {
-    uint32_t *pix = surface->pixels;
-
-    int i = 0x2400;  // Start of Video RAM
-    for (int col = 0; col < WIDTH; col ++) {
-        for (int row = HEIGHT; row > 0; row -= 8) {
-            for (int j = 0; j < 8; j++) {
-                int idx = (row - j) * WIDTH + col;
-
-                if (state->memory[i] & 1 << j) {
-                    if (row >= 188 && row <= 240)
-                    {
-                        pix[idx] = 0x00FF00;            // color player ship and cover green
-                    }
-                    else if (row >= 33 && row <= 55)
-                    {
-                        pix[idx] = 0xFF0000;            // color ufo red
-                    }
-                    else                    
-                    {
-                        pix[idx] = 0xFFFFFF;            // color the rest simply white
-                    } 
-
-                } else {
-                    pix[idx] = 0x000000;
-                }
-            }
-            i++;
+void DrawVideoRAM(Invaders* machine) {
+    ConvertVideoRAM(&machine->memory[INVADERS_VRAM], surface->pixels);
+
+    if (scaler) {
+        DrawScaled();
+    } else {
+        if (resizef) {
+        winsurface = SDL_GetWindowSurface(window);
         }
-    }
 
-    if (resizef) {
-    winsurface = SDL_GetWindowSurface(window);
+        SDL_BlitScaled(surface, NULL, winsurface, NULL);
     }
 
-    SDL_BlitScaled(surface, NULL, winsurface, NULL);
-
     // Update window
     if (SDL_UpdateWindowSurface(window)) {
         puts(SDL_GetError());
     }
 }
 
-uint8_t HandleSpaceInvadersIN(uint8_t port)
-{
-    // returns value to be put into state->a
-    unsigned char a = 0;
-    switch(port)
-    {
-        case 0:
-                a = 1;
-                break;
-        case 1: 
-                a = input_port1;
-                break;
-        case 2:
-            a = input_port2;
-            break;
-        case 3: // returns data shifted by the shift amount
-            {
-                a = shift_register >> (8 - shift_offset);;
-            }
-                break;
-    }
-    return a;
-}
-
-void HandleSpaceInvadersOUT(uint8_t port, uint8_t value)
-{
-    switch(port)
-    {
-        case 2: // sets the shift amount
-                shift_offset = value;
-                break;
-        case 3: // sets output port for sound
-                output_port3 = value;
-                break;
-        case 4: // sets the data in the shift registers
-                shift_register = (value << 8) | (shift_register >> 8);
-                break;
-        case 5: // sets output port for sound
-                output_port5 = value;
-                break;
-    }
-}
-
-void HandleInput(bool *quit, State8080* state) {
+void HandleInput(bool *quit, uint8_t *port1, uint8_t *port2) {
     SDL_Event ev;
 
     while (SDL_PollEvent(&ev)) {
@@ -179,46 +102,46 @@ void HandleInput(bool *quit, State8080* state) {
             const char *key = SDL_GetKeyName(ev.key.keysym.sym);
 
             if (strcmp(key, "C") == 0) {            // Insert Credit
-                input_port1 |= 0x01;
+                *port1 |= 0x01;
             } else if (strcmp(key, "2") == 0) {     // Player 2 Start
-                input_port1 |= 0x02;
+                *port1 |= 0x02;
             } else if (strcmp(key, "1") == 0) {     // Player 1 Start
-                input_port1 |= 0x04;
+                *port1 |= 0x04;
             } else if (strcmp(key, "A") == 0) {     // Player 1 move left
-                input_port1 |= 0x20;
+                *port1 |= 0x20;
             } else if (strcmp(key, "D") == 0) {     // Player 1 move right
-                input_port1 |= 0x40;
+                *port1 |= 0x40;
             } else if (strcmp(key, "W") == 0) {     // Player 1 shoot
-                input_port1 |= 0x10;
+                *port1 |= 0x10;
             } else if (strcmp(key, "Left") == 0) {  // Player 2 move left
-                input_port2 |= 0x20;
+                *port2 |= 0x20;
             } else if (strcmp(key, "Right") == 0) { // Player 2 move right
-                input_port2 |= 0x40;
+                *port2 |= 0x40;
             } else if (strcmp(key, "Up") == 0) {    // Player 2 shoot
-                input_port2 |= 0x10;
+                *port2 |= 0x10;
             } else if (strcmp(key, "Escape") == 0) {// Quit
                 *quit = true;
             }
         } else if (ev.type == SDL_KEYUP) {
             const char *key = SDL_GetKeyName(ev.key.keysym.sym);
             if (strcmp(key, "C") == 0) {
-                input_port1 &= ~0x01;
+                *port1 &= ~0x01;
             } else if (strcmp(key, "2") == 0) {
-                input_port1 &= ~0x02;
+                *port1 &= ~0x02;
             } else if (strcmp(key, "1") == 0) {
-                input_port1 &= ~0x04;
+                *port1 &= ~0x04;
             } else if (strcmp(key, "A") == 0) {
-                input_port1 &= ~0x20;
+                *port1 &= ~0x20;
             } else if (strcmp(key, "D") == 0) {
-                input_port1 &= ~0x40;
+                *port1 &= ~0x40;
             } else if (strcmp(key, "W") == 0) {
-                input_port1 &= ~0x10;
+                *port1 &= ~0x10;
             } else if (strcmp(key, "Left") == 0) {
-                input_port2 &= ~0x20;
+                *port2 &= ~0x20;
             } else if (strcmp(key, "Right") == 0) {
-                input_port2 &= ~0x40;
+                *port2 &= ~0x40;
             } else if (strcmp(key, "Up") == 0) {
-                input_port2 &= ~0x10;
+                *port2 &= ~0x10;
             } else if (strcmp(key, "Escape") == 0) {
                 *quit = true;
             }
@@ -226,10 +149,14 @@ void HandleInput(bool *quit, State8080* state) {
     }
 }
 
-State8080* Init8080(void)
+void AudioCallback(void *userdata, Uint8 *stream, int len)
+{
+    MixerRead(mixer, (int16_t *)stream, len / sizeof(int16_t));
+}
+
+Invaders* Init8080(void)
 {
-	State8080* state = calloc(1,sizeof(State8080));
-	state->memory = malloc(0x10000);  //16K
+	Invaders* machine = InvadersNew(NULL);
 
 	// SDL Init returns zero on success
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) != 0) {
@@ -237,12 +164,21 @@ State8080* Init8080(void)
         exit(1);
     }
 
-    //Initialize SDL_mixer
-    if(Mix_OpenAudio( 44100, MIX_DEFAULT_FORMAT, 2, 2048 ) < 0)
-    {
-        printf( "SDL_mixer could not initialize! SDL_mixer Error: %s\n", Mix_GetError() );
+    // Sound effects are mixed in software and played from the audio thread
+    mixer = MixerNew(MIXER_DEFAULT_CAPACITY);
+    LoadInvadersSounds(mixer, "./ROMs/sound");
+    SDL_AudioSpec want = { 0 };
+    want.freq = MIXER_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = 1024;
+    want.callback = AudioCallback;
+    audio = SDL_OpenAudioDevice(NULL, 0, &want, NULL, 0);
+    if (audio == 0) {
+        printf("Error opening audio: %s\n", SDL_GetError());
         exit(1);
     }
+    SDL_PauseAudioDevice(audio, 0);
 
 	// Creates a window for the game
     window = SDL_CreateWindow(
@@ -270,188 +206,174 @@ State8080* Init8080(void)
     // Create backbuffer surface
     surface = SDL_CreateRGBSurface(0, WIDTH, HEIGHT, 32, 0, 0, 0, 0);
 
-	return state;
+	return machine;
 }
 
-void PlaySounds(void)
+void MachineSound(Invaders* machine, uint8_t port, uint8_t value)
 {
-    if (output_port3 != last_output_port3)
-    {
-        int channel;
-        int ufoChannel = 1;
-        
-        if ( (output_port3 & 0x1) && !(last_output_port3 & 0x1) )
-        {
-            // Start UFO
-            wav0 = Mix_LoadWAV("./ROMs/sound/0.wav");
-            if(wav0 == NULL) { fprintf(stderr, "Unable to load WAV file 0: %s\n", Mix_GetError()); }
-            channel = Mix_PlayChannel(ufoChannel, wav0, -1 );
-            if(channel == -1) { fprintf(stderr, "Unable to play WAV file 0: %s\n", Mix_GetError()); }
-        }
-        else if ( !(output_port3 & 0x1) && (last_output_port3 & 0x1) ) 
-        {
-            // Stop UFO
-            Mix_HaltChannel(ufoChannel);
-        }
-
-        if ( (output_port3 & 0x2) && !(last_output_port3 & 0x2) )
-        {
-            // Player Shoot
-            wav1 = Mix_LoadWAV("./ROMs/sound/1.wav");
-            if(wav1 == NULL) { fprintf( stderr, "Unable to load WAV file 1: %s\n", Mix_GetError()); }
-            channel = Mix_PlayChannel( -1, wav1, 0 );
-            if (channel == -1) { fprintf(stderr, "Unable to play WAV file 1: %s\n", Mix_GetError()); }
-        }           
-        
-        if ( (output_port3 & 0x4) && !(last_output_port3 & 0x4) )
-        {
-            // Player dies
-            wav2 = Mix_LoadWAV("./ROMs/sound/2.wav");
-            if(wav2 == NULL) { fprintf(stderr, "Unable to load WAV file 2: %s\n", Mix_GetError()); }
-            channel = Mix_PlayChannel( -1, wav2, 0 );
-            if(channel == -1) { fprintf(stderr, "Unable to play WAV file 2: %s\n", Mix_GetError()); }
-        }            
-        
-        if ( (output_port3 & 0x8) && !(last_output_port3 & 0x8) )
-        {
-            // Invader dies
-            wav3 = Mix_LoadWAV("./ROMs/sound/3.wav");
-            if(wav3 == NULL) { fprintf(stderr, "Unable to load WAV file 3: %s\n", Mix_GetError()); }
-            channel = Mix_PlayChannel( -1, wav3, 0 );
-            if(channel == -1) { fprintf(stderr, "Unable to play WAV file 3: %s\n", Mix_GetError()); }
-        }            
-        
-        last_output_port3 = output_port3;
-    }
-    if (output_port5 != last_output_port5)
-    {
-        int channel;
-        if ( (output_port5 & 0x1) && !(last_output_port5 & 0x1))
-        {
-            // Fleet movement 1
-            wav4 = Mix_LoadWAV("./ROMs/sound/4.wav");
-            if(wav4 == NULL) { fprintf(stderr, "Unable to load WAV file 4: %s\n", Mix_GetError()); }
-            channel = Mix_PlayChannel( -1, wav4, 0 );
-            if(channel == -1) { fprintf(stderr, "Unable to play WAV file 4: %s\n", Mix_GetError()); }
-        }            
-        
-        if ( (output_port5 & 0x2) && !(last_output_port5 & 0x2))
-        {
-            // Fleet movement 2
-            wav5 = Mix_LoadWAV("./ROMs/sound/5.wav");
-            if(wav5 == NULL) { fprintf(stderr, "Unable to load WAV file 5: %s\n", Mix_GetError()); }
-            channel = Mix_PlayChannel( -1, wav5, 0 );
-            if(channel == -1) { fprintf(stderr, "Unable to play WAV file 5: %s\n", Mix_GetError()); }
-        }            
-        
-        if ( (output_port5 & 0x4) && !(last_output_port5 & 0x4))
-        {
-            // Fleet movement 3
-            wav6 = Mix_LoadWAV("./ROMs/sound/6.wav");
-            if(wav6 == NULL) { fprintf(stderr, "Unable to load WAV file 6: %s\n", Mix_GetError()); }
-            channel = Mix_PlayChannel( -1, wav6, 0 );
-            if(channel == -1) { fprintf(stderr, "Unable to play WAV file 6: %s\n", Mix_GetError()); }
-        }            
-        
-        if ( (output_port5 & 0x8) && !(last_output_port5 & 0x8))
-        {
-            // Fleet movement 4
-            wav7 = Mix_LoadWAV("./ROMs/sound/7.wav");
-            if(wav7 == NULL) { fprintf(stderr, "Unable to load WAV file 7: %s\n", Mix_GetError()); }
-            channel = Mix_PlayChannel( -1, wav7, 0 );
-            if(channel == -1) { fprintf(stderr, "Unable to play WAV file 7: %s\n", Mix_GetError()); }
-        }            
-        
-        if ( (output_port5 & 0x10) && !(last_output_port5 & 0x10))
-        {
-            // UFO hit
-            wav8 = Mix_LoadWAV("./ROMs/sound/8.wav");
-            if(wav8 == NULL) { fprintf(stderr, "Unable to load WAV file 8: %s\n", Mix_GetError()); }
-            channel = Mix_PlayChannel( -1, wav8, 0 );
-            if(channel == -1) { fprintf(stderr, "Unable to play WAV file 8: %s\n", Mix_GetError()); }
-        }            
-        
-        last_output_port5 = output_port5;
-    }
+    MixerWrite(mixer, machine->cpu.cycles, port, value);
 }
 
 int main (int argc, char**argv)
 {     
-	State8080* state = Init8080();
+	Invaders* machine = Init8080();
+	State8080* state = &machine->cpu;
 
-	ReadFileIntoMemoryAt(state, "./ROMs/invaders.h", 0);
-	ReadFileIntoMemoryAt(state, "./ROMs/invaders.g", 0x800);
-	ReadFileIntoMemoryAt(state, "./ROMs/invaders.f", 0x1000);
-	ReadFileIntoMemoryAt(state, "./ROMs/invaders.e", 0x1800);
+	// Map the verified ROM images read only into 0x0000 - 0x1fff
+	if (LoadInvadersRomSet(&roms, "./ROMs") != 0) {
+		exit(1);
+	}
+	BusMapRomSet(state->bus, &roms);
+	machine->sound = MachineSound;
+
+	// --trace <file> records every instruction, decode it with trace_decode
+	// --gdb <port> waits for GDB to attach before running
+	// --strict runs every instruction, no idle loop skipping
+	// --scale nearest|scale2x|scale3x|scale4x upscales in software, --scanlines darkens every other line
+	// --record <file> captures every frame, .png makes a numbered sequence, .gif or .y4m one file
+	// --audio <file.wav> also writes the sound to a WAV file
+	// --netplay <player 1|2> <local port> <address:port> plays the other player over UDP
+	// --shm <name> publishes every frame in shared memory, see shm/shm.h
+	// --inputs <file> records the input ports of every frame of a local game, replay with headless --play
+	// --boot <snapshot> starts from a snapshot instead of power on, e.g. workloads/game_start.snapshot (before --netplay)
+	Debugger *debugger = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			state->trace = TraceOpen(argv[++i], TRACE_DEFAULT_CAPACITY);
+			if (state->trace == NULL) {
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "--gdb") == 0 && i + 1 < argc) {
+			debugger = DebuggerListen(state, atoi(argv[++i]));
+			if (debugger == NULL) {
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "--strict") == 0) {
+			state->strict = 1;
+		} else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+			const char *mode = argv[++i];
+			scale_mode = strcmp(mode, "scale2x") == 0 ? SCALE_2X :
+			             strcmp(mode, "scale3x") == 0 ? SCALE_3X :
+			             strcmp(mode, "scale4x") == 0 ? SCALE_4X : SCALE_NEAREST;
+			if (scaler == NULL) {
+				scaler = ScalerNew(ScalerThreads());
+			}
+		} else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			capture = CaptureOpen(argv[++i], CAPTURE_DEFAULT_CAPACITY);
+			if (capture == NULL) {
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "--audio") == 0 && i + 1 < argc) {
+			if (MixerRecord(mixer, argv[++i]) != 0) {
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "--netplay") == 0 && i + 3 < argc) {
+			netplay = NetplayOpen(machine, atoi(argv[i + 1]) - 1, atoi(argv[i + 2]), argv[i + 3]);
+			if (netplay == NULL) {
+				exit(1);
+			}
+			i += 3;
+		} else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+			shared_name = argv[++i];
+			shared = SharedFrameCreate(shared_name);
+			if (shared == NULL) {
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "--inputs") == 0 && i + 1 < argc) {
+			inputs = fopen(argv[++i], "wb");
+			if (inputs == NULL) {
+				printf("error: Couldn't create %s\n", argv[i]);
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "--boot") == 0 && i + 1 < argc) {
+			if (InvadersLoadFile(machine, argv[++i]) != 0) {
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "--scanlines") == 0) {
+			scanlines = 1;
+			if (scaler == NULL) {
+				scaler = ScalerNew(ScalerThreads());
+			}
+		}
+	}
 
+    uint8_t keys_port1 = 0, keys_port2 = 0;
     uint32_t lastTime = SDL_GetTicks();
     bool quit = false;
 	while (!quit) {
-        unsigned char *op;
         int cycles = 0;
-        if (SDL_GetTicks() - lastTime >= FRAMERATE) {
+        if (netplay && SDL_GetTicks() - lastTime >= FRAMERATE) {
+            // Whole frames with the inputs of both players, the keyboard
+            // only feeds the local one
             lastTime = SDL_GetTicks();
-            while (cycles < CYCLES_PER_FRAME / 2) {
-                op = &state->memory[state->pc];
-                if (*op == 0xdb) // machine IN instruction
-                {
-                    state->a = HandleSpaceInvadersIN(op[1]);
-                    state->pc += 2;
-                    cycles += 3;
-                } else if (*op == 0xd3) // machine OUT instruction
-                {
-                    HandleSpaceInvadersOUT(op[1], state->a);
-                    PlaySounds();
-                    state->pc += 2;
-                    cycles += 3;                    
-                } else {
-                    cycles += Emulate8080(state);
+            HandleInput(&quit, &keys_port1, &keys_port2);
+            if (NetplayAdvance(netplay, NetplayInput(keys_port1, keys_port2))) {
+                if (capture) {
+                    CaptureVideo(capture, &machine->memory[INVADERS_VRAM]);
+                }
+                if (shared) {
+                    SharedFramePublish(shared, &machine->memory[INVADERS_VRAM], machine->frames);
                 }
+                MixerRender(mixer, state->cycles);
+                DrawVideoRAM(machine);
             }
-
-            if (state->int_enable) {
-                GenerateInterrupt(state, 1);
+        } else if (SDL_GetTicks() - lastTime >= FRAMERATE) {
+            lastTime = SDL_GetTicks();
+            if (debugger && debugger->attached) {
+                cycles = DebuggerRun(debugger, state, cycles, CYCLES_PER_FRAME / 2);
             }
+            cycles = InvadersRun(machine, cycles, CYCLES_PER_FRAME / 2);
+            InvadersInterrupt(machine, 1);
 
-            HandleInput(&quit, state);
-            DrawVideoRAM(state);
-
-            while (cycles < CYCLES_PER_FRAME) {
-                op = &state->memory[state->pc];
-                if (*op == 0xdb) // machine IN instruction
-                {
-                    state->a = HandleSpaceInvadersIN(op[1]);
-                    state->pc += 2;
-                    cycles += 3;
-                } else if (*op == 0xd3) // machine OUT instruction
-                {
-                    HandleSpaceInvadersOUT(op[1], state->a);
-                    PlaySounds();
-                    state->pc += 2;
-                    cycles += 3;                    
-                } else {
-                    cycles += Emulate8080(state);
-                }
+            HandleInput(&quit, &machine->input_port1, &machine->input_port2);
+            if (inputs) {
+                fputc(machine->input_port1, inputs);
+                fputc(machine->input_port2, inputs);
             }
+            DrawVideoRAM(machine);
 
-            if (state->int_enable) {
-                GenerateInterrupt(state, 2);
+            if (debugger && debugger->attached) {
+                cycles = DebuggerRun(debugger, state, cycles, CYCLES_PER_FRAME);
+            }
+            InvadersRun(machine, cycles, CYCLES_PER_FRAME);
+            if (capture) {
+                CaptureVideo(capture, &machine->memory[INVADERS_VRAM]);
             }
+            if (shared) {
+                SharedFramePublish(shared, &machine->memory[INVADERS_VRAM], machine->frames + 1);
+            }
+            InvadersInterrupt(machine, 2);
+            MixerRender(mixer, state->cycles);
+            machine->frames++;
         }
 	}
 
-    Mix_FreeChunk(wav0);
-    Mix_FreeChunk(wav1);
-    Mix_FreeChunk(wav2);
-    Mix_FreeChunk(wav3);
-    Mix_FreeChunk(wav4);
-    Mix_FreeChunk(wav5);
-    Mix_FreeChunk(wav6);
-    Mix_FreeChunk(wav7);
-    Mix_FreeChunk(wav8);
-    Mix_CloseAudio();
+	if (state->trace) {
+		TraceClose(state->trace);
+	}
+	if (netplay) {
+		NetplayClose(netplay);
+	}
+	if (shared) {
+		SharedFrameClose(shared);
+		SharedFrameRemove(shared_name);
+	}
+	if (capture) {
+		printf("Recorded %llu frames\n", (unsigned long long)CaptureClose(capture));
+	}
+	if (inputs) {
+		fclose(inputs);
+	}
+
+	SDL_CloseAudioDevice(audio);
+	MixerFree(mixer);
 	SDL_FreeSurface(surface);
+	SDL_FreeSurface(scaled);
+	if (scaler) {
+		ScalerFree(scaler);
+	}
 	SDL_DestroyWindow(window);
 	SDL_Quit();
+	FreeRomSet(&roms);
 	return 0;
 }
@@ -6,6 +6,213 @@
 
 #include "./disassembler/disassembler.h"
 #include "./emulator/emulator.h"
+#include "./cpm/cpm.h"
+#include "./cow/cow.h"
+#include "./netplay/netplay.h"
+
+// CPU diagnostics run when no programs are given on the command line, missing ones are skipped
+const char *DIAGNOSTICS[] = { "./ROMs/cpm/cpudiag.bin", "./ROMs/cpm/8080PRE.COM", "./ROMs/cpm/8080EXM.COM" };
+
+// Prints "CP/M OK" through BDOS function 9 and warm boots
+const uint8_t CPM_SMOKE_TEST[] = {
+    0x11, 0x0b, 0x01,       // LXI  D, $010b
+    0x0e, 0x09,             // MVI  C, #$09
+    0xcd, 0x05, 0x00,       // CALL $0005
+    0xc3, 0x00, 0x00,       // JMP  $0000
+    'C', 'P', '/', 'M', ' ', 'O', 'K', '\n', '$',
+};
+
+typedef struct FlagCase {
+    const char  *name;
+    uint8_t     code[3];        // instructions, run until pc passes them
+    uint8_t     length;
+    uint8_t     a, b, psw;      // before, flags in PSW layout
+    uint8_t     result, flags;  // A and flags after
+} FlagCase;
+
+// Flags 8080PRE and 8080EXM check, for when they aren't in ./ROMs/cpm
+const FlagCase FLAG_CASES[] = {
+    { "ADC carries out of $ff",    { 0x88 },             1, 0x01, 0xff, 0x03, 0x01, 0x13 },
+    { "SBB borrows in",            { 0x98 },             1, 0x05, 0x02, 0x03, 0x02, 0x12 },
+    { "SUI 0 doesn't borrow",      { 0xd6, 0x00 },       2, 0x42, 0x00, 0x02, 0x42, 0x16 },
+    { "DAA adjusts after AC",      { 0x27 },             1, 0x12, 0x00, 0x12, 0x18, 0x06 },
+    { "DAA carries out",           { 0x27 },             1, 0x9a, 0x00, 0x02, 0x00, 0x57 },
+    { "INR sets AC",               { 0x3c },             1, 0x0f, 0x00, 0x02, 0x10, 0x12 },
+    { "DCR clears AC",             { 0x3d },             1, 0x10, 0x00, 0x02, 0x0f, 0x06 },
+    { "ANA sets AC from bit 3",    { 0xa0 },             1, 0x08, 0x00, 0x03, 0x00, 0x56 },
+    { "PUSH PSW layout",           { 0xf5, 0xc1, 0x79 }, 3, 0x00, 0x00, 0xd7, 0xd7, 0xd7 },
+};
+
+// Copy-on-write branches, attract mode frames before the branch and inputs per branch
+#define COW_TEST_FRAMES     200
+#define COW_BRANCH_FRAMES   60
+const uint8_t COW_BRANCH_INPUTS[2] = { 0x08, 0x09 };    // nothing, coin
+
+void PlayCowBranch(CowRunner *r, CowState *s, int branch, int frames) {
+    CowLoad(r, s);
+    r->m.input_port1 = COW_BRANCH_INPUTS[branch];
+    for (int f = 0; f < frames; f++) {
+        InvadersRunFrame(&r->m);
+    }
+    CowSync(r);
+}
+
+const char* CheckCowBranches(const RomSet *roms) {
+    // Clones a state, plays both branches in turns and checks the parent
+    // kept its RAM and each branch ended where a plain machine restored
+    // from a snapshot of the parent ends. Returns NULL if all of it held.
+    InvadersSnapshot *start = malloc(sizeof(InvadersSnapshot));
+    uint8_t *before = malloc(COW_PAGES << PAGE_SHIFT);
+    uint8_t *after = malloc(COW_PAGES << PAGE_SHIFT);
+    Invaders *m = InvadersNew(roms);
+    const char *error = NULL;
+
+    CowRunner *r = CowRunnerNew(roms);
+    for (int f = 0; f < COW_TEST_FRAMES; f++) {
+        InvadersRunFrame(&r->m);
+    }
+    InvadersSave(&r->m, start);
+    CowState *root = CowCapture(r);
+    CowReadRAM(root, before);
+
+    CowState *branches[2] = { CowClone(r, root), CowClone(r, root) };
+    for (int half = 0; half < 2; half++) {
+        for (int i = 0; i < 2; i++) {
+            PlayCowBranch(r, branches[i], i, COW_BRANCH_FRAMES / 2);
+        }
+    }
+    CowReadRAM(root, after);
+    if (memcmp(before, after, COW_PAGES << PAGE_SHIFT) != 0 || root->frames != COW_TEST_FRAMES) {
+        error = "the parent changed";
+    }
+
+    for (int i = 0; i < 2 && !error; i++) {
+        InvadersRestore(m, start);
+        m->input_port1 = COW_BRANCH_INPUTS[i];
+        for (int f = 0; f < COW_BRANCH_FRAMES; f++) {
+            InvadersRunFrame(m);
+        }
+        CowReadRAM(branches[i], after);
+        if (memcmp(&m->memory[INVADERS_RAM], after, COW_PAGES << PAGE_SHIFT) != 0 ||
+            m->cpu.pc != branches[i]->pc || m->cpu.cycles != branches[i]->cycles) {
+            error = i == 0 ? "the first branch differs from its replay" : "the second branch differs from its replay";
+        }
+    }
+    CowReadRAM(branches[0], before);
+    if (!error && memcmp(before, after, COW_PAGES << PAGE_SHIFT) == 0) {
+        error = "the branches didn't diverge";
+    }
+
+    CowFree(r, branches[0]);
+    CowFree(r, branches[1]);
+    CowFree(r, root);
+    CowRunnerFree(r);
+    free(m);
+    free(after);
+    free(before);
+    free(start);
+    return error;
+}
+
+// Netplay over a link losing and reordering packets, checked NETPLAY_TEST_FRAMES in
+#define NETPLAY_TEST_FRAMES     600
+#define NETPLAY_IN_FLIGHT       64      // packets on the link at most
+#define NETPLAY_LOSS            4       // one packet in 4 is dropped
+#define NETPLAY_MAX_DELAY       5       // ticks a packet may take, later ones overtake it
+
+typedef struct TestPacket {
+    uint8_t     data[NETPLAY_PACKET_SIZE];
+    size_t      size;
+    int         to;                     // peer, -1 for a free slot
+    uint32_t    due;                    // tick it arrives at
+} TestPacket;
+
+uint8_t NetplayTestInput(int player, uint32_t frame) {
+    // Player 1 inserts two coins and starts a two player game, after that
+    // both move and fire, changing every 8 frames
+    static const uint8_t controls[4] = { 0, NETPLAY_FIRE, NETPLAY_LEFT, NETPLAY_RIGHT | NETPLAY_FIRE };
+    if (player == 0 && ((frame >= 20 && frame < 24) || (frame >= 40 && frame < 44))) {
+        return NETPLAY_COIN;
+    }
+    if (player == 0 && frame >= 80 && frame < 84) {
+        return NETPLAY_START2;
+    }
+    uint32_t hash = (frame / 8 + 1) * 2654435761u ^ player * 0x9e3779b9u;
+    return controls[hash >> 30];
+}
+
+const char* CheckNetplay(const RomSet *roms) {
+    // Two peers in one process, connected through a queue that drops and
+    // reorders packets. Returns NULL if both reach the state of an offline
+    // game with the same inputs and never saw a desync.
+    Invaders *m[2] = { InvadersNew(roms), InvadersNew(roms) };
+    Netplay *np[2] = { NetplayNew(m[0], 0), NetplayNew(m[1], 1) };
+    TestPacket *link = malloc(NETPLAY_IN_FLIGHT * sizeof(TestPacket));
+    InvadersSnapshot *offline = malloc(sizeof(InvadersSnapshot));
+    const char *error = NULL;
+    uint64_t rng = 1;
+
+    // The last frame either peer runs needs the inputs of every frame before
+    // NETPLAY_TEST_FRAMES, so the snapshot of that frame is final then
+    const uint32_t last = NETPLAY_TEST_FRAMES + NETPLAY_MAX_ROLLBACK + 1;
+    for (int i = 0; i < NETPLAY_IN_FLIGHT; i++) {
+        link[i].to = -1;
+    }
+    uint32_t tick = 0;
+    for (; (np[0]->frame < last || np[1]->frame < last) && tick < last * 20; tick++) {
+        for (int p = 0; p < 2; p++) {
+            if (np[p]->frame < last) {
+                NetplayStep(np[p], NetplayTestInput(p, np[p]->frame));
+            }
+            rng = rng * 6364136223846793005ull + 1442695040888963407ull;
+            if ((rng >> 33) % NETPLAY_LOSS == 0) {
+                continue;
+            }
+            for (int i = 0; i < NETPLAY_IN_FLIGHT; i++) {
+                if (link[i].to < 0) {
+                    link[i].size = NetplayPacket(np[p], link[i].data);
+                    link[i].to = !p;
+                    link[i].due = tick + 1 + (rng >> 40) % NETPLAY_MAX_DELAY;
+                    break;
+                }
+            }
+        }
+        for (int i = 0; i < NETPLAY_IN_FLIGHT; i++) {
+            if (link[i].to >= 0 && link[i].due <= tick) {
+                NetplayReceive(np[link[i].to], link[i].data, link[i].size);
+                link[i].to = -1;
+            }
+        }
+    }
+
+    Invaders *reference = InvadersNew(roms);
+    for (uint32_t f = 0; f < NETPLAY_TEST_FRAMES; f++) {
+        NetplayApplyInputs(reference, NetplayTestInput(0, f), NetplayTestInput(1, f));
+        InvadersRunFrame(reference);
+    }
+    InvadersSave(reference, offline);
+    uint32_t check = Crc32((const uint8_t *)offline, sizeof(InvadersSnapshot));
+
+    if (np[0]->frame < last || np[1]->frame < last) {
+        error = "the peers stopped advancing";
+    } else if (np[0]->desync || np[1]->desync) {
+        error = "a desync was reported";
+    } else if (np[0]->checks[NETPLAY_TEST_FRAMES % NETPLAY_WINDOW] != check ||
+               np[1]->checks[NETPLAY_TEST_FRAMES % NETPLAY_WINDOW] != check) {
+        error = "the game differs from an offline one";
+    } else if (np[0]->rollbacks == 0 || np[1]->rollbacks == 0) {
+        error = "no frame was rolled back";
+    }
+
+    for (int p = 0; p < 2; p++) {
+        NetplayClose(np[p]);
+        free(m[p]);
+    }
+    free(reference);
+    free(offline);
+    free(link);
+    return error;
+}
 
 void PrintReg(State8080* state) {
     printf("\t");
@@ -21,23 +228,122 @@ void PrintReg(State8080* state) {
 State8080* Init8080(void)
 {
     State8080* state = calloc(1,sizeof(State8080));
-    state->memory = malloc(0x10000);  //16K
+    state->memory = calloc(1, 0x10000);  //64K
+    state->bus = BusNew();
+    BusMapRAM(state->bus, 0x00, PAGE_COUNT, state->memory);
     return state;
 }
 
+void ReportCPM(const char *name, const CpmResult *result) {
+    double mips = result->seconds > 0 ? result->instructions / result->seconds / 1e6 : 0;
+    if (result->faulted) {
+        printf("FAIL %s: unimplemented opcode at %04x after %llu instructions\n", name, result->fault_pc,
+               (unsigned long long)result->instructions);
+        return;
+    }
+    printf("%s %s: %llu instructions, %llu cycles, %.3f s, %.1f MIPS\n",
+           result->passed ? "PASS" : "FAIL", name,
+           (unsigned long long)result->instructions, (unsigned long long)result->cycles,
+           result->seconds, mips);
+}
+
 int main (int argc, char**argv)
 {
-    int done = 0;
-    int vblankcycles = 0;
+    int failed = 0;
     State8080* state = Init8080();
 
-    state->memory[0] = 0x07;
+    BusWrite(state->bus, 0, 0x07);
 
     state->a = 0xF2;
 
     PrintReg(state);
-    done = Emulate8080(state);
+    Emulate8080(state);
     PrintReg(state);
 
-    return 0;
+    // HLT sleeps until an interrupt, the run loop skips the idle cycles
+    state = Init8080();
+    BusWrite(state->bus, 0x0000, 0xfb);         // EI
+    BusWrite(state->bus, 0x0001, 0x76);         // HLT
+    state->sp = 0x1000;
+    int cycles = Run8080(state, 0, 1000);
+    int halted = state->halted && state->pc == 0x0002 && cycles == 1000 && state->cycles == 1000;
+    GenerateInterrupt(state, 1);
+    halted &= !state->halted && state->pc == 0x0008 && BusRead(state->bus, 0x0ffe) == 0x02;
+    printf("%s HLT: woke at %04x after %llu cycles\n", halted ? "PASS" : "FAIL", state->pc,
+           (unsigned long long)state->cycles);
+    failed |= !halted;
+
+    // Flags, one instruction sequence at a time
+    int flag_failures = 0;
+    int flag_count = (int)(sizeof(FLAG_CASES) / sizeof(FLAG_CASES[0]));
+    for (int i = 0; i < flag_count; i++) {
+        const FlagCase *fc = &FLAG_CASES[i];
+        state = Init8080();
+        for (int j = 0; j < fc->length; j++) {
+            BusWrite(state->bus, j, fc->code[j]);
+        }
+        state->a = fc->a;
+        state->b = fc->b;
+        state->sp = 0x1000;
+        UnpackFlags(state, fc->psw);
+        while (state->pc < fc->length) {
+            Emulate8080(state);
+        }
+        if (state->a != fc->result || PackFlags(state) != fc->flags) {
+            printf("FAIL flags, %s: A $%02x flags $%02x, expected $%02x $%02x\n", fc->name, state->a,
+                   PackFlags(state), fc->result, fc->flags);
+            flag_failures++;
+        }
+    }
+    if (flag_failures == 0) {
+        printf("PASS flags: %d cases\n", flag_count);
+    }
+    failed |= flag_failures != 0;
+
+    // Copy-on-write branches against save state replays
+    RomSet roms;
+    if (LoadRomSet(&roms, "./ROMs", INVADERS_MANIFEST, INVADERS_MANIFEST_COUNT) != 0) {
+        printf("SKIP copy-on-write branches and netplay: ROMs not found\n");
+    } else {
+        const char *error = CheckCowBranches(&roms);
+        printf("%s copy-on-write branches%s%s\n", error ? "FAIL" : "PASS", error ? ", " : "", error ? error : "");
+        failed |= error != NULL;
+
+        // Netplay with lost and reordered packets against an offline game
+        error = CheckNetplay(&roms);
+        printf("%s netplay, %d frames over a lossy link%s%s\n", error ? "FAIL" : "PASS", NETPLAY_TEST_FRAMES,
+               error ? ", " : "", error ? error : "");
+        failed |= error != NULL;
+        FreeRomSet(&roms);
+    }
+
+    // The CP/M shim itself
+    CpmResult *result = malloc(sizeof(CpmResult));
+    state = Init8080();
+    for (int i = 0; i < (int)sizeof(CPM_SMOKE_TEST); i++) {
+        BusWrite(state->bus, CPM_TPA + i, CPM_SMOKE_TEST[i]);
+    }
+    PrepareCPM(state);
+    RunCPM(state, 1000, result);
+    result->passed &= strcmp(result->output, "CP/M OK\n") == 0;
+    ReportCPM("smoke test", result);
+    failed |= !result->passed;
+
+    // CPU diagnostics, given as arguments or from ./ROMs/cpm
+    int count = argc > 1 ? argc - 1 : (int)(sizeof(DIAGNOSTICS) / sizeof(DIAGNOSTICS[0]));
+    for (int i = 0; i < count; i++) {
+        const char *name = argc > 1 ? argv[i + 1] : DIAGNOSTICS[i];
+        state = Init8080();
+        if (LoadCPM(state, name) != 0) {
+            printf("SKIP %s: not found\n", name);
+            continue;
+        }
+        RunCPM(state, 0, result);
+        printf("\n");
+        ReportCPM(name, result);
+        failed |= !result->passed;
+    }
+
+    free(result);
+    return failed;
 }
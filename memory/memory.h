@@ -0,0 +1,190 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../opcodes/opcodes.h"
+
+/* Memory bus for the 8080 address space.
+
+The 64K address space is split into 256 byte pages. Every page has a host
+pointer for reads and one for writes. Plain RAM pages point straight at host
+memory so an access is one table lookup. Pages with a NULL pointer fall back
+to a handler (ROM write protection, memory mapped IO, ...). Mirrored pages
+simply share the host pointers of the page they mirror. */
+
+#define PAGE_SHIFT   8
+#define PAGE_SIZE    (1 << PAGE_SHIFT)          // 256 bytes
+#define PAGE_COUNT   (0x10000 >> PAGE_SHIFT)    // 256 pages
+#define PAGE_MASK    (PAGE_SIZE - 1)
+
+// Page attributes, kept for inspection (debugger, save states, ...)
+#define PAGE_UNMAPPED  0
+#define PAGE_RAM       1
+#define PAGE_ROM       2
+#define PAGE_MIRROR    3
+#define PAGE_MMIO      4
+
+struct MemoryBus;
+
+typedef uint8_t (*BusReadHandler)(struct MemoryBus *bus, uint16_t addr);
+typedef void    (*BusWriteHandler)(struct MemoryBus *bus, uint16_t addr, uint8_t value);
+
+typedef struct MemoryBus {
+    uint8_t             *read[PAGE_COUNT];          // host page for reads, NULL -> read_handler
+    uint8_t             *write[PAGE_COUNT];         // host page for writes, NULL -> write_handler
+    BusReadHandler      read_handler[PAGE_COUNT];
+    BusWriteHandler     write_handler[PAGE_COUNT];
+    uint8_t             attr[PAGE_COUNT];
+    void                *ctx;                       // handed to MMIO handlers through the bus
+    void                *debug;                     // debugger owning watched pages, if any
+    void                *heatmap;                   // heatmap counting accesses, if any
+    uint8_t             fetching;                   // BusFetch is gathering through handlers
+    uint16_t            read_handlers;              // pages with a NULL read pointer, see BusCountHandlers
+} MemoryBus;
+
+#ifndef CORE8080_LIBRARY
+
+uint8_t BusOpenRead(MemoryBus *bus, uint16_t addr) {
+    // Nothing drives the data bus, so it floats high
+    return 0xff;
+}
+
+void BusIgnoreWrite(MemoryBus *bus, uint16_t addr, uint8_t value) {
+    // Writes to ROM or unmapped pages are dropped
+    return;
+}
+
+void BusCountHandlers(MemoryBus *bus) {
+    // Call after changing read pointers by hand (watchpoints, heatmap, ...),
+    // the BusMap functions do it themselves
+    bus->read_handlers = 0;
+    for (int i = 0; i < PAGE_COUNT; i++) {
+        bus->read_handlers += bus->read[i] == NULL;
+    }
+}
+
+void BusInit(MemoryBus *bus) {
+    // Every page starts out unmapped
+    memset(bus, 0, sizeof(MemoryBus));
+    for (int i = 0; i < PAGE_COUNT; i++) {
+        bus->read_handler[i] = BusOpenRead;
+        bus->write_handler[i] = BusIgnoreWrite;
+    }
+    BusCountHandlers(bus);
+}
+
+MemoryBus* BusNew(void) {
+    MemoryBus *bus = malloc(sizeof(MemoryBus));
+    BusInit(bus);
+    return bus;
+}
+
+void BusMapRAM(MemoryBus *bus, int first_page, int count, uint8_t *host) {
+    // Map host memory as readable and writable
+    for (int i = 0; i < count; i++) {
+        int page = first_page + i;
+        bus->read[page] = &host[i << PAGE_SHIFT];
+        bus->write[page] = &host[i << PAGE_SHIFT];
+        bus->read_handler[page] = BusOpenRead;
+        bus->write_handler[page] = BusIgnoreWrite;
+        bus->attr[page] = PAGE_RAM;
+    }
+    BusCountHandlers(bus);
+}
+
+void BusMapROM(MemoryBus *bus, int first_page, int count, const uint8_t *host) {
+    // Map host memory as read only, writes take the slow path and are dropped
+    for (int i = 0; i < count; i++) {
+        int page = first_page + i;
+        bus->read[page] = (uint8_t *)&host[i << PAGE_SHIFT];
+        bus->write[page] = NULL;
+        bus->read_handler[page] = BusOpenRead;
+        bus->write_handler[page] = BusIgnoreWrite;
+        bus->attr[page] = PAGE_ROM;
+    }
+    BusCountHandlers(bus);
+}
+
+void BusMapMirror(MemoryBus *bus, int first_page, int count, int src_page, int src_count) {
+    // Alias pages onto an already mapped region, repeating it as often as needed
+    for (int i = 0; i < count; i++) {
+        int page = first_page + i;
+        int src = src_page + (i % src_count);
+        bus->read[page] = bus->read[src];
+        bus->write[page] = bus->write[src];
+        bus->read_handler[page] = bus->read_handler[src];
+        bus->write_handler[page] = bus->write_handler[src];
+        bus->attr[page] = PAGE_MIRROR;
+    }
+    BusCountHandlers(bus);
+}
+
+void BusMapIO(MemoryBus *bus, int first_page, int count, BusReadHandler rh, BusWriteHandler wh) {
+    // Every access to these pages goes through the handlers
+    for (int i = 0; i < count; i++) {
+        int page = first_page + i;
+        bus->read[page] = NULL;
+        bus->write[page] = NULL;
+        bus->read_handler[page] = rh ? rh : BusOpenRead;
+        bus->write_handler[page] = wh ? wh : BusIgnoreWrite;
+        bus->attr[page] = PAGE_MMIO;
+    }
+    BusCountHandlers(bus);
+}
+
+#else
+
+// Compiled into libcore8080, see core/core8080.h
+uint8_t BusOpenRead(MemoryBus *bus, uint16_t addr);
+void BusIgnoreWrite(MemoryBus *bus, uint16_t addr, uint8_t value);
+void BusCountHandlers(MemoryBus *bus);
+void BusInit(MemoryBus *bus);
+MemoryBus* BusNew(void);
+void BusMapRAM(MemoryBus *bus, int first_page, int count, uint8_t *host);
+void BusMapROM(MemoryBus *bus, int first_page, int count, const uint8_t *host);
+void BusMapMirror(MemoryBus *bus, int first_page, int count, int src_page, int src_count);
+void BusMapIO(MemoryBus *bus, int first_page, int count, BusReadHandler rh, BusWriteHandler wh);
+
+#endif
+
+static inline uint8_t BusRead(MemoryBus *bus, uint16_t addr) {
+    uint8_t *page = bus->read[addr >> PAGE_SHIFT];
+    if (page) {
+        return page[addr & PAGE_MASK];
+    }
+    return bus->read_handler[addr >> PAGE_SHIFT](bus, addr);
+}
+
+static inline void BusWrite(MemoryBus *bus, uint16_t addr, uint8_t value) {
+    uint8_t *page = bus->write[addr >> PAGE_SHIFT];
+    if (page) {
+        page[addr & PAGE_MASK] = value;
+        return;
+    }
+    bus->write_handler[addr >> PAGE_SHIFT](bus, addr, value);
+}
+
+static inline uint8_t* BusFetch(MemoryBus *bus, uint16_t addr, uint8_t *scratch) {
+    // Returns a pointer to the 3 bytes at addr, enough for any instruction.
+    // Inside a mapped page the host memory is used directly, otherwise the
+    // instruction's bytes are gathered into scratch one at a time. Only as
+    // many as the opcode is long are read, the rest of scratch is zero.
+    // Handlers can tell these reads from data reads by bus->fetching.
+    uint8_t *page = bus->read[addr >> PAGE_SHIFT];
+    if (page && (addr & PAGE_MASK) <= PAGE_SIZE - 3) {
+        return &page[addr & PAGE_MASK];
+    }
+    bus->fetching = 1;
+    scratch[0] = BusRead(bus, addr);
+    int length = OPCODE_LENGTH[scratch[0]];
+    scratch[1] = length > 1 ? BusRead(bus, (uint16_t)(addr + 1)) : 0;
+    scratch[2] = length > 2 ? BusRead(bus, (uint16_t)(addr + 2)) : 0;
+    bus->fetching = 0;
+    return scratch;
+}
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef MIXER_H
+#define MIXER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "../invaders/invaders.h"
+
+/* Software mixer for the Space Invaders sound board.
+
+Writes to ports 3 and 5 are queued with the emulated cycle they happened
+at. MixerRender plays the queue back up to a cycle count, starting and
+stopping the samples at the exact output sample the write maps to, and
+mixes the result into 16 bit mono PCM. The PCM goes to an optional WAV file
+and into a single producer / single consumer ring that the audio device
+drains with MixerRead. Everything is driven by emulated time, so a
+headless run produces the same audio at any speed. */
+
+#define MIXER_RATE              44100
+#define MIXER_SOUNDS            9           // 0 - 3 on port 3 bits 0 - 3, 4 - 8 on port 5 bits 0 - 4
+#define MIXER_UFO               0           // loops while its bit is set
+#define MIXER_MAX_EVENTS        256
+#define MIXER_BLOCK             1024        // samples mixed at a time
+#define MIXER_DEFAULT_CAPACITY  (1 << 13)   // ring samples, must be a power of two
+
+typedef struct MixerSample {
+    int16_t     *data;              // MIXER_RATE mono
+    uint32_t    length;
+} MixerSample;
+
+typedef struct MixerEvent {
+    uint64_t    cycle;
+    uint8_t     port;
+    uint8_t     value;
+} MixerEvent;
+
+typedef struct Mixer {
+    MixerSample         sounds[MIXER_SOUNDS];
+    uint32_t            position[MIXER_SOUNDS];
+    uint8_t             playing[MIXER_SOUNDS];
+    uint8_t             port3;              // latches as of the last rendered sample
+    uint8_t             port5;
+    MixerEvent          events[MIXER_MAX_EVENTS];
+    int                 event_count;
+    uint64_t            sample;             // output samples rendered so far
+    int16_t             *ring;              // NULL when nothing plays the audio live
+    uint64_t            mask;
+    _Atomic uint64_t    head;               // next sample to write, owned by the emulation thread
+    _Atomic uint64_t    tail;               // next sample to play, owned by the audio thread
+    uint64_t            overruns;           // samples dropped because the ring was full
+    uint64_t            underruns;          // silent samples played because it was empty
+    FILE                *wav;
+    uint32_t            wav_samples;
+} Mixer;
+
+static uint32_t ReadLE32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t ReadLE16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+int ParseWavSample(MixerSample *sample, const uint8_t *file, long size, const char *filename) {
+    // Decodes an 8 or 16 bit PCM WAV file in memory and resamples it to
+    // MIXER_RATE mono. Returns -1 if it is in another format.
+    int ok = size > 12 && memcmp(file, "RIFF", 4) == 0 && memcmp(file + 8, "WAVE", 4) == 0;
+
+    // Walk the chunks for the format and the data
+    const uint8_t *fmt = NULL, *data = NULL;
+    uint32_t data_size = 0;
+    for (long pos = 12; ok && pos + 8 <= size; ) {
+        uint32_t chunk = ReadLE32(file + pos + 4);
+        if (chunk > size - pos - 8) {
+            chunk = size - pos - 8;         // truncated file, take what's there
+        }
+        if (memcmp(file + pos, "fmt ", 4) == 0 && chunk >= 16) {
+            fmt = file + pos + 8;
+        } else if (memcmp(file + pos, "data", 4) == 0) {
+            data = file + pos + 8;
+            data_size = chunk;
+        }
+        pos += 8 + chunk + (chunk & 1);
+    }
+
+    int channels = fmt ? ReadLE16(fmt + 2) : 0;
+    uint32_t rate = fmt ? ReadLE32(fmt + 4) : 0;
+    int bits = fmt ? ReadLE16(fmt + 14) : 0;
+    if (!ok || fmt == NULL || data == NULL || ReadLE16(fmt) != 1 || channels < 1 ||
+        rate == 0 || (bits != 8 && bits != 16)) {
+        fprintf(stderr, "error: %s is not an 8 or 16 bit PCM WAV file\n", filename);
+        return -1;
+    }
+
+    // Down mix to 16 bit mono
+    uint32_t frame = channels * bits / 8;
+    uint32_t count = data_size / frame;
+    int16_t *mono = malloc((count + 1) * sizeof(int16_t));
+    for (uint32_t i = 0; i < count; i++) {
+        int32_t sum = 0;
+        for (int c = 0; c < channels; c++) {
+            const uint8_t *p = data + i * frame + c * bits / 8;
+            sum += bits == 8 ? (p[0] - 128) << 8 : (int16_t)ReadLE16(p);
+        }
+        mono[i] = sum / channels;
+    }
+    mono[count] = count ? mono[count - 1] : 0;
+
+    // Linear interpolation to the output rate, step in 16.16 fixed point
+    uint64_t step = ((uint64_t)rate << 16) / MIXER_RATE;
+    uint32_t length = (uint32_t)(((uint64_t)count << 16) / step);
+    sample->data = malloc((length ? length : 1) * sizeof(int16_t));
+    sample->length = length;
+    for (uint32_t i = 0; i < length; i++) {
+        uint64_t at = i * step;
+        uint32_t index = at >> 16;
+        int64_t frac = at & 0xffff;
+        // A full swing times frac doesn't fit in 32 bits
+        sample->data[i] = mono[index] + (((mono[index + 1] - mono[index]) * frac) >> 16);
+    }
+    free(mono);
+    return 0;
+}
+
+int LoadWavSample(MixerSample *sample, const char *filename) {
+    // Reads a WAV file for ParseWavSample.
+    // Returns -1 if the file is missing or in another format.
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "error: Couldn't open sound %s\n", filename);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *file = malloc(size > 0 ? size : 1);
+    int ok = size > 0 && fread(file, size, 1, f) == 1;
+    fclose(f);
+
+    int result = ok ? ParseWavSample(sample, file, size, filename) : -1;
+    if (!ok) {
+        fprintf(stderr, "error: Couldn't read sound %s\n", filename);
+    }
+    free(file);
+    return result;
+}
+
+Mixer* MixerNew(size_t capacity) {
+    // capacity is the ring size in samples for live playback, 0 for none
+    Mixer *mixer = calloc(1, sizeof(Mixer));
+    if (capacity > 0) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        mixer->ring = malloc(size * sizeof(int16_t));
+        mixer->mask = size - 1;
+    }
+    return mixer;
+}
+
+int MixerLoadSounds(Mixer *mixer, const char *dir) {
+    // Loads dir/0.wav to dir/8.wav, missing ones stay silent.
+    // Returns the number that failed.
+    int failed = 0;
+    for (int i = 0; i < MIXER_SOUNDS; i++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%d.wav", dir, i);
+        if (LoadWavSample(&mixer->sounds[i], path) != 0) {
+            failed++;
+        }
+    }
+    return failed;
+}
+
+static void PutLE32(FILE *f, uint32_t v) {
+    fputc(v & 0xff, f);
+    fputc(v >> 8 & 0xff, f);
+    fputc(v >> 16 & 0xff, f);
+    fputc(v >> 24, f);
+}
+
+static void WriteWavHeader(FILE *f, uint32_t samples) {
+    fwrite("RIFF", 4, 1, f);
+    PutLE32(f, 36 + samples * 2);
+    fwrite("WAVEfmt ", 8, 1, f);
+    PutLE32(f, 16);
+    PutLE32(f, 1 | 1 << 16);                // PCM, mono
+    PutLE32(f, MIXER_RATE);
+    PutLE32(f, MIXER_RATE * 2);
+    PutLE32(f, 2 | 16 << 16);               // block align, bits per sample
+    fwrite("data", 4, 1, f);
+    PutLE32(f, samples * 2);
+}
+
+int MixerRecord(Mixer *mixer, const char *filename) {
+    // Also writes everything rendered from now on to a WAV file
+    mixer->wav = fopen(filename, "wb");
+    if (mixer->wav == NULL) {
+        fprintf(stderr, "error: Couldn't create %s\n", filename);
+        return -1;
+    }
+    mixer->wav_samples = 0;
+    WriteWavHeader(mixer->wav, 0);
+    return 0;
+}
+
+static void MixerTrigger(Mixer *mixer, uint8_t port, uint8_t value) {
+    // Starts a sample on every rising edge, the UFO also stops on a falling one
+    uint8_t old = port == 3 ? mixer->port3 : mixer->port5;
+    int first = port == 3 ? 0 : 4;
+    int bits = port == 3 ? 4 : 5;
+    for (int bit = 0; bit < bits; bit++) {
+        int sound = first + bit;
+        uint8_t mask = 1 << bit;
+        if ((value & mask) && !(old & mask)) {
+            mixer->playing[sound] = 1;
+            mixer->position[sound] = 0;
+        } else if (sound == MIXER_UFO && !(value & mask) && (old & mask)) {
+            mixer->playing[sound] = 0;
+        }
+    }
+    if (port == 3) {
+        mixer->port3 = value;
+    } else {
+        mixer->port5 = value;
+    }
+}
+
+static void MixerPush(Mixer *mixer, const int16_t *pcm, int count) {
+    // Hands samples to the audio device, dropping what doesn't fit
+    uint64_t head = atomic_load_explicit(&mixer->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&mixer->tail, memory_order_acquire);
+    uint64_t space = mixer->mask + 1 - (head - tail);
+    if ((uint64_t)count > space) {
+        mixer->overruns += count - space;
+        count = space;
+    }
+    for (int i = 0; i < count; i++) {
+        mixer->ring[(head + i) & mixer->mask] = pcm[i];
+    }
+    atomic_store_explicit(&mixer->head, head + count, memory_order_release);
+}
+
+static void MixerOutput(Mixer *mixer, uint64_t count) {
+    // Mixes count samples of the playing sounds
+    int16_t pcm[MIXER_BLOCK];
+    while (count > 0) {
+        int n = count < MIXER_BLOCK ? count : MIXER_BLOCK;
+        int32_t acc[MIXER_BLOCK] = { 0 };
+        for (int s = 0; s < MIXER_SOUNDS; s++) {
+            const MixerSample *sample = &mixer->sounds[s];
+            if (!mixer->playing[s] || sample->length == 0) {
+                continue;
+            }
+            uint32_t pos = mixer->position[s];
+            for (int i = 0; i < n; i++) {
+                if (pos == sample->length) {
+                    if (s != MIXER_UFO) {
+                        mixer->playing[s] = 0;
+                        break;
+                    }
+                    pos = 0;
+                }
+                acc[i] += sample->data[pos++];
+            }
+            mixer->position[s] = pos;
+        }
+        for (int i = 0; i < n; i++) {
+            pcm[i] = acc[i] > INT16_MAX ? INT16_MAX : acc[i] < INT16_MIN ? INT16_MIN : acc[i];
+        }
+
+        if (mixer->wav) {
+            fwrite(pcm, sizeof(int16_t), n, mixer->wav);        // WAV is little endian, as is every host we run on
+            mixer->wav_samples += n;
+        }
+        if (mixer->ring) {
+            MixerPush(mixer, pcm, n);
+        }
+        mixer->sample += n;
+        count -= n;
+    }
+}
+
+static inline uint64_t MixerSampleAt(uint64_t cycle) {
+    return cycle * MIXER_RATE / INVADERS_CLOCK;
+}
+
+static void MixerAdvance(Mixer *mixer, uint64_t cycle) {
+    // Renders up to the sample cycle falls in. Going backwards or jumping
+    // more than a second (a restored snapshot) resynchronizes instead.
+    uint64_t target = MixerSampleAt(cycle);
+    if (target < mixer->sample || target - mixer->sample > MIXER_RATE) {
+        mixer->sample = target;
+        return;
+    }
+    MixerOutput(mixer, target - mixer->sample);
+}
+
+void MixerRender(Mixer *mixer, uint64_t cycle) {
+    // Plays back the queued port writes and renders audio up to cycle
+    for (int i = 0; i < mixer->event_count; i++) {
+        MixerAdvance(mixer, mixer->events[i].cycle);
+        MixerTrigger(mixer, mixer->events[i].port, mixer->events[i].value);
+    }
+    mixer->event_count = 0;
+    MixerAdvance(mixer, cycle);
+}
+
+void MixerWrite(Mixer *mixer, uint64_t cycle, uint8_t port, uint8_t value) {
+    // Queues a write to port 3 or 5 made at the given emulated cycle
+    if (mixer->event_count == MIXER_MAX_EVENTS) {
+        MixerRender(mixer, cycle);
+    }
+    MixerEvent *e = &mixer->events[mixer->event_count++];
+    e->cycle = cycle;
+    e->port = port;
+    e->value = value;
+}
+
+size_t MixerRead(Mixer *mixer, int16_t *out, size_t count) {
+    // Audio thread side: fills out with count samples, silence past what has
+    // been rendered. Returns the number of rendered samples.
+    uint64_t tail = atomic_load_explicit(&mixer->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&mixer->head, memory_order_acquire);
+    size_t n = head - tail < count ? head - tail : count;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = mixer->ring[(tail + i) & mixer->mask];
+    }
+    memset(out + n, 0, (count - n) * sizeof(int16_t));
+    mixer->underruns += count - n;
+    atomic_store_explicit(&mixer->tail, tail + n, memory_order_release);
+    return n;
+}
+
+void MixerFree(Mixer *mixer) {
+    // Finishes the WAV file, if any
+    if (mixer->wav) {
+        fseek(mixer->wav, 0, SEEK_SET);
+        WriteWavHeader(mixer->wav, mixer->wav_samples);
+        fclose(mixer->wav);
+    }
+    for (int i = 0; i < MIXER_SOUNDS; i++) {
+        free(mixer->sounds[i].data);
+    }
+    free(mixer->ring);
+    free(mixer);
+}
+
+#endif
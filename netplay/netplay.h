@@ -0,0 +1,316 @@
+#ifndef NETPLAY_H
+#define NETPLAY_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+    #include <sys/socket.h>
+#endif
+
+#include "../invaders/invaders.h"
+#include "../romset/romset.h"
+
+/* Rollback netplay for two machines over UDP.
+
+Both peers run the same machine from reset and exchange one input byte per
+frame. A frame never waits for the remote input: it runs with a prediction
+(the last input that arrived) and a snapshot of the machine is kept from
+before it. When a real input turns out different from the prediction the
+machine is restored to that frame and the frames since are run again with
+the corrected inputs, sound muted. A peer stops advancing only when it gets
+NETPLAY_MAX_ROLLBACK frames ahead of what it has heard from the other.
+
+Every packet carries all inputs the other side hasn't acknowledged, so lost
+packets need no retransmission logic, and a checksum of the newest frame
+both sides agree on to catch desyncs. NetplayNew and NetplayStep run a peer
+without the socket, carrying packets from NetplayPacket to NetplayReceive
+is up to the caller. */
+
+#define NETPLAY_MAGIC         "8NP1"
+#define NETPLAY_MAX_ROLLBACK  8                 // frames run on predictions before stalling
+#define NETPLAY_WINDOW        32                // frames of history, power of two > 3 * NETPLAY_MAX_ROLLBACK
+#define NETPLAY_MAX_INPUTS    (2 * NETPLAY_MAX_ROLLBACK)
+#define NETPLAY_PACKET_SIZE   (4 + 4 + 4 + 4 + 4 + 1 + NETPLAY_MAX_INPUTS)
+
+// A player's input uses the bit positions of input port 1
+#define NETPLAY_COIN    0x01
+#define NETPLAY_START2  0x02
+#define NETPLAY_START1  0x04
+#define NETPLAY_FIRE    0x10
+#define NETPLAY_LEFT    0x20
+#define NETPLAY_RIGHT   0x40
+#define NETPLAY_BUTTONS (NETPLAY_COIN | NETPLAY_START1 | NETPLAY_START2)
+#define NETPLAY_CONTROLS (NETPLAY_FIRE | NETPLAY_LEFT | NETPLAY_RIGHT)
+
+typedef struct Netplay {
+    Invaders            *m;
+    int                 player;                 // 0 or 1
+    int                 fd;
+#ifndef _WIN32
+    struct sockaddr_in  peer;
+#endif
+    uint32_t            frame;                  // next frame to run
+    uint32_t            confirmed;              // remote inputs known for frames below this
+    uint32_t            acked;                  // remote has our inputs below this
+    uint32_t            rollback;               // oldest frame run with a wrong prediction
+    uint8_t             local[NETPLAY_WINDOW];
+    uint8_t             remote[NETPLAY_WINDOW];
+    uint8_t             used[NETPLAY_WINDOW];   // remote input each frame was run with
+    uint32_t            checks[NETPLAY_WINDOW]; // Crc32 of the snapshot before each frame
+    InvadersSnapshot    snapshots[NETPLAY_WINDOW];
+    uint32_t            desync;                 // first frame the checksums differed, 0 if none
+    uint64_t            rollbacks;              // statistics
+    uint64_t            resimulated;
+    uint64_t            stalls;
+} Netplay;
+
+uint8_t NetplayInput(uint8_t port1, uint8_t port2) {
+    // Local input from the keyboard ports, either player's controls count
+    return (port1 & NETPLAY_BUTTONS) | ((port1 | port2) & NETPLAY_CONTROLS);
+}
+
+void NetplayApplyInputs(Invaders *m, uint8_t player1, uint8_t player2) {
+    // Either player can insert coins and start, player 2 moves with the
+    // second set of controls on port 2
+    m->input_port1 = 0x08 | (player1 & (NETPLAY_BUTTONS | NETPLAY_CONTROLS)) | (player2 & NETPLAY_BUTTONS);
+    m->input_port2 = (m->input_port2 & ~NETPLAY_CONTROLS) | (player2 & NETPLAY_CONTROLS);
+}
+
+static void NetplaySave(Netplay *np, uint32_t frame) {
+    InvadersSnapshot *s = &np->snapshots[frame % NETPLAY_WINDOW];
+    InvadersSave(np->m, s);
+    np->checks[frame % NETPLAY_WINDOW] = Crc32((const uint8_t *)s, sizeof(InvadersSnapshot));
+}
+
+static void NetplayRunFrame(Netplay *np, uint32_t frame) {
+    // Runs frame from its inputs, predicting the remote one if it isn't in yet
+    uint32_t i = frame % NETPLAY_WINDOW;
+    if (frame < np->confirmed) {
+        np->used[i] = np->remote[i];
+    } else {
+        np->used[i] = np->confirmed > 0 ? np->remote[(np->confirmed - 1) % NETPLAY_WINDOW] : 0;
+    }
+    NetplaySave(np, frame);
+    if (np->player == 0) {
+        NetplayApplyInputs(np->m, np->local[i], np->used[i]);
+    } else {
+        NetplayApplyInputs(np->m, np->used[i], np->local[i]);
+    }
+    InvadersRunFrame(np->m);
+}
+
+static void NetplayResimulate(Netplay *np) {
+    // Goes back to the first mispredicted frame and runs forward again
+    void (*sound)(Invaders *, uint8_t, uint8_t) = np->m->sound;
+    np->m->sound = NULL;
+    InvadersRestore(np->m, &np->snapshots[np->rollback % NETPLAY_WINDOW]);
+    for (uint32_t f = np->rollback; f < np->frame; f++) {
+        NetplayRunFrame(np, f);
+        np->resimulated++;
+    }
+    np->m->sound = sound;
+    np->rollbacks++;
+    np->rollback = UINT32_MAX;
+}
+
+static void PutNet32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t GetNet32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint32_t NetplaySyncFrame(const Netplay *np) {
+    // Newest frame whose snapshot only depends on confirmed inputs
+    return np->frame < np->confirmed ? np->frame : np->confirmed;
+}
+
+static void NetplayReceive(Netplay *np, const uint8_t *p, size_t size) {
+    // Packet: magic, first frame, count, our acked frame, sync frame, checksum, inputs
+    if (size < NETPLAY_PACKET_SIZE - NETPLAY_MAX_INPUTS || memcmp(p, NETPLAY_MAGIC, 4) != 0) {
+        return;
+    }
+    uint32_t first = GetNet32(p + 4);
+    uint32_t acked = GetNet32(p + 8);
+    uint32_t sync = GetNet32(p + 12);
+    uint32_t check = GetNet32(p + 16);
+    uint32_t count = p[20];
+    if (count > NETPLAY_MAX_INPUTS || size < NETPLAY_PACKET_SIZE - NETPLAY_MAX_INPUTS + count) {
+        return;
+    }
+
+    if (acked > np->acked && acked <= np->frame) {
+        np->acked = acked;
+    }
+    // Inputs are taken in order only, a later packet repeats anything missed
+    for (uint32_t f = first; f < first + count; f++) {
+        if (f != np->confirmed || f >= np->frame + NETPLAY_MAX_ROLLBACK * 2) {
+            continue;
+        }
+        uint32_t i = f % NETPLAY_WINDOW;
+        np->remote[i] = p[21 + f - first];
+        np->confirmed++;
+        if (f < np->frame && np->used[i] != np->remote[i] && f < np->rollback) {
+            np->rollback = f;
+        }
+    }
+    // Compare once our own snapshot of that frame is final
+    if (sync > 0 && sync <= NetplaySyncFrame(np) && sync + NETPLAY_WINDOW > np->frame &&
+        np->rollback > sync && sync < np->frame && np->checks[sync % NETPLAY_WINDOW] != check && np->desync == 0) {
+        np->desync = sync;
+        fprintf(stderr, "error: netplay desync at frame %u\n", sync);
+    }
+}
+
+static size_t NetplayPacket(const Netplay *np, uint8_t *p) {
+    // Writes the packet for the other side into p, NETPLAY_PACKET_SIZE
+    // bytes at most, and returns its size
+    uint32_t sync = NetplaySyncFrame(np);
+    uint32_t first = np->acked;
+    uint32_t count = np->frame - first;
+    if (count > NETPLAY_MAX_INPUTS) {       // can't happen with both sides stalling, but stay in bounds
+        first = np->frame - NETPLAY_MAX_INPUTS;
+        count = NETPLAY_MAX_INPUTS;
+    }
+    memcpy(p, NETPLAY_MAGIC, 4);
+    PutNet32(p + 4, first);
+    PutNet32(p + 8, np->confirmed);
+    PutNet32(p + 12, sync < np->frame ? sync : 0);
+    PutNet32(p + 16, np->checks[sync % NETPLAY_WINDOW]);
+    p[20] = count;
+    for (uint32_t i = 0; i < count; i++) {
+        p[21 + i] = np->local[(first + i) % NETPLAY_WINDOW];
+    }
+    return 21 + count;
+}
+
+Netplay* NetplayNew(Invaders *m, int player) {
+    // A peer without a socket, packets go through NetplayPacket and
+    // NetplayReceive. NetplayOpen adds the UDP socket.
+    Netplay *np = calloc(1, sizeof(Netplay));
+    np->m = m;
+    np->player = player;
+    np->fd = -1;
+    np->rollback = UINT32_MAX;
+    return np;
+}
+
+#ifndef _WIN32
+
+static void NetplaySend(Netplay *np) {
+    uint8_t p[NETPLAY_PACKET_SIZE];
+    size_t size = NetplayPacket(np, p);
+    sendto(np->fd, p, size, 0, (struct sockaddr *)&np->peer, sizeof(np->peer));
+}
+
+static void NetplayPoll(Netplay *np) {
+    uint8_t p[256];
+    ssize_t size;
+    while ((size = recv(np->fd, p, sizeof(p), 0)) > 0) {
+        NetplayReceive(np, p, size);
+    }
+}
+
+Netplay* NetplayOpen(Invaders *m, int player, int local_port, const char *peer) {
+    // Plays as player 0 or 1 on UDP local_port against peer ("address:port").
+    // m has to be at reset with the same ROMs on both sides. Returns NULL on failure.
+    char host[64];
+    const char *colon = strrchr(peer, ':');
+    if (colon == NULL || colon - peer >= (long)sizeof(host) || (player != 0 && player != 1)) {
+        fprintf(stderr, "error: netplay peer must be address:port\n");
+        return NULL;
+    }
+    memcpy(host, peer, colon - peer);
+    host[colon - peer] = '\0';
+
+    Netplay *np = NetplayNew(m, player);
+    np->peer.sin_family = AF_INET;
+    np->peer.sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &np->peer.sin_addr) != 1) {
+        fprintf(stderr, "error: %s is not an IPv4 address\n", host);
+        free(np);
+        return NULL;
+    }
+
+    np->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(local_port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (np->fd < 0 || bind(np->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("netplay");
+        if (np->fd >= 0) {
+            close(np->fd);
+        }
+        free(np);
+        return NULL;
+    }
+    fcntl(np->fd, F_SETFL, fcntl(np->fd, F_GETFL) | O_NONBLOCK);
+    return np;
+}
+
+void NetplayClose(Netplay *np) {
+    if (np->fd >= 0) {
+        close(np->fd);
+    }
+    free(np);
+}
+
+#else
+
+static void NetplaySend(Netplay *np) {
+}
+
+static void NetplayPoll(Netplay *np) {
+}
+
+Netplay* NetplayOpen(Invaders *m, int player, int local_port, const char *peer) {
+    printf("error: netplay is not available on Windows\n");
+    return NULL;
+}
+
+void NetplayClose(Netplay *np) {
+    free(np);
+}
+
+#endif
+
+int NetplayStep(Netplay *np, uint8_t input) {
+    // NetplayAdvance without the network: takes back mispredicted frames
+    // and runs the next one unless too far ahead of the remote player
+    if (np->rollback < np->frame) {
+        NetplayResimulate(np);
+    }
+    if (np->frame >= np->confirmed + NETPLAY_MAX_ROLLBACK) {
+        np->stalls++;
+        return 0;
+    }
+    np->local[np->frame % NETPLAY_WINDOW] = input;
+    NetplayRunFrame(np, np->frame);
+    np->frame++;
+    return 1;
+}
+
+int NetplayAdvance(Netplay *np, uint8_t input) {
+    // Runs the next frame with the local player's input. Returns 0 without
+    // running anything while too far ahead of the remote player; call again
+    // with the same input next tick.
+    NetplayPoll(np);
+    int ran = NetplayStep(np, input);
+    NetplaySend(np);
+    return ran;
+}
+
+#endif
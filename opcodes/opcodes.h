@@ -0,0 +1,374 @@
+#ifndef OPCODES_H
+#define OPCODES_H
+
+#include <stdint.h>
+
+/* Opcode metadata shared by the emulator, the disassembler and the analysis
+tools. OPCODE_LIST is the single source of truth: one row per opcode with
+mnemonic, operands, length, cycles (taken / not taken) and the flags it
+affects. The tables below are generated from it at compile time.
+Used http://www.emulator101.com/8080-by-opcode.html as a reference. */
+
+enum Mnemonic {
+    MN_NOP, MN_LXI, MN_STAX, MN_INX, MN_INR, MN_DCR, MN_MVI, MN_RLC, MN_DAD,
+    MN_LDAX, MN_DCX, MN_RRC, MN_RAL, MN_RAR, MN_SHLD, MN_DAA, MN_LHLD, MN_CMA,
+    MN_STA, MN_STC, MN_LDA, MN_CMC, MN_MOV, MN_HLT, MN_ADD, MN_ADC, MN_SUB, MN_SBB,
+    MN_ANA, MN_XRA, MN_ORA, MN_CMP, MN_RNZ, MN_POP, MN_JNZ, MN_JMP, MN_CNZ,
+    MN_PUSH, MN_ADI, MN_RST, MN_RZ, MN_RET, MN_JZ, MN_CZ, MN_CALL, MN_ACI, MN_RNC,
+    MN_JNC, MN_OUT, MN_CNC, MN_SUI, MN_RC, MN_JC, MN_IN, MN_CC, MN_SBI, MN_RPO,
+    MN_JPO, MN_XTHL, MN_CPO, MN_ANI, MN_RPE, MN_PCHL, MN_JPE, MN_XCHG, MN_CPE,
+    MN_XRI, MN_RP, MN_JP, MN_DI, MN_CP, MN_ORI, MN_RM, MN_SPHL, MN_JM, MN_EI,
+    MN_CM, MN_CPI,
+    MN_COUNT
+};
+
+enum OperandKind {
+    OP_NONE,
+    OP_B, OP_C, OP_D, OP_E, OP_H, OP_L, OP_M, OP_A,     // 8 bit registers (M is memory at HL)
+    OP_BC, OP_DE, OP_HL, OP_SP, OP_PSW,                 // register pairs
+    OP_D8,          // 8 bit immediate data
+    OP_D16,         // 16 bit immediate data
+    OP_A16,         // 16 bit address
+    OP_PORT,        // 8 bit IO port
+    OP_RST,         // restart vector number, taken from the opcode
+};
+
+// Flags written by an instruction
+#define FLAG_Z    0x01
+#define FLAG_S    0x02
+#define FLAG_P    0x04
+#define FLAG_CY   0x08
+#define FLAG_AC   0x10
+
+#define FLAGS_NONE    0
+#define FLAGS_CY      FLAG_CY
+#define FLAGS_ZSPA    (FLAG_Z | FLAG_S | FLAG_P | FLAG_AC)
+#define FLAGS_ZSPCA   (FLAG_Z | FLAG_S | FLAG_P | FLAG_CY | FLAG_AC)
+
+// Control flow, FLOW_CONDITIONAL is or'ed in for Jcc/Ccc/Rcc
+#define FLOW_NONE          0
+#define FLOW_JUMP          1
+#define FLOW_CALL          2
+#define FLOW_RST           3
+#define FLOW_RETURN        4
+#define FLOW_INDIRECT      5       // PCHL
+#define FLOW_HALT          6
+#define FLOW_CONDITIONAL   0x80
+#define FLOW_COND_JUMP     (FLOW_JUMP | FLOW_CONDITIONAL)
+#define FLOW_COND_CALL     (FLOW_CALL | FLOW_CONDITIONAL)
+#define FLOW_COND_RETURN   (FLOW_RETURN | FLOW_CONDITIONAL)
+
+//   opcode mnemonic operands  len cycles nt flags  flow
+#define OPCODE_LIST(X) \
+    X(0x00, NOP,  NONE, NONE, 1,  4,  4, NONE,  NONE         ) \
+    X(0x01, LXI,  BC,   D16,  3, 10, 10, NONE,  NONE         ) \
+    X(0x02, STAX, BC,   NONE, 1,  7,  7, NONE,  NONE         ) \
+    X(0x03, INX,  BC,   NONE, 1,  5,  5, NONE,  NONE         ) \
+    X(0x04, INR,  B,    NONE, 1,  5,  5, ZSPA,  NONE         ) \
+    X(0x05, DCR,  B,    NONE, 1,  5,  5, ZSPA,  NONE         ) \
+    X(0x06, MVI,  B,    D8,   2,  7,  7, NONE,  NONE         ) \
+    X(0x07, RLC,  NONE, NONE, 1,  4,  4, CY,    NONE         ) \
+    X(0x08, NOP,  NONE, NONE, 1,  4,  4, NONE,  NONE         ) \
+    X(0x09, DAD,  BC,   NONE, 1, 10, 10, CY,    NONE         ) \
+    X(0x0a, LDAX, BC,   NONE, 1,  7,  7, NONE,  NONE         ) \
+    X(0x0b, DCX,  BC,   NONE, 1,  5,  5, NONE,  NONE         ) \
+    X(0x0c, INR,  C,    NONE, 1,  5,  5, ZSPA,  NONE         ) \
+    X(0x0d, DCR,  C,    NONE, 1,  5,  5, ZSPA,  NONE         ) \
+    X(0x0e, MVI,  C,    D8,   2,  7,  7, NONE,  NONE         ) \
+    X(0x0f, RRC,  NONE, NONE, 1,  4,  4, CY,    NONE         ) \
+    X(0x10, NOP,  NONE, NONE, 1,  4,  4, NONE,  NONE         ) \
+    X(0x11, LXI,  DE,   D16,  3, 10, 10, NONE,  NONE         ) \
+    X(0x12, STAX, DE,   NONE, 1,  7,  7, NONE,  NONE         ) \
+    X(0x13, INX,  DE,   NONE, 1,  5,  5, NONE,  NONE         ) \
+    X(0x14, INR,  D,    NONE, 1,  5,  5, ZSPA,  NONE         ) \
+    X(0x15, DCR,  D,    NONE, 1,  5,  5, ZSPA,  NONE         ) \
+    X(0x16, MVI,  D,    D8,   2,  7,  7, NONE,  NONE         ) \
+    X(0x17, RAL,  NONE, NONE, 1,  4,  4, CY,    NONE         ) \
+    X(0x18, NOP,  NONE, NONE, 1,  4,  4, NONE,  NONE         ) \
+    X(0x19, DAD,  DE,   NONE, 1, 10, 10, CY,    NONE         ) \
+    X(0x1a, LDAX, DE,   NONE, 1,  7,  7, NONE,  NONE         ) \
+    X(0x1b, DCX,  DE,   NONE, 1,  5,  5, NONE,  NONE         ) \
+    X(0x1c, INR,  E,    NONE, 1,  5,  5, ZSPA,  NONE         ) \
+    X(0x1d, DCR,  E,    NONE, 1,  5,  5, ZSPA,  NONE         ) \
+    X(0x1e, MVI,  E,    D8,   2,  7,  7, NONE,  NONE         ) \
+    X(0x1f, RAR,  NONE, NONE, 1,  4,  4, CY,    NONE         ) \
+    X(0x20, NOP,  NONE, NONE, 1,  4,  4, NONE,  NONE         ) \
+    X(0x21, LXI,  HL,   D16,  3, 10, 10, NONE,  NONE         ) \
+    X(0x22, SHLD, A16,  NONE, 3, 16, 16, NONE,  NONE         ) \
+    X(0x23, INX,  HL,   NONE, 1,  5,  5, NONE,  NONE         ) \
+    X(0x24, INR,  H,    NONE, 1,  5,  5, ZSPA,  NONE         ) \
+    X(0x25, DCR,  H,    NONE, 1,  5,  5, ZSPA,  NONE         ) \
+    X(0x26, MVI,  H,    D8,   2,  7,  7, NONE,  NONE         ) \
+    X(0x27, DAA,  NONE, NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x28, NOP,  NONE, NONE, 1,  4,  4, NONE,  NONE         ) \
+    X(0x29, DAD,  HL,   NONE, 1, 10, 10, CY,    NONE         ) \
+    X(0x2a, LHLD, A16,  NONE, 3, 16, 16, NONE,  NONE         ) \
+    X(0x2b, DCX,  HL,   NONE, 1,  5,  5, NONE,  NONE         ) \
+    X(0x2c, INR,  L,    NONE, 1,  5,  5, ZSPA,  NONE         ) \
+    X(0x2d, DCR,  L,    NONE, 1,  5,  5, ZSPA,  NONE         ) \
+    X(0x2e, MVI,  L,    D8,   2,  7,  7, NONE,  NONE         ) \
+    X(0x2f, CMA,  NONE, NONE, 1,  4,  4, NONE,  NONE         ) \
+    X(0x30, NOP,  NONE, NONE, 1,  4,  4, NONE,  NONE         ) \
+    X(0x31, LXI,  SP,   D16,  3, 10, 10, NONE,  NONE         ) \
+    X(0x32, STA,  A16,  NONE, 3, 13, 13, NONE,  NONE         ) \
+    X(0x33, INX,  SP,   NONE, 1,  5,  5, NONE,  NONE         ) \
+    X(0x34, INR,  M,    NONE, 1, 10, 10, ZSPA,  NONE         ) \
+    X(0x35, DCR,  M,    NONE, 1, 10, 10, ZSPA,  NONE         ) \
+    X(0x36, MVI,  M,    D8,   2, 10, 10, NONE,  NONE         ) \
+    X(0x37, STC,  NONE, NONE, 1,  4,  4, CY,    NONE         ) \
+    X(0x38, NOP,  NONE, NONE, 1,  4,  4, NONE,  NONE         ) \
+    X(0x39, DAD,  SP,   NONE, 1, 10, 10, CY,    NONE         ) \
+    X(0x3a, LDA,  A16,  NONE, 3, 13, 13, NONE,  NONE         ) \
+    X(0x3b, DCX,  SP,   NONE, 1,  5,  5, NONE,  NONE         ) \
+    X(0x3c, INR,  A,    NONE, 1,  5,  5, ZSPA,  NONE         ) \
+    X(0x3d, DCR,  A,    NONE, 1,  5,  5, ZSPA,  NONE         ) \
+    X(0x3e, MVI,  A,    D8,   2,  7,  7, NONE,  NONE         ) \
+    X(0x3f, CMC,  NONE, NONE, 1,  4,  4, CY,    NONE         ) \
+    X(0x40, MOV,  B,    B,    1,  5,  5, NONE,  NONE         ) \
+    X(0x41, MOV,  B,    C,    1,  5,  5, NONE,  NONE         ) \
+    X(0x42, MOV,  B,    D,    1,  5,  5, NONE,  NONE         ) \
+    X(0x43, MOV,  B,    E,    1,  5,  5, NONE,  NONE         ) \
+    X(0x44, MOV,  B,    H,    1,  5,  5, NONE,  NONE         ) \
+    X(0x45, MOV,  B,    L,    1,  5,  5, NONE,  NONE         ) \
+    X(0x46, MOV,  B,    M,    1,  7,  7, NONE,  NONE         ) \
+    X(0x47, MOV,  B,    A,    1,  5,  5, NONE,  NONE         ) \
+    X(0x48, MOV,  C,    B,    1,  5,  5, NONE,  NONE         ) \
+    X(0x49, MOV,  C,    C,    1,  5,  5, NONE,  NONE         ) \
+    X(0x4a, MOV,  C,    D,    1,  5,  5, NONE,  NONE         ) \
+    X(0x4b, MOV,  C,    E,    1,  5,  5, NONE,  NONE         ) \
+    X(0x4c, MOV,  C,    H,    1,  5,  5, NONE,  NONE         ) \
+    X(0x4d, MOV,  C,    L,    1,  5,  5, NONE,  NONE         ) \
+    X(0x4e, MOV,  C,    M,    1,  7,  7, NONE,  NONE         ) \
+    X(0x4f, MOV,  C,    A,    1,  5,  5, NONE,  NONE         ) \
+    X(0x50, MOV,  D,    B,    1,  5,  5, NONE,  NONE         ) \
+    X(0x51, MOV,  D,    C,    1,  5,  5, NONE,  NONE         ) \
+    X(0x52, MOV,  D,    D,    1,  5,  5, NONE,  NONE         ) \
+    X(0x53, MOV,  D,    E,    1,  5,  5, NONE,  NONE         ) \
+    X(0x54, MOV,  D,    H,    1,  5,  5, NONE,  NONE         ) \
+    X(0x55, MOV,  D,    L,    1,  5,  5, NONE,  NONE         ) \
+    X(0x56, MOV,  D,    M,    1,  7,  7, NONE,  NONE         ) \
+    X(0x57, MOV,  D,    A,    1,  5,  5, NONE,  NONE         ) \
+    X(0x58, MOV,  E,    B,    1,  5,  5, NONE,  NONE         ) \
+    X(0x59, MOV,  E,    C,    1,  5,  5, NONE,  NONE         ) \
+    X(0x5a, MOV,  E,    D,    1,  5,  5, NONE,  NONE         ) \
+    X(0x5b, MOV,  E,    E,    1,  5,  5, NONE,  NONE         ) \
+    X(0x5c, MOV,  E,    H,    1,  5,  5, NONE,  NONE         ) \
+    X(0x5d, MOV,  E,    L,    1,  5,  5, NONE,  NONE         ) \
+    X(0x5e, MOV,  E,    M,    1,  7,  7, NONE,  NONE         ) \
+    X(0x5f, MOV,  E,    A,    1,  5,  5, NONE,  NONE         ) \
+    X(0x60, MOV,  H,    B,    1,  5,  5, NONE,  NONE         ) \
+    X(0x61, MOV,  H,    C,    1,  5,  5, NONE,  NONE         ) \
+    X(0x62, MOV,  H,    D,    1,  5,  5, NONE,  NONE         ) \
+    X(0x63, MOV,  H,    E,    1,  5,  5, NONE,  NONE         ) \
+    X(0x64, MOV,  H,    H,    1,  5,  5, NONE,  NONE         ) \
+    X(0x65, MOV,  H,    L,    1,  5,  5, NONE,  NONE         ) \
+    X(0x66, MOV,  H,    M,    1,  7,  7, NONE,  NONE         ) \
+    X(0x67, MOV,  H,    A,    1,  5,  5, NONE,  NONE         ) \
+    X(0x68, MOV,  L,    B,    1,  5,  5, NONE,  NONE         ) \
+    X(0x69, MOV,  L,    C,    1,  5,  5, NONE,  NONE         ) \
+    X(0x6a, MOV,  L,    D,    1,  5,  5, NONE,  NONE         ) \
+    X(0x6b, MOV,  L,    E,    1,  5,  5, NONE,  NONE         ) \
+    X(0x6c, MOV,  L,    H,    1,  5,  5, NONE,  NONE         ) \
+    X(0x6d, MOV,  L,    L,    1,  5,  5, NONE,  NONE         ) \
+    X(0x6e, MOV,  L,    M,    1,  7,  7, NONE,  NONE         ) \
+    X(0x6f, MOV,  L,    A,    1,  5,  5, NONE,  NONE         ) \
+    X(0x70, MOV,  M,    B,    1,  7,  7, NONE,  NONE         ) \
+    X(0x71, MOV,  M,    C,    1,  7,  7, NONE,  NONE         ) \
+    X(0x72, MOV,  M,    D,    1,  7,  7, NONE,  NONE         ) \
+    X(0x73, MOV,  M,    E,    1,  7,  7, NONE,  NONE         ) \
+    X(0x74, MOV,  M,    H,    1,  7,  7, NONE,  NONE         ) \
+    X(0x75, MOV,  M,    L,    1,  7,  7, NONE,  NONE         ) \
+    X(0x76, HLT,  NONE, NONE, 1,  7,  7, NONE,  HALT         ) \
+    X(0x77, MOV,  M,    A,    1,  7,  7, NONE,  NONE         ) \
+    X(0x78, MOV,  A,    B,    1,  5,  5, NONE,  NONE         ) \
+    X(0x79, MOV,  A,    C,    1,  5,  5, NONE,  NONE         ) \
+    X(0x7a, MOV,  A,    D,    1,  5,  5, NONE,  NONE         ) \
+    X(0x7b, MOV,  A,    E,    1,  5,  5, NONE,  NONE         ) \
+    X(0x7c, MOV,  A,    H,    1,  5,  5, NONE,  NONE         ) \
+    X(0x7d, MOV,  A,    L,    1,  5,  5, NONE,  NONE         ) \
+    X(0x7e, MOV,  A,    M,    1,  7,  7, NONE,  NONE         ) \
+    X(0x7f, MOV,  A,    A,    1,  5,  5, NONE,  NONE         ) \
+    X(0x80, ADD,  B,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x81, ADD,  C,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x82, ADD,  D,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x83, ADD,  E,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x84, ADD,  H,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x85, ADD,  L,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x86, ADD,  M,    NONE, 1,  7,  7, ZSPCA, NONE         ) \
+    X(0x87, ADD,  A,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x88, ADC,  B,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x89, ADC,  C,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x8a, ADC,  D,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x8b, ADC,  E,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x8c, ADC,  H,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x8d, ADC,  L,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x8e, ADC,  M,    NONE, 1,  7,  7, ZSPCA, NONE         ) \
+    X(0x8f, ADC,  A,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x90, SUB,  B,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x91, SUB,  C,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x92, SUB,  D,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x93, SUB,  E,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x94, SUB,  H,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x95, SUB,  L,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x96, SUB,  M,    NONE, 1,  7,  7, ZSPCA, NONE         ) \
+    X(0x97, SUB,  A,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x98, SBB,  B,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x99, SBB,  C,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x9a, SBB,  D,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x9b, SBB,  E,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x9c, SBB,  H,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x9d, SBB,  L,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0x9e, SBB,  M,    NONE, 1,  7,  7, ZSPCA, NONE         ) \
+    X(0x9f, SBB,  A,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xa0, ANA,  B,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xa1, ANA,  C,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xa2, ANA,  D,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xa3, ANA,  E,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xa4, ANA,  H,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xa5, ANA,  L,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xa6, ANA,  M,    NONE, 1,  7,  7, ZSPCA, NONE         ) \
+    X(0xa7, ANA,  A,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xa8, XRA,  B,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xa9, XRA,  C,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xaa, XRA,  D,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xab, XRA,  E,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xac, XRA,  H,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xad, XRA,  L,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xae, XRA,  M,    NONE, 1,  7,  7, ZSPCA, NONE         ) \
+    X(0xaf, XRA,  A,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xb0, ORA,  B,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xb1, ORA,  C,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xb2, ORA,  D,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xb3, ORA,  E,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xb4, ORA,  H,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xb5, ORA,  L,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xb6, ORA,  M,    NONE, 1,  7,  7, ZSPCA, NONE         ) \
+    X(0xb7, ORA,  A,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xb8, CMP,  B,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xb9, CMP,  C,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xba, CMP,  D,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xbb, CMP,  E,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xbc, CMP,  H,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xbd, CMP,  L,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xbe, CMP,  M,    NONE, 1,  7,  7, ZSPCA, NONE         ) \
+    X(0xbf, CMP,  A,    NONE, 1,  4,  4, ZSPCA, NONE         ) \
+    X(0xc0, RNZ,  NONE, NONE, 1, 11,  5, NONE,  COND_RETURN  ) \
+    X(0xc1, POP,  BC,   NONE, 1, 10, 10, NONE,  NONE         ) \
+    X(0xc2, JNZ,  A16,  NONE, 3, 10, 10, NONE,  COND_JUMP    ) \
+    X(0xc3, JMP,  A16,  NONE, 3, 10, 10, NONE,  JUMP         ) \
+    X(0xc4, CNZ,  A16,  NONE, 3, 17, 11, NONE,  COND_CALL    ) \
+    X(0xc5, PUSH, BC,   NONE, 1, 11, 11, NONE,  NONE         ) \
+    X(0xc6, ADI,  D8,   NONE, 2,  7,  7, ZSPCA, NONE         ) \
+    X(0xc7, RST,  RST,  NONE, 1, 11, 11, NONE,  RST          ) \
+    X(0xc8, RZ,   NONE, NONE, 1, 11,  5, NONE,  COND_RETURN  ) \
+    X(0xc9, RET,  NONE, NONE, 1, 10, 10, NONE,  RETURN       ) \
+    X(0xca, JZ,   A16,  NONE, 3, 10, 10, NONE,  COND_JUMP    ) \
+    X(0xcb, NOP,  NONE, NONE, 1, 10, 10, NONE,  NONE         ) \
+    X(0xcc, CZ,   A16,  NONE, 3, 17, 11, NONE,  COND_CALL    ) \
+    X(0xcd, CALL, A16,  NONE, 3, 17, 17, NONE,  CALL         ) \
+    X(0xce, ACI,  D8,   NONE, 2,  7,  7, ZSPCA, NONE         ) \
+    X(0xcf, RST,  RST,  NONE, 1, 11, 11, NONE,  RST          ) \
+    X(0xd0, RNC,  NONE, NONE, 1, 11,  5, NONE,  COND_RETURN  ) \
+    X(0xd1, POP,  DE,   NONE, 1, 10, 10, NONE,  NONE         ) \
+    X(0xd2, JNC,  A16,  NONE, 3, 10, 10, NONE,  COND_JUMP    ) \
+    X(0xd3, OUT,  PORT, NONE, 2, 10, 10, NONE,  NONE         ) \
+    X(0xd4, CNC,  A16,  NONE, 3, 17, 11, NONE,  COND_CALL    ) \
+    X(0xd5, PUSH, DE,   NONE, 1, 11, 11, NONE,  NONE         ) \
+    X(0xd6, SUI,  D8,   NONE, 2,  7,  7, ZSPCA, NONE         ) \
+    X(0xd7, RST,  RST,  NONE, 1, 11, 11, NONE,  RST          ) \
+    X(0xd8, RC,   NONE, NONE, 1, 11,  5, NONE,  COND_RETURN  ) \
+    X(0xd9, NOP,  NONE, NONE, 1, 10, 10, NONE,  NONE         ) \
+    X(0xda, JC,   A16,  NONE, 3, 10, 10, NONE,  COND_JUMP    ) \
+    X(0xdb, IN,   PORT, NONE, 2, 10, 10, NONE,  NONE         ) \
+    X(0xdc, CC,   A16,  NONE, 3, 17, 11, NONE,  COND_CALL    ) \
+    X(0xdd, NOP,  NONE, NONE, 1, 17, 17, NONE,  NONE         ) \
+    X(0xde, SBI,  D8,   NONE, 2,  7,  7, ZSPCA, NONE         ) \
+    X(0xdf, RST,  RST,  NONE, 1, 11, 11, NONE,  RST          ) \
+    X(0xe0, RPO,  NONE, NONE, 1, 11,  5, NONE,  COND_RETURN  ) \
+    X(0xe1, POP,  HL,   NONE, 1, 10, 10, NONE,  NONE         ) \
+    X(0xe2, JPO,  A16,  NONE, 3, 10, 10, NONE,  COND_JUMP    ) \
+    X(0xe3, XTHL, NONE, NONE, 1, 18, 18, NONE,  NONE         ) \
+    X(0xe4, CPO,  A16,  NONE, 3, 17, 11, NONE,  COND_CALL    ) \
+    X(0xe5, PUSH, HL,   NONE, 1, 11, 11, NONE,  NONE         ) \
+    X(0xe6, ANI,  D8,   NONE, 2,  7,  7, ZSPCA, NONE         ) \
+    X(0xe7, RST,  RST,  NONE, 1, 11, 11, NONE,  RST          ) \
+    X(0xe8, RPE,  NONE, NONE, 1, 11,  5, NONE,  COND_RETURN  ) \
+    X(0xe9, PCHL, NONE, NONE, 1,  5,  5, NONE,  INDIRECT     ) \
+    X(0xea, JPE,  A16,  NONE, 3, 10, 10, NONE,  COND_JUMP    ) \
+    X(0xeb, XCHG, NONE, NONE, 1,  5,  5, NONE,  NONE         ) \
+    X(0xec, CPE,  A16,  NONE, 3, 17, 11, NONE,  COND_CALL    ) \
+    X(0xed, NOP,  NONE, NONE, 1, 17, 17, NONE,  NONE         ) \
+    X(0xee, XRI,  D8,   NONE, 2,  7,  7, ZSPCA, NONE         ) \
+    X(0xef, RST,  RST,  NONE, 1, 11, 11, NONE,  RST          ) \
+    X(0xf0, RP,   NONE, NONE, 1, 11,  5, NONE,  COND_RETURN  ) \
+    X(0xf1, POP,  PSW,  NONE, 1, 10, 10, ZSPCA, NONE         ) \
+    X(0xf2, JP,   A16,  NONE, 3, 10, 10, NONE,  COND_JUMP    ) \
+    X(0xf3, DI,   NONE, NONE, 1,  4,  4, NONE,  NONE         ) \
+    X(0xf4, CP,   A16,  NONE, 3, 17, 11, NONE,  COND_CALL    ) \
+    X(0xf5, PUSH, PSW,  NONE, 1, 11, 11, NONE,  NONE         ) \
+    X(0xf6, ORI,  D8,   NONE, 2,  7,  7, ZSPCA, NONE         ) \
+    X(0xf7, RST,  RST,  NONE, 1, 11, 11, NONE,  RST          ) \
+    X(0xf8, RM,   NONE, NONE, 1, 11,  5, NONE,  COND_RETURN  ) \
+    X(0xf9, SPHL, NONE, NONE, 1,  5,  5, NONE,  NONE         ) \
+    X(0xfa, JM,   A16,  NONE, 3, 10, 10, NONE,  COND_JUMP    ) \
+    X(0xfb, EI,   NONE, NONE, 1,  4,  4, NONE,  NONE         ) \
+    X(0xfc, CM,   A16,  NONE, 3, 17, 11, NONE,  COND_CALL    ) \
+    X(0xfd, NOP,  NONE, NONE, 1, 17, 17, NONE,  NONE         ) \
+    X(0xfe, CPI,  D8,   NONE, 2,  7,  7, ZSPCA, NONE         ) \
+    X(0xff, RST,  RST,  NONE, 1, 11, 11, NONE,  RST          )
+
+typedef struct OpcodeInfo {
+    uint8_t     mnemonic;       // enum Mnemonic
+    uint8_t     operand[2];     // enum OperandKind
+    uint8_t     length;         // 1 to 3 bytes
+    uint8_t     cycles;         // cycles taken (branch taken for conditionals)
+    uint8_t     cycles_not_taken;
+    uint8_t     flags;          // FLAG_* bits written
+    uint8_t     flow;           // FLOW_*
+} OpcodeInfo;
+
+#ifndef CORE8080_LIBRARY
+
+const char *MNEMONIC_NAMES[MN_COUNT] = {
+    "NOP", "LXI", "STAX", "INX", "INR", "DCR", "MVI", "RLC", "DAD", "LDAX", "DCX",
+    "RRC", "RAL", "RAR", "SHLD", "DAA", "LHLD", "CMA", "STA", "STC", "LDA", "CMC",
+    "MOV", "HLT", "ADD", "ADC", "SUB", "SBB", "ANA", "XRA", "ORA", "CMP", "RNZ",
+    "POP", "JNZ", "JMP", "CNZ", "PUSH", "ADI", "RST", "RZ", "RET", "JZ", "CZ",
+    "CALL", "ACI", "RNC", "JNC", "OUT", "CNC", "SUI", "RC", "JC", "IN", "CC",
+    "SBI", "RPO", "JPO", "XTHL", "CPO", "ANI", "RPE", "PCHL", "JPE", "XCHG", "CPE",
+    "XRI", "RP", "JP", "DI", "CP", "ORI", "RM", "SPHL", "JM", "EI", "CM", "CPI",
+};
+
+const char *OPERAND_NAMES[] = {
+    "", "B", "C", "D", "E", "H", "L", "M", "A", "B", "D", "H", "SP", "PSW",
+};
+
+#define OPCODE_INFO_ENTRY(op, mn, o1, o2, len, cyc, nt, fl, flow) \
+    [op] = { MN_##mn, { OP_##o1, OP_##o2 }, len, cyc, nt, FLAGS_##fl, FLOW_##flow },
+
+const OpcodeInfo OPCODE_INFO[256] = {
+    OPCODE_LIST(OPCODE_INFO_ENTRY)
+};
+
+#define OPCODE_LENGTH_ENTRY(op, mn, o1, o2, len, cyc, nt, fl, flow)  [op] = len,
+
+// Length only, 256 bytes so it stays in cache for trace decoders and block builders
+const uint8_t OPCODE_LENGTH[256] = {
+    OPCODE_LIST(OPCODE_LENGTH_ENTRY)
+};
+
+#else
+
+// Compiled into libcore8080, see core/core8080.h
+extern const char *MNEMONIC_NAMES[MN_COUNT];
+extern const char *OPERAND_NAMES[];
+extern const OpcodeInfo OPCODE_INFO[256];
+extern const uint8_t OPCODE_LENGTH[256];
+
+#endif
+
+static inline int OpcodeLength(uint8_t opcode) {
+    return OPCODE_LENGTH[opcode];
+}
+
+#endif
@@ -0,0 +1,240 @@
+#ifndef ROMSET_H
+#define ROMSET_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+    // no mmap, the images are read into private buffers instead
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+#include "../memory/memory.h"
+
+/* ROM set loader.
+
+Each image of a set is listed in a manifest with its load address, exact
+size and CRC32. Images are mmapped read only and the bus pages point
+straight into the mapping, so nothing is copied and every machine (or
+process) using the set shares the same physical pages. AttachRomSet does
+the same for images already in memory, see embed/embed.h. */
+
+#define ROMSET_MAX_IMAGES  8
+
+typedef struct RomImage {
+    const char  *name;          // file name, relative to the set directory
+    uint16_t    address;        // load address, must be page aligned
+    uint32_t    size;           // exact file size in bytes
+    uint32_t    crc32;
+} RomImage;
+
+typedef struct RomSet {
+    int             count;
+    const RomImage  *manifest;
+    const uint8_t   *data[ROMSET_MAX_IMAGES];   // read only image contents
+    size_t          length[ROMSET_MAX_IMAGES];  // length of each mapping, 0 if not owned
+} RomSet;
+
+#ifndef CORE8080_LIBRARY
+
+// Space Invaders (Midway, 1978)
+const RomImage INVADERS_MANIFEST[4] = {
+    { "invaders.h", 0x0000, 0x800, 0x734f5ad8 },
+    { "invaders.g", 0x0800, 0x800, 0x6bfaca4a },
+    { "invaders.f", 0x1000, 0x800, 0x0ccead96 },
+    { "invaders.e", 0x1800, 0x800, 0x14e538b0 },
+};
+
+uint32_t Crc32(const uint8_t *data, size_t size) {
+    // Standard reflected CRC32 (polynomial 0xedb88320), table built on first use
+    static uint32_t table[256];
+    static int table_ready = 0;
+
+    if (!table_ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        table_ready = 1;
+    }
+
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffff;
+}
+
+const uint8_t* MapImageFile(const char *path, size_t *size, size_t *length) {
+    // Maps a whole file read only. Returns NULL on failure.
+#ifdef _WIN32
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    fseek(f, 0L, SEEK_END);
+    long fsize = ftell(f);
+    fseek(f, 0L, SEEK_SET);
+    if (fsize <= 0) {
+        fclose(f);
+        return NULL;
+    }
+
+    uint8_t *buffer = malloc(fsize);
+    if (fread(buffer, fsize, 1, f) != 1) {
+        free(buffer);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+
+    *size = fsize;
+    *length = fsize;
+    return buffer;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);      // the mapping keeps its own reference to the file
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    *size = st.st_size;
+    *length = st.st_size;
+    return data;
+#endif
+}
+
+void UnmapImageFile(const uint8_t *data, size_t length) {
+#ifdef _WIN32
+    free((void *)data);
+#else
+    munmap((void *)data, length);
+#endif
+}
+
+void FreeRomSet(RomSet *set) {
+    for (int i = 0; i < set->count; i++) {
+        if (set->data[i] && set->length[i]) {
+            UnmapImageFile(set->data[i], set->length[i]);
+        }
+        set->data[i] = NULL;
+    }
+    set->count = 0;
+}
+
+static int CheckRomImage(const RomImage *image, const char *path, const uint8_t *data, size_t size) {
+    // Placement, size and CRC32 of one image against its manifest entry
+    if ((image->address & PAGE_MASK) != 0 || (image->size & PAGE_MASK) != 0 ||
+        (uint32_t)image->address + image->size > 0x10000) {
+        fprintf(stderr, "error: %s does not fit on page boundaries at $%04x\n", image->name, image->address);
+        return -1;
+    }
+    if (size != image->size) {
+        fprintf(stderr, "error: %s is %zu bytes, expected %u\n", path, size, image->size);
+        return -1;
+    }
+    uint32_t crc = Crc32(data, size);
+    if (crc != image->crc32) {
+        fprintf(stderr, "error: %s has CRC32 %08x, expected %08x\n", path, crc, image->crc32);
+        return -1;
+    }
+    return 0;
+}
+
+int LoadRomSet(RomSet *set, const char *dir, const RomImage *manifest, int count) {
+    // Maps and verifies every image in the manifest.
+    // Returns 0 on success, -1 (with an error printed) on failure.
+    memset(set, 0, sizeof(RomSet));
+    if (count > ROMSET_MAX_IMAGES) {
+        fprintf(stderr, "error: ROM set has too many images (%d)\n", count);
+        return -1;
+    }
+    set->manifest = manifest;
+
+    for (int i = 0; i < count; i++) {
+        char path[1024];
+        size_t size = 0;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, manifest[i].name);
+        set->data[i] = MapImageFile(path, &size, &set->length[i]);
+        set->count = i + 1;
+        if (set->data[i] == NULL) {
+            fprintf(stderr, "error: Couldn't open %s\n", path);
+            FreeRomSet(set);
+            return -1;
+        }
+        if (CheckRomImage(&manifest[i], path, set->data[i], size) != 0) {
+            FreeRomSet(set);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int AttachRomSet(RomSet *set, const RomImage *manifest, const uint8_t *const *images, const size_t *sizes, int count) {
+    // Same as LoadRomSet for images already in memory, such as ones linked
+    // into the executable. They are verified but neither copied nor freed.
+    memset(set, 0, sizeof(RomSet));
+    if (count > ROMSET_MAX_IMAGES) {
+        fprintf(stderr, "error: ROM set has too many images (%d)\n", count);
+        return -1;
+    }
+    set->manifest = manifest;
+
+    for (int i = 0; i < count; i++) {
+        if (CheckRomImage(&manifest[i], manifest[i].name, images[i], sizes[i]) != 0) {
+            memset(set, 0, sizeof(RomSet));
+            return -1;
+        }
+        set->data[i] = images[i];
+        set->length[i] = 0;             // not ours to unmap
+    }
+    set->count = count;
+    return 0;
+}
+
+void BusMapRomSet(MemoryBus *bus, const RomSet *set) {
+    // Points the ROM pages of the bus straight at the mapped images
+    for (int i = 0; i < set->count; i++) {
+        const RomImage *image = &set->manifest[i];
+        BusMapROM(bus, image->address >> PAGE_SHIFT, image->size >> PAGE_SHIFT, set->data[i]);
+    }
+}
+
+#else
+
+// Compiled into libcore8080, see core/core8080.h
+extern const RomImage INVADERS_MANIFEST[4];
+uint32_t Crc32(const uint8_t *data, size_t size);
+const uint8_t* MapImageFile(const char *path, size_t *size, size_t *length);
+void UnmapImageFile(const uint8_t *data, size_t length);
+void FreeRomSet(RomSet *set);
+int LoadRomSet(RomSet *set, const char *dir, const RomImage *manifest, int count);
+int AttachRomSet(RomSet *set, const RomImage *manifest, const uint8_t *const *images, const size_t *sizes, int count);
+void BusMapRomSet(MemoryBus *bus, const RomSet *set);
+
+#endif
+
+#define INVADERS_MANIFEST_COUNT  (int)(sizeof(INVADERS_MANIFEST) / sizeof(INVADERS_MANIFEST[0]))
+
+#endif
@@ -0,0 +1,415 @@
+#ifndef SCALER_H
+#define SCALER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+    // no sysconf, ScalerThreads guesses
+#else
+    #include <unistd.h>
+#endif
+
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
+/* Pixel art upscaler for 32 bit frames.
+
+Modes are nearest neighbour by any integer factor and Scale2x / Scale3x /
+Scale4x (Scale2x applied twice). An optional scanline mask darkens the last
+output row of every source row. The frame is cut into horizontal bands of
+source rows that a small pool of worker threads scales in parallel, the
+calling thread takes the first band. With SSE2 the Scale2x, 2x/4x nearest
+and scanline loops work on 4 pixels at a time, the plain C versions are the
+reference and handle the edges. */
+
+#define SCALE_NEAREST  0
+#define SCALE_2X       1
+#define SCALE_3X       2
+#define SCALE_4X       3
+
+#define SCALER_MAX_THREADS  16
+#define SCANLINE_MASK       0x007f7f7f      // halves every color channel after a shift
+
+typedef struct ScaleJob {
+    const uint32_t  *src;
+    int             width;          // source size in pixels
+    int             height;
+    int             src_pitch;      // in pixels
+    uint32_t        *dst;
+    int             dst_pitch;      // in pixels
+    int             mode;           // SCALE_*
+    int             factor;         // output pixels per source pixel for this pass
+    int             scanlines;      // darken every scanline_period-th output row
+    int             scanline_period;
+} ScaleJob;
+
+typedef struct Scaler {
+    int                 threads;        // including the calling thread
+    pthread_t           worker[SCALER_MAX_THREADS];
+    pthread_mutex_t     lock;
+    pthread_cond_t      start;
+    pthread_cond_t      done;
+    uint64_t            generation;     // bumped for every pass
+    int                 pending;        // workers still busy with the pass
+    int                 stop;
+    ScaleJob            job;
+    uint32_t            *tmp;           // Scale4x intermediate frame
+    size_t              tmp_size;
+} Scaler;
+
+int ScaleFactor(int mode, int factor) {
+    // Output pixels per source pixel, factor only matters for SCALE_NEAREST
+    switch (mode) {
+        case SCALE_2X: return 2;
+        case SCALE_3X: return 3;
+        case SCALE_4X: return 4;
+    }
+    return factor < 1 ? 1 : factor;
+}
+
+/* Row kernels. Each one scales source row y into factor output rows. */
+
+static void NearestRowC(const ScaleJob *job, int y) {
+    const uint32_t *s = job->src + (size_t)y * job->src_pitch;
+    uint32_t *d = job->dst + (size_t)y * job->factor * job->dst_pitch;
+    int k = job->factor;
+
+    for (int x = 0; x < job->width; x++) {
+        for (int i = 0; i < k; i++) {
+            d[x * k + i] = s[x];
+        }
+    }
+    for (int i = 1; i < k; i++) {
+        memcpy(d + (size_t)i * job->dst_pitch, d, (size_t)job->width * k * sizeof(uint32_t));
+    }
+}
+
+static void NearestRow(const ScaleJob *job, int y) {
+#ifdef __SSE2__
+    if (job->factor == 2 || job->factor == 4) {
+        const uint32_t *s = job->src + (size_t)y * job->src_pitch;
+        uint32_t *d = job->dst + (size_t)y * job->factor * job->dst_pitch;
+        int k = job->factor;
+        int x = 0;
+
+        for (; x + 4 <= job->width; x += 4) {
+            __m128i p = _mm_loadu_si128((const __m128i *)&s[x]);
+            __m128i lo = _mm_unpacklo_epi32(p, p);          // p0 p0 p1 p1
+            __m128i hi = _mm_unpackhi_epi32(p, p);          // p2 p2 p3 p3
+            if (k == 2) {
+                _mm_storeu_si128((__m128i *)&d[x * 2], lo);
+                _mm_storeu_si128((__m128i *)&d[x * 2 + 4], hi);
+            } else {
+                _mm_storeu_si128((__m128i *)&d[x * 4], _mm_unpacklo_epi64(lo, lo));
+                _mm_storeu_si128((__m128i *)&d[x * 4 + 4], _mm_unpackhi_epi64(lo, lo));
+                _mm_storeu_si128((__m128i *)&d[x * 4 + 8], _mm_unpacklo_epi64(hi, hi));
+                _mm_storeu_si128((__m128i *)&d[x * 4 + 12], _mm_unpackhi_epi64(hi, hi));
+            }
+        }
+        for (; x < job->width; x++) {
+            for (int i = 0; i < k; i++) {
+                d[x * k + i] = s[x];
+            }
+        }
+        for (int i = 1; i < k; i++) {
+            memcpy(d + (size_t)i * job->dst_pitch, d, (size_t)job->width * k * sizeof(uint32_t));
+        }
+        return;
+    }
+#endif
+    NearestRowC(job, y);
+}
+
+static void Scale2xPixel(const uint32_t *above, const uint32_t *row, const uint32_t *below,
+                         int x, int width, uint32_t *d0, uint32_t *d1) {
+    //   A B C
+    //   D E F     E becomes  E0 E1
+    //   G H I                E2 E3
+    uint32_t b = above[x], h = below[x], e = row[x];
+    uint32_t d = row[x > 0 ? x - 1 : x];
+    uint32_t f = row[x < width - 1 ? x + 1 : x];
+
+    d0[x * 2]     = d == b && b != f && d != h ? d : e;
+    d0[x * 2 + 1] = b == f && b != d && f != h ? f : e;
+    d1[x * 2]     = d == h && d != b && h != f ? d : e;
+    d1[x * 2 + 1] = h == f && d != h && b != f ? f : e;
+}
+
+#ifndef __SSE2__
+static void Scale2xRowC(const ScaleJob *job, int y) {
+    const uint32_t *row = job->src + (size_t)y * job->src_pitch;
+    const uint32_t *above = y > 0 ? row - job->src_pitch : row;
+    const uint32_t *below = y < job->height - 1 ? row + job->src_pitch : row;
+    uint32_t *d0 = job->dst + (size_t)y * 2 * job->dst_pitch;
+    uint32_t *d1 = d0 + job->dst_pitch;
+
+    for (int x = 0; x < job->width; x++) {
+        Scale2xPixel(above, row, below, x, job->width, d0, d1);
+    }
+}
+#endif
+
+static void Scale2xRow(const ScaleJob *job, int y) {
+#ifdef __SSE2__
+    const uint32_t *row = job->src + (size_t)y * job->src_pitch;
+    const uint32_t *above = y > 0 ? row - job->src_pitch : row;
+    const uint32_t *below = y < job->height - 1 ? row + job->src_pitch : row;
+    uint32_t *d0 = job->dst + (size_t)y * 2 * job->dst_pitch;
+    uint32_t *d1 = d0 + job->dst_pitch;
+    int x = 1;
+
+    // The first and last pixel need clamped neighbours, the rest go 4 at a time
+    Scale2xPixel(above, row, below, 0, job->width, d0, d1);
+    for (; x + 4 < job->width; x += 4) {
+        __m128i b = _mm_loadu_si128((const __m128i *)&above[x]);
+        __m128i h = _mm_loadu_si128((const __m128i *)&below[x]);
+        __m128i d = _mm_loadu_si128((const __m128i *)&row[x - 1]);
+        __m128i e = _mm_loadu_si128((const __m128i *)&row[x]);
+        __m128i f = _mm_loadu_si128((const __m128i *)&row[x + 1]);
+
+        __m128i db = _mm_cmpeq_epi32(d, b);
+        __m128i bf = _mm_cmpeq_epi32(b, f);
+        __m128i dh = _mm_cmpeq_epi32(d, h);
+        __m128i hf = _mm_cmpeq_epi32(h, f);
+
+        // mask & ~x & ~y, then pick between the neighbour and e
+        __m128i c0 = _mm_andnot_si128(_mm_or_si128(bf, dh), db);
+        __m128i c1 = _mm_andnot_si128(_mm_or_si128(db, hf), bf);
+        __m128i c2 = _mm_andnot_si128(_mm_or_si128(db, hf), dh);
+        __m128i c3 = _mm_andnot_si128(_mm_or_si128(dh, bf), hf);
+        __m128i e0 = _mm_or_si128(_mm_and_si128(c0, d), _mm_andnot_si128(c0, e));
+        __m128i e1 = _mm_or_si128(_mm_and_si128(c1, f), _mm_andnot_si128(c1, e));
+        __m128i e2 = _mm_or_si128(_mm_and_si128(c2, d), _mm_andnot_si128(c2, e));
+        __m128i e3 = _mm_or_si128(_mm_and_si128(c3, f), _mm_andnot_si128(c3, e));
+
+        _mm_storeu_si128((__m128i *)&d0[x * 2], _mm_unpacklo_epi32(e0, e1));
+        _mm_storeu_si128((__m128i *)&d0[x * 2 + 4], _mm_unpackhi_epi32(e0, e1));
+        _mm_storeu_si128((__m128i *)&d1[x * 2], _mm_unpacklo_epi32(e2, e3));
+        _mm_storeu_si128((__m128i *)&d1[x * 2 + 4], _mm_unpackhi_epi32(e2, e3));
+    }
+    for (; x < job->width; x++) {
+        Scale2xPixel(above, row, below, x, job->width, d0, d1);
+    }
+#else
+    Scale2xRowC(job, y);
+#endif
+}
+
+static void Scale3xRow(const ScaleJob *job, int y) {
+    //   A B C                E0 E1 E2
+    //   D E F   E becomes    E3 E4 E5
+    //   G H I                E6 E7 E8
+    const uint32_t *row = job->src + (size_t)y * job->src_pitch;
+    const uint32_t *above = y > 0 ? row - job->src_pitch : row;
+    const uint32_t *below = y < job->height - 1 ? row + job->src_pitch : row;
+    uint32_t *d0 = job->dst + (size_t)y * 3 * job->dst_pitch;
+    uint32_t *d1 = d0 + job->dst_pitch;
+    uint32_t *d2 = d1 + job->dst_pitch;
+
+    for (int x = 0; x < job->width; x++) {
+        int l = x > 0 ? x - 1 : x;
+        int r = x < job->width - 1 ? x + 1 : x;
+        uint32_t a = above[l], b = above[x], c = above[r];
+        uint32_t d = row[l], e = row[x], f = row[r];
+        uint32_t g = below[l], h = below[x], i = below[r];
+
+        int db = d == b && b != f && d != h;
+        int bf = b == f && b != d && f != h;
+        int dh = d == h && d != b && h != f;
+        int hf = h == f && d != h && b != f;
+
+        d0[x * 3]     = db ? d : e;
+        d0[x * 3 + 1] = (db && e != c) || (bf && e != a) ? b : e;
+        d0[x * 3 + 2] = bf ? f : e;
+        d1[x * 3]     = (db && e != g) || (dh && e != a) ? d : e;
+        d1[x * 3 + 1] = e;
+        d1[x * 3 + 2] = (bf && e != i) || (hf && e != c) ? f : e;
+        d2[x * 3]     = dh ? d : e;
+        d2[x * 3 + 1] = (dh && e != i) || (hf && e != g) ? h : e;
+        d2[x * 3 + 2] = hf ? f : e;
+    }
+}
+
+static void DarkenRow(uint32_t *d, int width) {
+    int x = 0;
+#ifdef __SSE2__
+    __m128i mask = _mm_set1_epi32(SCANLINE_MASK);
+    for (; x + 4 <= width; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)&d[x]);
+        _mm_storeu_si128((__m128i *)&d[x], _mm_and_si128(_mm_srli_epi32(p, 1), mask));
+    }
+#endif
+    for (; x < width; x++) {
+        d[x] = (d[x] >> 1) & SCANLINE_MASK;
+    }
+}
+
+static void ScaleBand(const ScaleJob *job, int first, int last) {
+    // Scales source rows first to last - 1
+    for (int y = first; y < last; y++) {
+        switch (job->mode) {
+            case SCALE_2X: Scale2xRow(job, y); break;
+            case SCALE_3X: Scale3xRow(job, y); break;
+            default:       NearestRow(job, y); break;
+        }
+    }
+
+    if (job->scanlines) {
+        int out_width = job->width * job->factor;
+        for (int y = first * job->factor; y < last * job->factor; y++) {
+            if (y % job->scanline_period == job->scanline_period - 1) {
+                DarkenRow(job->dst + (size_t)y * job->dst_pitch, out_width);
+            }
+        }
+    }
+}
+
+static void ScaleShare(Scaler *s, int index) {
+    // Band index of the current job
+    int first = s->job.height * index / s->threads;
+    int last = s->job.height * (index + 1) / s->threads;
+    ScaleBand(&s->job, first, last);
+}
+
+typedef struct ScalerWorker {
+    Scaler  *scaler;
+    int     index;
+} ScalerWorker;
+
+static void* ScalerThread(void *arg) {
+    ScalerWorker *w = arg;
+    Scaler *s = w->scaler;
+    int index = w->index;
+    uint64_t seen = 0;
+    free(w);
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (s->generation == seen && !s->stop) {
+            pthread_cond_wait(&s->start, &s->lock);
+        }
+        if (s->stop) {
+            break;
+        }
+        seen = s->generation;
+        pthread_mutex_unlock(&s->lock);
+
+        ScaleShare(s, index);
+
+        pthread_mutex_lock(&s->lock);
+        if (--s->pending == 0) {
+            pthread_cond_signal(&s->done);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+int ScalerThreads(void) {
+    // A sensible pool size for this machine
+#ifdef _WIN32
+    int n = 2;
+#else
+    int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n < 1) {
+        n = 1;
+    }
+    return n > 4 ? 4 : n;
+}
+
+Scaler* ScalerNew(int threads) {
+    if (threads < 1) {
+        threads = 1;
+    } else if (threads > SCALER_MAX_THREADS) {
+        threads = SCALER_MAX_THREADS;
+    }
+
+    Scaler *s = calloc(1, sizeof(Scaler));
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->start, NULL);
+    pthread_cond_init(&s->done, NULL);
+
+    s->threads = 1;
+    for (int i = 1; i < threads; i++) {
+        ScalerWorker *w = malloc(sizeof(ScalerWorker));
+        w->scaler = s;
+        w->index = i;
+        if (pthread_create(&s->worker[i], NULL, ScalerThread, w) != 0) {
+            free(w);
+            break;
+        }
+        s->threads++;
+    }
+    return s;
+}
+
+void ScalerFree(Scaler *s) {
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->start);
+    pthread_mutex_unlock(&s->lock);
+    for (int i = 1; i < s->threads; i++) {
+        pthread_join(s->worker[i], NULL);
+    }
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->start);
+    pthread_cond_destroy(&s->done);
+    free(s->tmp);
+    free(s);
+}
+
+static void ScalePass(Scaler *s, const ScaleJob *job) {
+    // Runs one pass on every thread and waits for all bands
+    pthread_mutex_lock(&s->lock);
+    s->job = *job;
+    s->pending = s->threads - 1;
+    s->generation++;
+    pthread_cond_broadcast(&s->start);
+    pthread_mutex_unlock(&s->lock);
+
+    ScaleShare(s, 0);
+
+    pthread_mutex_lock(&s->lock);
+    while (s->pending > 0) {
+        pthread_cond_wait(&s->done, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void Scale(Scaler *s, const uint32_t *src, int width, int height, int src_pitch,
+           uint32_t *dst, int dst_pitch, int mode, int factor, int scanlines) {
+    // Scales width x height pixels of src into dst, which has to hold
+    // ScaleFactor(mode, factor) times as many in each direction. Pitches
+    // are in pixels.
+    int k = ScaleFactor(mode, factor);
+    ScaleJob job = { src, width, height, src_pitch, dst, dst_pitch, mode, k, scanlines && k > 1, k };
+
+    if (mode == SCALE_4X) {
+        // Scale2x into the intermediate frame, then Scale2x again
+        size_t size = (size_t)width * 2 * height * 2;
+        if (s->tmp_size < size) {
+            free(s->tmp);
+            s->tmp = malloc(size * sizeof(uint32_t));
+            s->tmp_size = size;
+        }
+        ScaleJob first = { src, width, height, src_pitch, s->tmp, width * 2, SCALE_2X, 2, 0, 2 };
+        ScalePass(s, &first);
+
+        job.src = s->tmp;
+        job.width = width * 2;
+        job.height = height * 2;
+        job.src_pitch = width * 2;
+        job.mode = SCALE_2X;
+        job.factor = 2;
+        job.scanline_period = 4;
+    }
+    ScalePass(s, &job);
+}
+
+#endif
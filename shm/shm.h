@@ -0,0 +1,158 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#ifndef _WIN32
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+#endif
+
+#include "../invaders/invaders.h"
+
+/* Framebuffer published in POSIX shared memory.
+
+The emulator copies every completed frame of 1bpp video RAM into a named
+segment (/dev/shm on Linux) behind a seqlock. The sequence number is odd
+while a frame is being written. Readers copy the frame out and retry if the
+sequence changed in between, so the writer never waits and readers never
+block each other. Any number of tools on the host can attach read only with
+SharedFrameAttach and poll with SharedFrameRead, or map the segment
+themselves using the layout below. */
+
+#define SHARED_FRAME_MAGIC    "8080SHM"
+#define SHARED_FRAME_VERSION  1
+#define SHARED_FRAME_RETRIES  1000
+
+typedef struct SharedFrame {
+    char                magic[8];
+    uint32_t            version;
+    uint32_t            size;           // sizeof(SharedFrame)
+    uint32_t            width;          // INVADERS_WIDTH
+    uint32_t            height;         // INVADERS_HEIGHT
+    _Atomic uint64_t    sequence;       // odd while the frame is being written
+    uint64_t            frame;          // machine frame count
+    uint64_t            timestamp;      // CLOCK_MONOTONIC nanoseconds when published
+    uint8_t             vram[INVADERS_VRAM_SIZE];   // as in the machine, see ConvertVideoRAM
+} SharedFrame;
+
+#ifndef _WIN32
+
+SharedFrame* SharedFrameCreate(const char *name) {
+    // Creates or replaces the segment name ("/invaders"), NULL on failure
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(SharedFrame)) != 0) {
+        perror("shared memory");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    SharedFrame *shared = mmap(NULL, sizeof(SharedFrame), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        perror("shared memory");
+        return NULL;
+    }
+    memset(shared, 0, sizeof(SharedFrame));
+    shared->version = SHARED_FRAME_VERSION;
+    shared->size = sizeof(SharedFrame);
+    shared->width = INVADERS_WIDTH;
+    shared->height = INVADERS_HEIGHT;
+    atomic_thread_fence(memory_order_release);
+    memcpy(shared->magic, SHARED_FRAME_MAGIC, 8);   // readers check the magic last
+    return shared;
+}
+
+const SharedFrame* SharedFrameAttach(const char *name) {
+    // Maps an existing segment read only, NULL if missing or another version
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        perror(name);
+        return NULL;
+    }
+    SharedFrame *shared = mmap(NULL, sizeof(SharedFrame), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        perror(name);
+        return NULL;
+    }
+    if (memcmp(shared->magic, SHARED_FRAME_MAGIC, 8) != 0 || shared->version != SHARED_FRAME_VERSION ||
+        shared->size != sizeof(SharedFrame)) {
+        fprintf(stderr, "error: %s is not a version %d shared frame\n", name, SHARED_FRAME_VERSION);
+        munmap(shared, sizeof(SharedFrame));
+        return NULL;
+    }
+    return shared;
+}
+
+void SharedFrameClose(const SharedFrame *shared) {
+    munmap((void *)shared, sizeof(SharedFrame));
+}
+
+void SharedFrameRemove(const char *name) {
+    shm_unlink(name);
+}
+
+#else
+
+SharedFrame* SharedFrameCreate(const char *name) {
+    printf("error: shared memory frames are not available on Windows\n");
+    return NULL;
+}
+
+const SharedFrame* SharedFrameAttach(const char *name) {
+    printf("error: shared memory frames are not available on Windows\n");
+    return NULL;
+}
+
+void SharedFrameClose(const SharedFrame *shared) {
+}
+
+void SharedFrameRemove(const char *name) {
+}
+
+#endif
+
+static inline void SharedFramePublish(SharedFrame *shared, const uint8_t *vram, uint64_t frame) {
+    // Writer side, never waits
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t seq = atomic_load_explicit(&shared->sequence, memory_order_relaxed);
+    atomic_store_explicit(&shared->sequence, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    shared->frame = frame;
+    shared->timestamp = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    memcpy(shared->vram, vram, INVADERS_VRAM_SIZE);
+    atomic_store_explicit(&shared->sequence, seq + 2, memory_order_release);
+}
+
+uint64_t SharedFrameRead(const SharedFrame *shared, uint8_t *vram, uint64_t *frame, uint64_t *timestamp) {
+    // Copies out the latest frame. Returns its sequence number, 0 if nothing
+    // was published yet or the writer kept getting in the way.
+    for (int i = 0; i < SHARED_FRAME_RETRIES; i++) {
+        uint64_t seq = atomic_load_explicit(&((SharedFrame *)shared)->sequence, memory_order_acquire);
+        if (seq == 0) {
+            return 0;
+        }
+        if (seq & 1) {
+            continue;
+        }
+        *frame = shared->frame;
+        *timestamp = shared->timestamp;
+        memcpy(vram, shared->vram, INVADERS_VRAM_SIZE);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&((SharedFrame *)shared)->sequence, memory_order_relaxed) == seq) {
+            return seq / 2;
+        }
+    }
+    return 0;
+}
+
+#endif
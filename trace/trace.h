@@ -0,0 +1,206 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../disassembler/disassembler.h"
+
+/* Binary execution trace.
+
+The emulation thread appends one fixed size record per instruction into a
+single producer / single consumer ring buffer (no locks, just two atomic
+counters). A background thread drains the ring into a file. If the writer
+falls behind the producer waits rather than dropping records, so a trace
+is always complete. DecodeTraceFile turns a trace back into text. */
+
+#define TRACE_MAGIC    "8080TRC"
+#define TRACE_VERSION  1
+
+#define TRACE_DEFAULT_CAPACITY  (1 << 16)     // records, must be a power of two
+
+typedef struct TraceRecord {
+    uint64_t    cycle;          // cycle count before the instruction
+    uint16_t    pc;
+    uint16_t    sp;
+    uint8_t     opcode;
+    uint8_t     operand[2];     // the following bytes, valid up to the instruction length
+    uint8_t     a, b, c, d, e, h, l;
+    uint8_t     flags;          // PSW layout: S Z 0 AC 0 P 1 CY
+    uint8_t     pad[3];
+} TraceRecord;                  // 24 bytes
+
+typedef struct Trace {
+    TraceRecord         *ring;
+    uint64_t            mask;           // capacity - 1
+    _Atomic uint64_t    head;           // next record to write, owned by the emulation thread
+    _Atomic uint64_t    tail;           // next record to flush, owned by the writer thread
+    uint64_t            cached_tail;    // producer's last view of tail
+    uint64_t            stalls;         // times the producer had to wait for the writer
+    _Atomic int         stop;
+    FILE                *file;
+    pthread_t           writer;
+} Trace;
+
+#ifndef CORE8080_LIBRARY
+
+static void TraceSleep(long ns) {
+    struct timespec ts = { 0, ns };
+    nanosleep(&ts, NULL);
+}
+
+static size_t TraceFlush(Trace *trace) {
+    // Writes everything currently in the ring, returns the number of records
+    uint64_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+    size_t count = head - tail;
+
+    while (tail != head) {
+        // Write up to the end of the ring, then wrap
+        uint64_t index = tail & trace->mask;
+        uint64_t run = trace->mask + 1 - index;
+        if (run > head - tail) {
+            run = head - tail;
+        }
+        fwrite(&trace->ring[index], sizeof(TraceRecord), run, trace->file);
+        tail += run;
+        atomic_store_explicit(&trace->tail, tail, memory_order_release);
+    }
+    return count;
+}
+
+static void* TraceWriterThread(void *arg) {
+    Trace *trace = arg;
+    while (!atomic_load_explicit(&trace->stop, memory_order_acquire)) {
+        if (TraceFlush(trace) == 0) {
+            TraceSleep(1000000);    // idle, check again in 1 ms
+        }
+    }
+    TraceFlush(trace);
+    return NULL;
+}
+
+Trace* TraceOpen(const char *filename, size_t capacity) {
+    // Starts recording into filename. capacity is rounded up to a power of two.
+    // Returns NULL if the file can't be created.
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "error: Couldn't create trace file %s\n", filename);
+        return NULL;
+    }
+
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    Trace *trace = calloc(1, sizeof(Trace));
+    trace->ring = malloc(size * sizeof(TraceRecord));
+    trace->mask = size - 1;
+    trace->file = f;
+
+    uint32_t header[2] = { TRACE_VERSION, sizeof(TraceRecord) };
+    fwrite(TRACE_MAGIC, 8, 1, f);
+    fwrite(header, sizeof(header), 1, f);
+
+    if (pthread_create(&trace->writer, NULL, TraceWriterThread, trace) != 0) {
+        fprintf(stderr, "error: Couldn't start trace writer\n");
+        fclose(f);
+        free(trace->ring);
+        free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+static inline TraceRecord* TraceReserve(Trace *trace) {
+    // Returns the slot for the next record, waiting while the ring is full
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    if (head - trace->cached_tail > trace->mask) {
+        trace->cached_tail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+        while (head - trace->cached_tail > trace->mask) {
+            trace->stalls++;
+            TraceSleep(100000);
+            trace->cached_tail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+        }
+    }
+    return &trace->ring[head & trace->mask];
+}
+
+static inline void TraceCommit(Trace *trace) {
+    // Publishes the record filled in after TraceReserve
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+uint64_t TraceClose(Trace *trace) {
+    // Flushes the remaining records, stops the writer and returns the record count
+    atomic_store_explicit(&trace->stop, 1, memory_order_release);
+    pthread_join(trace->writer, NULL);
+
+    uint64_t count = atomic_load(&trace->head);
+    fclose(trace->file);
+    free(trace->ring);
+    free(trace);
+    return count;
+}
+
+int DecodeTraceFile(const char *filename, FILE *out) {
+    // Prints one disassembled line with registers per record.
+    // Returns the number of records, or -1 if the file is not a trace.
+    char magic[8];
+    uint32_t header[2];
+
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "error: Couldn't open %s\n", filename);
+        return -1;
+    }
+    if (fread(magic, 8, 1, f) != 1 || memcmp(magic, TRACE_MAGIC, 8) != 0 ||
+        fread(header, sizeof(header), 1, f) != 1 ||
+        header[0] != TRACE_VERSION || header[1] != sizeof(TraceRecord)) {
+        fprintf(stderr, "error: %s is not a version %d trace\n", filename, TRACE_VERSION);
+        fclose(f);
+        return -1;
+    }
+
+    TraceRecord records[1024];
+    char line[128];
+    int total = 0;
+    size_t n;
+
+    while ((n = fread(records, sizeof(TraceRecord), 1024, f)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            const TraceRecord *r = &records[i];
+            uint8_t code[3] = { r->opcode, r->operand[0], r->operand[1] };
+            Instruction ins;
+
+            DecodeInstruction(code, r->pc, &ins);
+            FormatInstruction(&ins, line, 0, sizeof(line));
+            fprintf(out, "%12llu  %04x  %-20s %c%c%c%c%c  A $%02x B $%02x C $%02x D $%02x E $%02x H $%02x L $%02x SP %04x\n",
+                    (unsigned long long)r->cycle, r->pc, line,
+                    r->flags & 0x40 ? 'z' : '.', r->flags & 0x80 ? 's' : '.', r->flags & 0x04 ? 'p' : '.',
+                    r->flags & 0x01 ? 'c' : '.', r->flags & 0x10 ? 'a' : '.',
+                    r->a, r->b, r->c, r->d, r->e, r->h, r->l, r->sp);
+            total++;
+        }
+    }
+    fclose(f);
+    return total;
+}
+
+#else
+
+// Compiled into libcore8080, see core/core8080.h
+Trace* TraceOpen(const char *filename, size_t capacity);
+uint64_t TraceClose(Trace *trace);
+int DecodeTraceFile(const char *filename, FILE *out);
+
+#endif
+
+#endif
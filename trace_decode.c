@@ -0,0 +1,20 @@
+/* Prints a binary execution trace recorded with --trace as disassembly */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "./trace/trace.h"
+
+int main (int argc, char**argv)
+{
+    if (argc < 2) {
+        printf("usage: %s <trace file>\n", argv[0]);
+        return 1;
+    }
+
+    if (DecodeTraceFile(argv[1], stdout) < 0) {
+        return 1;
+    }
+    return 0;
+}